@@ -0,0 +1,110 @@
+#include "bandwidthschedule.h"
+#include <QRegularExpression>
+
+namespace {
+constexpr quint8 kAllDays = 0x7f;
+constexpr quint8 kWeekdays = 0x1f;
+constexpr quint8 kWeekends = 0x60;
+
+// Monday = 0, -1 if not a day name ("Mon", "monday", ...).
+int dayIndex(const QString& name) {
+    static const char* names[] = {"mon", "tue", "wed", "thu", "fri", "sat", "sun"};
+    QString n = name.trimmed().toLower();
+    if (n.length() < 3) return -1;
+    for (int i = 0; i < 7; ++i) {
+        if (n.startsWith(names[i])) return i;
+    }
+    return -1;
+}
+
+bool parseDays(const QString& text, quint8& days) {
+    QString t = text.toLower();
+    if (t == "daily" || t == "*") { days = kAllDays; return true; }
+    if (t == "weekdays") { days = kWeekdays; return true; }
+    if (t == "weekends") { days = kWeekends; return true; }
+    days = 0;
+    for (const QString& item : t.split(',', Qt::SkipEmptyParts)) {
+        QStringList ends = item.split('-');
+        int first = dayIndex(ends[0]);
+        int last = ends.size() == 2 ? dayIndex(ends[1]) : first;
+        if (first < 0 || last < 0 || ends.size() > 2) return false;
+        // Wraps around the week: "Fri-Mon".
+        for (int d = first;; d = (d + 1) % 7) {
+            days |= 1 << d;
+            if (d == last) break;
+        }
+    }
+    return days != 0;
+}
+
+// "2048", "512 KB/s", "2MB/s" or "unlimited", in KB/s.
+bool parseSpeed(const QString& text, double& kbps) {
+    if (text.compare("unlimited", Qt::CaseInsensitive) == 0) { kbps = 0; return true; }
+    static const QRegularExpression re("^(\\d+(?:\\.\\d+)?)\\s*([km]?)(?:b(?:/s)?)?$",
+                                       QRegularExpression::CaseInsensitiveOption);
+    QRegularExpressionMatch m = re.match(text.trimmed());
+    if (!m.hasMatch()) return false;
+    kbps = m.captured(1).toDouble();
+    if (m.captured(2).toLower() == "m") kbps *= 1024;
+    return true;
+}
+}
+
+bool ScheduleRule::covers(const QDateTime& when) const {
+    int today = when.date().dayOfWeek() - 1;
+    int yesterday = (today + 6) % 7;
+    QTime t = when.time();
+    bool onToday = days & (1 << today);
+    if (start == end) return onToday;
+    if (start < end) return onToday && t >= start && t < end;
+    // Overnight: the evening of one of its days or the morning after.
+    return (onToday && t >= start) || ((days & (1 << yesterday)) && t < end);
+}
+
+BandwidthSchedule BandwidthSchedule::parse(const QString& text, QStringList* errors) {
+    static const QRegularExpression separators("[;\\n]");
+    static const QRegularExpression space("\\s+");
+    static const QRegularExpression timeRange("^(\\d{1,2}:\\d{2})-(\\d{1,2}:\\d{2})$");
+
+    BandwidthSchedule schedule;
+    for (QString line : text.split(separators, Qt::SkipEmptyParts)) {
+        line = line.trimmed();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+        ScheduleRule rule;
+        rule.text = line;
+        QString problem;
+        QStringList words = line.split(space, Qt::SkipEmptyParts);
+        if (!parseDays(words.takeFirst(), rule.days)) problem = "unknown days";
+        for (const QString& word : words) {
+            if (!problem.isEmpty()) break;
+            QRegularExpressionMatch m = timeRange.match(word);
+            if (m.hasMatch()) {
+                rule.start = QTime::fromString(m.captured(1).rightJustified(5, '0'), "hh:mm");
+                rule.end = QTime::fromString(m.captured(2).rightJustified(5, '0'), "hh:mm");
+                if (!rule.start.isValid() || !rule.end.isValid()) problem = "bad time " + word;
+            } else if (word.startsWith("speed=", Qt::CaseInsensitive)) {
+                if (!parseSpeed(word.mid(6), rule.speedLimit)) problem = "bad speed " + word;
+            } else if (word.startsWith("active=", Qt::CaseInsensitive)) {
+                bool ok = false;
+                rule.maxActive = word.mid(7).toInt(&ok);
+                if (!ok || rule.maxActive < 1) problem = "bad count " + word;
+            } else {
+                problem = "unknown " + word;
+            }
+        }
+        if (problem.isEmpty() && rule.speedLimit < 0 && rule.maxActive == 0) problem = "changes nothing";
+        if (!problem.isEmpty()) {
+            if (errors) errors->append(line + ": " + problem);
+            continue;
+        }
+        schedule.m_rules.append(rule);
+    }
+    return schedule;
+}
+
+const ScheduleRule* BandwidthSchedule::ruleAt(const QDateTime& when) const {
+    for (const auto& rule : m_rules) {
+        if (rule.covers(when)) return &rule;
+    }
+    return nullptr;
+}
@@ -0,0 +1,47 @@
+#ifndef BANDWIDTHSCHEDULE_H
+#define BANDWIDTHSCHEDULE_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QTime>
+#include <QDateTime>
+
+// One rule of the weekly schedule: on its days, between start and end,
+// the speed limit or the number of active downloads (or both) differ
+// from the defaults. A rule whose end is not after its start runs past
+// midnight into the next day; equal times mean the whole day.
+struct ScheduleRule {
+    quint8 days = 0;         // bit 0 = Monday ... bit 6 = Sunday
+    QTime start{0, 0};
+    QTime end{0, 0};
+    double speedLimit = -1;  // KB/s, 0 = unlimited, -1 = the default
+    int maxActive = 0;       // 0 = the default
+    QString text;            // as written
+
+    bool covers(const QDateTime& when) const;
+};
+
+// The rules as kept in the "BandwidthSchedule" setting, one per line (or
+// separated by ';'), for example:
+//
+//     Mon-Fri 08:00-18:00 speed=2048
+//     Daily 22:00-07:00 active=20 speed=unlimited
+//
+// Days are Mon..Sun, ranges and lists of them ("Sat,Sun"), "Weekdays",
+// "Weekends" or "Daily"; the time range may be left out for the whole
+// day. The first rule that covers the moment wins.
+class BandwidthSchedule {
+public:
+    // Malformed rules are skipped and described in `errors`.
+    static BandwidthSchedule parse(const QString& text, QStringList* errors = nullptr);
+
+    bool isEmpty() const { return m_rules.isEmpty(); }
+    // The rule in effect at `when`, null if only the defaults are.
+    const ScheduleRule* ruleAt(const QDateTime& when) const;
+
+private:
+    QList<ScheduleRule> m_rules;
+};
+
+#endif
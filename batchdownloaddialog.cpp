@@ -10,6 +10,8 @@
 #include <QFile>
 #include <QTextStream>
 #include <QDir>
+#include <QFileInfo>
+#include <QRegularExpression>
 
 BatchDownloadDialog::BatchDownloadDialog(QWidget *parent) : QDialog(parent) {
     setupUI();
@@ -24,7 +26,7 @@ void BatchDownloadDialog::setupUI() {
     
     // Instructions
     QLabel* instructions = new QLabel(
-        "Enter URLs (one per line) or load from a text file:"
+        "Enter URLs (one per line, optionally followed by a checksum and pieces=<manifest>) or load from a text file:"
     );
     instructions->setStyleSheet("color: #7aa2f7; font-weight: bold; font-size: 14px;");
     mainLayout->addWidget(instructions);
@@ -33,14 +35,17 @@ void BatchDownloadDialog::setupUI() {
     QHBoxLayout* textAreaLayout = new QHBoxLayout();
     
     m_urlTextEdit = new QTextEdit();
-    m_urlTextEdit->setPlaceholderText("https://example.com/file1.zip\nhttps://example.com/file2.iso\n...");
+    m_urlTextEdit->setPlaceholderText("https://example.com/file1.zip\nhttps://example.com/file2.iso sha256:9f86d08...\n...");
     textAreaLayout->addWidget(m_urlTextEdit, 1);
     
     QVBoxLayout* textBtnLayout = new QVBoxLayout();
     m_loadFileBtn = new QPushButton("Load from\nFile...");
     m_validateBtn = new QPushButton("Validate\nURLs");
+    m_checksumsBtn = new QPushButton("Load\nChecksums...");
+    m_checksumsBtn->setToolTip("A SHA256SUMS-style file; entries are matched by file name");
     textBtnLayout->addWidget(m_loadFileBtn);
     textBtnLayout->addWidget(m_validateBtn);
+    textBtnLayout->addWidget(m_checksumsBtn);
     textBtnLayout->addStretch();
     textAreaLayout->addLayout(textBtnLayout);
     
@@ -78,6 +83,7 @@ void BatchDownloadDialog::setupUI() {
     connect(m_loadFileBtn, &QPushButton::clicked, this, &BatchDownloadDialog::onLoadFromFile);
     connect(btnBrowse, &QPushButton::clicked, this, &BatchDownloadDialog::onBrowsePath);
     connect(m_validateBtn, &QPushButton::clicked, this, &BatchDownloadDialog::onValidateUrls);
+    connect(m_checksumsBtn, &QPushButton::clicked, this, &BatchDownloadDialog::onLoadChecksums);
     connect(buttons, &QDialogButtonBox::accepted, this, &BatchDownloadDialog::onAccepted);
     connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
 }
@@ -109,6 +115,25 @@ void BatchDownloadDialog::onLoadFromFile() {
     onValidateUrls(); // Auto-validate after loading
 }
 
+void BatchDownloadDialog::onLoadChecksums() {
+    QString filename = QFileDialog::getOpenFileName(
+        this,
+        "Select Checksum File",
+        QDir::homePath(),
+        "Checksum Files (*SUMS *.sha256 *.sha1 *.md5 *.txt);;All Files (*)"
+    );
+    
+    if (filename.isEmpty()) return;
+    
+    m_sums = Checksum::readSumsFile(filename);
+    if (m_sums.isEmpty()) {
+        QMessageBox::warning(this, "Error", "No checksums found in: " + filename);
+        return;
+    }
+    m_checksumsBtn->setText(QString("Checksums\n(%1)").arg(m_sums.size()));
+    onValidateUrls();
+}
+
 void BatchDownloadDialog::onBrowsePath() {
     QString dir = QFileDialog::getExistingDirectory(
         this,
@@ -123,6 +148,8 @@ void BatchDownloadDialog::onBrowsePath() {
 void BatchDownloadDialog::onValidateUrls() {
     m_urlList->clear();
     m_urls.clear();
+    m_checksums.clear();
+    m_pieces.clear();
     
     QString text = m_urlTextEdit->toPlainText();
     QStringList lines = text.split('\n', Qt::SkipEmptyParts);
@@ -131,10 +158,21 @@ void BatchDownloadDialog::onValidateUrls() {
         QString trimmed = line.trimmed();
         if (trimmed.isEmpty() || trimmed.startsWith('#')) continue; // Skip empty and comments
         
-        if (isValidUrl(trimmed)) {
-            m_urls.append(trimmed);
-            m_urlList->addItem(trimmed);
+        // "<url> [checksum] [pieces=<manifest>]"
+        QStringList fields = trimmed.split(QRegularExpression("\\s+"));
+        QString url = fields.first();
+        if (!isValidUrl(url)) continue;
+        for (int i = 1; i < fields.size(); ++i) {
+            if (fields.at(i).startsWith("pieces=")) {
+                m_pieces.insert(url, fields.at(i).mid(7));
+                continue;
+            }
+            Checksum checksum = Checksum::parse(fields.at(i));
+            if (checksum.isValid()) m_checksums.insert(url, checksum.toString());
         }
+        m_urls.append(url);
+        QString expected = getChecksum(url);
+        m_urlList->addItem(expected.isEmpty() ? url : url + "  [" + expected.section(':', 0, 0) + "]");
     }
     
     // Update label
@@ -171,6 +209,12 @@ bool BatchDownloadDialog::isValidUrl(const QString& url) const {
            (qurl.scheme() == "http" || qurl.scheme() == "https" || qurl.scheme() == "ftp");
 }
 
+QString BatchDownloadDialog::getChecksum(const QString& url) const {
+    if (m_checksums.contains(url)) return m_checksums.value(url);
+    QString name = QFileInfo(QUrl(url).path()).fileName();
+    return m_sums.contains(name) ? m_sums.value(name).toString() : QString();
+}
+
 QString BatchDownloadDialog::getSavePath() const {
     return m_pathEdit->text();
 }
@@ -6,6 +6,8 @@
 #include <QLineEdit>
 #include <QListWidget>
 #include <QPushButton>
+#include <QMap>
+#include "checksum.h"
 
 class BatchDownloadDialog : public QDialog {
     Q_OBJECT
@@ -14,9 +16,15 @@ public:
     
     QStringList getUrls() const { return m_urls; }
     QString getSavePath() const;
+    // Given on the URL's line ("<url> sha256:<hex>"), or found by file name
+    // in a loaded SHA256SUMS file; empty if neither.
+    QString getChecksum(const QString& url) const;
+    // Piece hash manifest from the URL's line ("pieces=<path or URL>").
+    QString getPieces(const QString& url) const { return m_pieces.value(url); }
 
 private slots:
     void onLoadFromFile();
+    void onLoadChecksums();
     void onBrowsePath();
     void onValidateUrls();
     void onAccepted();
@@ -30,7 +38,11 @@ private:
     QListWidget* m_urlList;
     QPushButton* m_loadFileBtn;
     QPushButton* m_validateBtn;
+    QPushButton* m_checksumsBtn;
     QStringList m_urls;
+    QMap<QString, QString> m_checksums;   // by URL, from the list itself
+    QMap<QString, QString> m_pieces;      // by URL, from the list itself
+    QMap<QString, Checksum> m_sums;       // by file name, from a sums file
 };
 
 #endif
@@ -0,0 +1,122 @@
+#include "bufferpool.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+// Blocks kept around for reuse once returned; beyond this they are freed
+// so an idle application does not sit on its peak.
+const size_t kMaxFreeBlocks = 8;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        m_data = other.m_data;
+        m_size = other.m_size;
+        other.m_data = nullptr;
+        other.m_size = 0;
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::reset() {
+    if (!m_data) return;
+    BufferPool::instance().release(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+BufferPool& BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::BufferPool()
+    : m_blockSize(4 * 1024 * 1024), m_cap(256LL * 1024 * 1024),
+      m_inUse(0), m_allocated(0), m_peak(0)
+{
+}
+
+BufferPool::~BufferPool() {
+    for (char* block : m_free) std::free(block);
+}
+
+void BufferPool::configure(size_t blockSize, qint64 capBytes) {
+    blockSize = std::clamp(blockSize, kMinBlockSize, kMaxBlockSize);
+    blockSize = (blockSize + kAlignment - 1) / kAlignment * kAlignment;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // A pool must hold at least one block or nothing could ever be written.
+    m_cap = std::max<qint64>(capBytes, blockSize);
+    if (blockSize != m_blockSize) {
+        for (char* block : m_free) std::free(block);
+        m_allocated -= (qint64)(m_free.size() * m_blockSize);
+        m_free.clear();
+        m_blockSize = blockSize;
+    }
+    while (!m_free.empty() && m_allocated > m_cap) {
+        std::free(m_free.back());
+        m_free.pop_back();
+        m_allocated -= m_blockSize;
+    }
+}
+
+BufferPool::Buffer BufferPool::acquire() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    char* block = nullptr;
+    if (!m_free.empty()) {
+        block = m_free.back();
+        m_free.pop_back();
+    } else {
+        if (m_allocated + (qint64)m_blockSize > m_cap) return Buffer();
+        block = static_cast<char*>(std::aligned_alloc(kAlignment, m_blockSize));
+        if (!block) return Buffer();
+        m_allocated += m_blockSize;
+    }
+    m_inUse += m_blockSize;
+    m_peak = std::max(m_peak, m_inUse);
+    return Buffer(block, m_blockSize);
+}
+
+void BufferPool::release(char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inUse -= size;
+    // Blocks of an older size, or beyond what is worth keeping, go back to
+    // the system.
+    if (size == m_blockSize && m_free.size() < kMaxFreeBlocks) {
+        m_free.push_back(data);
+        return;
+    }
+    std::free(data);
+    m_allocated -= size;
+}
+
+size_t BufferPool::blockSize() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_blockSize;
+}
+
+bool BufferPool::exhausted() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_free.empty() && m_allocated + (qint64)m_blockSize > m_cap;
+}
+
+qint64 BufferPool::capBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cap;
+}
+
+qint64 BufferPool::inUseBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_inUse;
+}
+
+qint64 BufferPool::allocatedBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_allocated;
+}
+
+qint64 BufferPool::peakBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak;
+}
@@ -0,0 +1,71 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QtGlobal>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+// Process-wide pool of page-aligned write buffers. Each connection collects
+// what curl hands it in one block and passes the block to the disk writer
+// when it fills, so the disk sees a few large aligned writes instead of
+// thousands of small ones. All blocks together never exceed the cap; a
+// connection that cannot get a block pauses until one comes back.
+class BufferPool {
+public:
+    // A block on loan from the pool; returned when destroyed.
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+        Buffer& operator=(Buffer&& other) noexcept;
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer() { reset(); }
+
+        char* data() const { return m_data; }
+        size_t capacity() const { return m_size; }
+        explicit operator bool() const { return m_data != nullptr; }
+        void reset();
+
+    private:
+        friend class BufferPool;
+        Buffer(char* data, size_t size) : m_data(data), m_size(size) {}
+        char* m_data = nullptr;
+        size_t m_size = 0;
+    };
+
+    static BufferPool& instance();
+
+    // Takes effect for blocks handed out from now on. blockSize is clamped
+    // to [kMinBlockSize, kMaxBlockSize] and rounded to kAlignment.
+    void configure(size_t blockSize, qint64 capBytes);
+    // An empty buffer when the cap is reached.
+    Buffer acquire();
+
+    size_t blockSize() const;
+    bool exhausted() const;
+    qint64 capBytes() const;
+    qint64 inUseBytes() const;     // blocks on loan
+    qint64 allocatedBytes() const; // on loan plus kept for reuse
+    qint64 peakBytes() const;
+
+    static constexpr size_t kAlignment = 4096; // O_DIRECT needs page alignment
+    static constexpr size_t kMinBlockSize = 1024 * 1024;
+    static constexpr size_t kMaxBlockSize = 8 * 1024 * 1024;
+
+private:
+    BufferPool();
+    ~BufferPool();
+    void release(char* data, size_t size);
+
+    mutable std::mutex m_mutex;
+    std::vector<char*> m_free; // all of size m_blockSize
+    size_t m_blockSize;
+    qint64 m_cap;
+    qint64 m_inUse;
+    qint64 m_allocated;
+    qint64 m_peak;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "checksum.h"
+#include "hashkernels.h"
+#include <QCryptographicHash>
+#include <QFile>
+#include <QRegularExpression>
+#include <QTextStream>
+
+namespace {
+struct AlgorithmInfo {
+    Checksum::Algorithm algorithm;
+    const char* name;
+    int hexLength;
+};
+
+const AlgorithmInfo kAlgorithms[] = {
+    {Checksum::Md5, "md5", 32},
+    {Checksum::Sha1, "sha1", 40},
+    {Checksum::Sha256, "sha256", 64},
+    {Checksum::Crc32c, "crc32c", 8},
+};
+
+bool isHex(const QString& s) {
+    static const QRegularExpression hex("^[0-9a-fA-F]+$");
+    return hex.match(s).hasMatch();
+}
+}
+
+QString Checksum::algorithmName(Algorithm algorithm) {
+    for (const auto& a : kAlgorithms) {
+        if (a.algorithm == algorithm) return a.name;
+    }
+    return QString();
+}
+
+QString Checksum::toString() const {
+    if (!isValid()) return QString();
+    return algorithmName(algorithm) + ":" + QString::fromLatin1(hex);
+}
+
+Checksum Checksum::parse(const QString& text) {
+    Checksum c;
+    QString s = text.trimmed();
+    QString name;
+    int sep = s.indexOf(QRegularExpression("[:=]"));
+    if (sep > 0) {
+        // "SHA-256:" and "sha256=" are common spellings too.
+        name = s.left(sep).toLower().remove('-');
+        s = s.mid(sep + 1).trimmed();
+    }
+    if (!isHex(s)) return c;
+    for (const auto& a : kAlgorithms) {
+        bool match = name.isEmpty() ? a.algorithm != Crc32c && s.size() == a.hexLength : name == a.name;
+        if (!match || s.size() != a.hexLength) continue;
+        c.algorithm = a.algorithm;
+        c.hex = s.toLower().toLatin1();
+        break;
+    }
+    return c;
+}
+
+QMap<QString, Checksum> Checksum::readSumsFile(const QString& path) {
+    QMap<QString, Checksum> sums;
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) return sums;
+    static const QRegularExpression gnu("^\\\\?([0-9a-fA-F]+) [ *](.+)$");
+    static const QRegularExpression bsd("^([A-Za-z0-9-]+) \\((.+)\\) = ([0-9a-fA-F]+)$");
+    QTextStream in(&f);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+        QRegularExpressionMatch m = bsd.match(line);
+        if (m.hasMatch()) {
+            Checksum c = parse(m.captured(1) + ":" + m.captured(3));
+            if (c.isValid()) sums.insert(m.captured(2), c);
+            continue;
+        }
+        m = gnu.match(line);
+        if (!m.hasMatch()) continue;
+        Checksum c = parse(m.captured(1));
+        // Names may carry a leading path: "./dir/file.iso".
+        QString name = m.captured(2);
+        name = name.mid(name.lastIndexOf('/') + 1);
+        if (c.isValid()) sums.insert(name, c);
+    }
+    return sums;
+}
+
+Digest::Digest(Checksum::Algorithm algorithm) : m_algorithm(algorithm), m_crc(0) {
+    switch (algorithm) {
+    case Checksum::Sha256:
+        m_sha256.reset(new Sha256());
+        break;
+    case Checksum::Sha1:
+        m_hash.reset(new QCryptographicHash(QCryptographicHash::Sha1));
+        break;
+    case Checksum::Md5:
+        m_hash.reset(new QCryptographicHash(QCryptographicHash::Md5));
+        break;
+    default:
+        break;
+    }
+}
+
+Digest::~Digest() = default;
+
+void Digest::addData(const char* data, size_t length) {
+    if (m_sha256) m_sha256->update(data, length);
+    else if (m_hash) m_hash->addData(QByteArray::fromRawData(data, (qsizetype)length));
+    else if (m_algorithm == Checksum::Crc32c) m_crc = Crc32c::extend(m_crc, data, length);
+}
+
+QByteArray Digest::hexResult() {
+    if (m_sha256) {
+        unsigned char digest[32];
+        m_sha256->final(digest);
+        return QByteArray(reinterpret_cast<const char*>(digest), sizeof(digest)).toHex();
+    }
+    if (m_hash) return m_hash->result().toHex();
+    if (m_algorithm == Checksum::Crc32c) return QByteArray::number(m_crc, 16).rightJustified(8, '0');
+    return QByteArray();
+}
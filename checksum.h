@@ -0,0 +1,47 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <memory>
+
+class QCryptographicHash;
+class Sha256;
+
+// The digest a download is expected to have, as given with its URL:
+// "sha256:<hex>" (or sha1, md5, crc32c), or bare hex whose length names
+// the algorithm. CRC32C always needs its prefix; eight hex digits alone
+// could just as well be a plain CRC32.
+struct Checksum {
+    enum Algorithm { None, Md5, Sha1, Sha256, Crc32c };
+    Algorithm algorithm = None;
+    QByteArray hex; // lowercase
+
+    bool isValid() const { return algorithm != None; }
+    QString toString() const; // "sha256:<hex>", empty if invalid
+
+    static Checksum parse(const QString& text);
+    static QString algorithmName(Algorithm algorithm);
+    // The entries of a SHA256SUMS-style file ("<hex>  <name>", "<hex> *<name>"
+    // or BSD "SHA256 (<name>) = <hex>"), by file name.
+    static QMap<QString, Checksum> readSumsFile(const QString& path);
+};
+
+// Incremental digest over bytes fed in order. SHA-256 and CRC32C run on
+// the hashkernels; SHA-1 and MD5 on QCryptographicHash.
+class Digest {
+public:
+    explicit Digest(Checksum::Algorithm algorithm);
+    ~Digest();
+    void addData(const char* data, size_t length);
+    QByteArray hexResult(); // once, after the last addData()
+
+private:
+    Checksum::Algorithm m_algorithm;
+    std::unique_ptr<Sha256> m_sha256;
+    std::unique_ptr<QCryptographicHash> m_hash;
+    quint32 m_crc;
+};
+
+#endif
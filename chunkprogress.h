@@ -7,6 +7,7 @@ struct ChunkProgress {
     double size;
     double startOffset;
     double totalFileSize; 
-    QString status;
+    QString status;   // last failure cause while the range is being retried
+    int retries = 0;
 };
 #endif
\ No newline at end of file
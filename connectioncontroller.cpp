@@ -0,0 +1,103 @@
+#include "connectioncontroller.h"
+#include <algorithm>
+
+namespace {
+// New connections need a moment to get out of TCP slow start before their
+// contribution can be judged.
+const int kWarmupSamples = 1;
+const int kMeasureSamples = 2;
+// An added connection must deliver at least this fraction of the average
+// per-connection rate to be worth keeping...
+const double kMinMarginalGain = 0.15;
+// ...and above this fraction the next probe adds twice as many.
+const double kStrongMarginalGain = 0.6;
+// Once settled, probe upwards again after this many samples in case the
+// link got better.
+const int kReprobeSamples = 30;
+const int kInitialConnections = 2;
+}
+
+ConnectionController::ConnectionController(int cap)
+    : m_phase(Measuring), m_cap(std::clamp(cap, 1, kMaxConnections)), m_ceiling(kMaxConnections),
+      m_target(std::min(kInitialConnections, m_cap)), m_step(1),
+      m_baseTarget(0), m_baseThroughput(0), m_sum(0), m_samples(0)
+{
+}
+
+void ConnectionController::setCap(int cap) {
+    m_cap = std::clamp(cap, 1, kMaxConnections);
+    if (m_target > m_cap) {
+        m_baseTarget = 0;
+        changeTarget(m_cap);
+    }
+}
+
+void ConnectionController::changeTarget(int target) {
+    m_target = std::max(1, std::min({target, m_cap, m_ceiling}));
+    m_phase = Measuring;
+    m_sum = 0;
+    m_samples = 0;
+}
+
+void ConnectionController::settle() {
+    m_phase = Settled;
+    m_baseTarget = 0;
+    m_step = 1;
+    m_samples = 0;
+}
+
+int ConnectionController::addSample(double throughput, int activeConnections) {
+    ++m_samples;
+    if (m_phase == Settled) {
+        if (m_samples >= kReprobeSamples) changeTarget(m_target);
+        return m_target;
+    }
+
+    if (m_samples <= kWarmupSamples) return m_target;
+    m_sum += throughput;
+    if (m_samples < kWarmupSamples + kMeasureSamples) return m_target;
+
+    evaluate(m_sum / kMeasureSamples, activeConnections);
+    return m_target;
+}
+
+void ConnectionController::evaluate(double level, int activeConnections) {
+    // The worker could not open as many connections as asked for (too little
+    // splittable data left), so this level says nothing about the link.
+    if (activeConnections < m_target) {
+        m_target = std::max(1, activeConnections);
+        settle();
+        return;
+    }
+
+    if (m_baseTarget > 0) {
+        // Judge the probe that moved us from m_baseTarget to m_target.
+        int added = m_target - m_baseTarget;
+        double perConnection = m_baseThroughput / m_baseTarget;
+        double marginal = (level - m_baseThroughput) / added;
+        double gain = perConnection > 0 ? marginal / perConnection : 1.0;
+
+        if (gain < kMinMarginalGain) {
+            // Plateau: the extra connections bought nothing, drop them.
+            m_target = m_baseTarget;
+            settle();
+            return;
+        }
+        m_step = (gain >= kStrongMarginalGain) ? m_step * 2 : 1;
+    }
+
+    if (m_target >= std::min(m_cap, m_ceiling)) {
+        settle();
+        return;
+    }
+
+    m_baseTarget = m_target;
+    m_baseThroughput = level;
+    changeTarget(m_target + m_step);
+}
+
+void ConnectionController::onRefused(int activeConnections) {
+    m_ceiling = std::max(1, std::min(m_ceiling, activeConnections));
+    m_target = std::min(m_target, m_ceiling);
+    settle();
+}
@@ -0,0 +1,45 @@
+#ifndef CONNECTIONCONTROLLER_H
+#define CONNECTIONCONTROLLER_H
+
+// Picks how many parallel connections a download should use from what the
+// link actually delivers. It starts small, keeps adding connections while
+// each addition still raises aggregate throughput, steps back when it stops
+// paying off, and lowers its ceiling whenever the server refuses one.
+class ConnectionController {
+public:
+    explicit ConnectionController(int cap = 8);
+
+    void setCap(int cap);
+    int cap() const { return m_cap; }
+    int target() const { return m_target; }
+
+    // Aggregate throughput (bytes/sec) over the last sampling interval, and
+    // the number of connections that were actually running during it.
+    // Returns the new target.
+    int addSample(double throughput, int activeConnections);
+
+    // The server rejected a connection (HTTP 429/503, refused connect).
+    void onRefused(int activeConnections);
+
+    static constexpr int kMaxConnections = 32;
+
+private:
+    enum Phase { Measuring, Settled };
+
+    void changeTarget(int target);
+    void evaluate(double level, int activeConnections);
+    void settle();
+
+    Phase m_phase;
+    int m_cap;
+    int m_ceiling;      // lowered by refusals, never raised again
+    int m_target;
+    int m_step;         // connections added per probe; doubles while gains are strong
+
+    int m_baseTarget;   // level the running probe started from, 0 if none
+    double m_baseThroughput;
+    double m_sum;
+    int m_samples;      // samples seen in the current phase
+};
+
+#endif
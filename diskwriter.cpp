@@ -0,0 +1,257 @@
+#include "diskwriter.h"
+#include "writeback.h"
+#include <QSocketNotifier>
+#include <QThread>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef PARAFETCH_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace {
+thread_local DiskWriter* t_writer = nullptr;
+// Live writers by backend, for backendName().
+std::atomic<int> g_ringWriters{0};
+std::atomic<int> g_poolWriters{0};
+}
+
+#ifdef PARAFETCH_HAVE_LIBURING
+struct DiskWriter::Ring {
+    static constexpr unsigned kEntries = 256;
+    io_uring ring;
+    unsigned inFlight = 0;
+};
+#else
+struct DiskWriter::Ring {};
+#endif
+
+// Fallback backend: a few threads doing plain pwrite() for every network
+// thread in the process. Results go back to the submitting DiskWriter.
+class WriterPool {
+public:
+    static WriterPool& instance() {
+        static WriterPool pool;
+        return pool;
+    }
+
+    void push(DiskWriter::Request* request) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(request);
+        }
+        m_cond.notify_one();
+    }
+
+private:
+    WriterPool() {
+        unsigned n = std::max(2u, std::min(4u, std::thread::hardware_concurrency() / 2));
+        for (unsigned i = 0; i < n; ++i) m_threads.emplace_back([this]() { run(); });
+    }
+
+    ~WriterPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for (auto& t : m_threads) t.join();
+    }
+
+    void run() {
+        for (;;) {
+            DiskWriter::Request* r;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+                if (m_queue.empty()) return;
+                r = m_queue.front();
+                m_queue.pop_front();
+            }
+            r->error = r->file->writeAt(r->data.data(), r->length, r->offset);
+            r->done = r->error ? 0 : r->length;
+            r->owner->complete(r);
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<DiskWriter::Request*> m_queue;
+    std::vector<std::thread> m_threads;
+    bool m_stop = false;
+};
+
+DiskWriter* DiskWriter::forCurrentThread() {
+    if (!t_writer) {
+        t_writer = new DiskWriter();
+        connect(QThread::currentThread(), &QThread::finished, t_writer, &QObject::deleteLater);
+    }
+    return t_writer;
+}
+
+DiskWriter::DiskWriter()
+    : QObject(nullptr), m_notifyFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      m_inFlightBytes(0), m_wasCongested(false)
+{
+#ifdef PARAFETCH_HAVE_LIBURING
+    // io_uring may be missing or blocked (old kernel, seccomp); fall back
+    // to the thread pool then.
+    m_ring.reset(new Ring());
+    if (io_uring_queue_init(Ring::kEntries, &m_ring->ring, 0) != 0) {
+        m_ring.reset();
+    } else if (io_uring_register_eventfd(&m_ring->ring, m_notifyFd) != 0) {
+        io_uring_queue_exit(&m_ring->ring);
+        m_ring.reset();
+    }
+#endif
+    ++(m_ring ? g_ringWriters : g_poolWriters);
+    m_notifier = new QSocketNotifier(m_notifyFd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &DiskWriter::onNotify);
+}
+
+DiskWriter::~DiskWriter() {
+    // Nothing may complete into a destroyed writer.
+    while (m_inFlightBytes > 0 || !m_pending.isEmpty()) {
+        if (m_ring) reapRing(true);
+        else reapPool(true);
+    }
+#ifdef PARAFETCH_HAVE_LIBURING
+    if (m_ring) io_uring_queue_exit(&m_ring->ring);
+#endif
+    ::close(m_notifyFd);
+    --(m_ring ? g_ringWriters : g_poolWriters);
+    if (t_writer == this) t_writer = nullptr;
+}
+
+const char* DiskWriter::backendName() {
+    int ring = g_ringWriters, pool = g_poolWriters;
+    if (ring && pool) return "io_uring and writer threads";
+    if (ring) return "io_uring";
+    return pool ? "writer threads" : "";
+}
+
+void DiskWriter::submit(std::unique_ptr<Request> request) {
+    Request* r = request.release();
+    r->owner = this;
+    m_pending[r->client] += 1;
+    m_inFlightBytes += r->length;
+    if (congested()) m_wasCongested = true;
+
+    if (m_ring && submitToRing(r)) return;
+    WriterPool::instance().push(r);
+}
+
+bool DiskWriter::submitToRing(Request* r) {
+#ifdef PARAFETCH_HAVE_LIBURING
+    // Keep the completion queue from overflowing.
+    while (m_ring->inFlight >= Ring::kEntries) reapRing(true);
+
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring->ring);
+    if (!sqe) {
+        io_uring_submit(&m_ring->ring);
+        sqe = io_uring_get_sqe(&m_ring->ring);
+        if (!sqe) return false;
+    }
+    const char* data = r->data.data() + r->done;
+    size_t length = r->length - r->done;
+    curl_off_t offset = r->offset + (curl_off_t)r->done;
+    io_uring_prep_write(sqe, r->file->fdFor(data, length, offset), data, (unsigned)length, offset);
+    io_uring_sqe_set_data(sqe, r);
+    if (io_uring_submit(&m_ring->ring) < 0) return false;
+    ++m_ring->inFlight;
+    return true;
+#else
+    Q_UNUSED(r);
+    return false;
+#endif
+}
+
+void DiskWriter::reapRing(bool wait) {
+#ifdef PARAFETCH_HAVE_LIBURING
+    io_uring_cqe* cqe = nullptr;
+    if (wait) {
+        if (m_ring->inFlight == 0) { reapPool(true); return; } // a request fell back to the pool
+        if (io_uring_wait_cqe(&m_ring->ring, &cqe) != 0) return;
+    }
+    while (io_uring_peek_cqe(&m_ring->ring, &cqe) == 0 && cqe) {
+        Request* r = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+        io_uring_cqe_seen(&m_ring->ring, cqe);
+        --m_ring->inFlight;
+
+        if (res < 0) {
+            if (res == -EINTR || res == -EAGAIN) { if (!submitToRing(r)) WriterPool::instance().push(r); continue; }
+            // The device refused an O_DIRECT write; the pool retries it
+            // through the page cache.
+            if (res == -EINVAL && r->done == 0) { WriterPool::instance().push(r); continue; }
+            r->error = -res;
+        } else if (res == 0) {
+            r->error = EIO;
+        } else {
+            r->done += res;
+            // A short write is finished with another submission.
+            if (r->done < r->length) { if (!submitToRing(r)) WriterPool::instance().push(r); continue; }
+        }
+        finish(r);
+    }
+#else
+    Q_UNUSED(wait);
+#endif
+}
+
+void DiskWriter::complete(Request* r) {
+    {
+        std::lock_guard<std::mutex> lock(m_doneMutex);
+        m_done.push_back(r);
+    }
+    m_doneCond.notify_one();
+    uint64_t one = 1;
+    ssize_t n = ::write(m_notifyFd, &one, sizeof(one));
+    Q_UNUSED(n);
+}
+
+void DiskWriter::reapPool(bool wait) {
+    std::deque<Request*> done;
+    {
+        std::unique_lock<std::mutex> lock(m_doneMutex);
+        if (wait) m_doneCond.wait(lock, [this]() { return !m_done.empty(); });
+        done.swap(m_done);
+    }
+    for (Request* r : done) finish(r);
+}
+
+void DiskWriter::finish(Request* r) {
+    std::unique_ptr<Request> owned(r);
+    m_inFlightBytes -= r->length;
+    if (--m_pending[r->client] == 0) m_pending.remove(r->client);
+    if (!r->error && r->file->isOpen()) Writeback::instance().add(r->file.get(), r->offset, r->length);
+    r->client->writeDone(r->tag, r->offset, r->length, r->error);
+}
+
+void DiskWriter::onNotify() {
+    uint64_t count;
+    ssize_t n = ::read(m_notifyFd, &count, sizeof(count));
+    Q_UNUSED(n);
+    if (m_ring) reapRing(false);
+    reapPool(false);
+
+    if (m_wasCongested && m_inFlightBytes < kLowWater) {
+        m_wasCongested = false;
+        emit decongested();
+    }
+}
+
+void DiskWriter::drain(Client* client) {
+    while (m_pending.value(client, 0) > 0) {
+        if (m_ring) reapRing(true);
+        else reapPool(true);
+    }
+    if (m_wasCongested && m_inFlightBytes < kLowWater) {
+        m_wasCongested = false;
+        emit decongested();
+    }
+}
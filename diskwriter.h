@@ -0,0 +1,95 @@
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <QObject>
+#include <QMap>
+#include <curl/curl.h>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "outputfile.h"
+#include "bufferpool.h"
+
+class QSocketNotifier;
+
+// Takes disk writes off the network thread. A worker hands over a filled
+// buffer and returns to curl immediately; the write happens asynchronously and its completion is delivered back on the
+// submitting thread. Backed by io_uring when built with liburing and the
+// kernel allows it, otherwise by a small writer-thread pool shared by the
+// process. There is one writer per network thread, like TransferEngine.
+class DiskWriter : public QObject {
+    Q_OBJECT
+public:
+    class Client {
+    public:
+        virtual ~Client() = default;
+        // error is an errno value, 0 on success.
+        virtual void writeDone(void* tag, curl_off_t offset, size_t length, int error) = 0;
+    };
+
+    struct Request {
+        std::shared_ptr<OutputFile> file; // keeps the descriptor open until done
+        BufferPool::Buffer data;          // back to the pool once written
+        size_t length = 0;
+        curl_off_t offset = 0;
+        Client* client = nullptr;
+        void* tag = nullptr;
+
+        // Filled in by the writer.
+        DiskWriter* owner = nullptr;
+        size_t done = 0;
+        int error = 0;
+    };
+
+    static DiskWriter* forCurrentThread();
+    ~DiskWriter();
+
+    void submit(std::unique_ptr<Request> request);
+    // Blocks until every write of this client has completed and been
+    // reported. Workers call it before closing or renaming their files.
+    void drain(Client* client);
+
+    // Backpressure: above the high-water mark workers pause their transfers
+    // until decongested() fires below the low-water mark.
+    bool congested() const { return m_inFlightBytes >= kHighWater; }
+    qint64 inFlightBytes() const { return m_inFlightBytes; }
+    // What the writers alive in the process use: io_uring may be missing
+    // or blocked on some of them. Empty before the first is created.
+    static const char* backendName();
+
+    static constexpr qint64 kHighWater = 64LL * 1024 * 1024;
+    static constexpr qint64 kLowWater = 16LL * 1024 * 1024;
+
+signals:
+    void decongested();
+
+private slots:
+    void onNotify();
+
+private:
+    struct Ring;
+
+    DiskWriter();
+    void complete(Request* request); // writer pool threads hand results back here
+    bool submitToRing(Request* request);
+    void reapRing(bool wait);
+    void reapPool(bool wait);
+    void finish(Request* request);
+
+    std::unique_ptr<Ring> m_ring; // null: thread pool backend
+    int m_notifyFd;
+    QSocketNotifier* m_notifier;
+
+    QMap<Client*, int> m_pending;
+    qint64 m_inFlightBytes;
+    bool m_wasCongested;
+
+    std::mutex m_doneMutex;
+    std::condition_variable m_doneCond;
+    std::deque<Request*> m_done;
+
+    friend class WriterPool;
+};
+
+#endif
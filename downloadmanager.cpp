@@ -1,8 +1,83 @@
 #include "downloadmanager.h"
+#include "progressjournal.h"
+#include "piecemanifest.h"
 #include <QDir>
 #include <QStandardPaths>
 #include <QTextStream>
 #include <QFile>
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace {
+// The output is synced and the merge journal advanced at least this often,
+// so an interrupted merge never has to start over from the beginning.
+const qint64 kMergeStep = 256LL * 1024 * 1024;
+const size_t kCopyBufferSize = 1024 * 1024;
+
+QString mergeJournal(const QString& id) { return DownloadManager::getTempDirectory() + "/" + id + ".merge"; }
+
+void writeMergeJournal(const QString& id, qint64 offset)
+{
+    QFile f(mergeJournal(id));
+    if (f.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        f.write(QByteArray::number(offset));
+}
+
+// Copies length bytes between two descriptors, cheapest way first: a
+// reflink (shares extents, no data moves), then copy_file_range (stays in
+// the kernel), then a bounded read/write loop.
+bool copyRange(int in, off_t inOff, int out, off_t outOff, qint64 length)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range clone;
+    clone.src_fd = in;
+    clone.src_offset = inOff;
+    clone.src_length = length;
+    clone.dest_offset = outOff;
+    if (ioctl(out, FICLONERANGE, &clone) == 0) return true;
+#endif
+#ifdef __linux__
+    bool kernelCopy = true;
+    while (length > 0 && kernelCopy) {
+        ssize_t n = copy_file_range(in, &inOff, out, &outOff, (size_t)length, 0);
+        if (n > 0) { length -= n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) return false; // part shorter than its range
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) return false;
+        kernelCopy = false;
+    }
+    if (length == 0) return true;
+#endif
+    std::vector<char> buffer(kCopyBufferSize);
+    while (length > 0) {
+        ssize_t n = pread(in, buffer.data(), std::min<qint64>(length, buffer.size()), inOff);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(out, buffer.data() + done, n - done, outOff + done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            done += w;
+        }
+        inOff += n;
+        outOff += n;
+        length -= n;
+    }
+    return true;
+}
+}
 
 QString DownloadManager::getTempDirectory()
 {
@@ -11,62 +86,357 @@ QString DownloadManager::getTempDirectory()
     return p;
 }
 
+QString DownloadManager::getStagingDirectory(const QString& outPath)
+{
+    // Staging next to the target keeps the merge in one filesystem (where
+    // it can reflink) and makes the final step a rename, which a temp
+    // directory on tmpfs or another mount cannot.
+    QString p = QDir(outPath).filePath(".parafetch");
+    if (QDir().mkpath(p) && QFileInfo(p).isWritable()) return p;
+    return getTempDirectory();
+}
+
+QString DownloadManager::getMergeFile(const QString& outPath, const QString& id)
+{
+    return QDir(outPath).absoluteFilePath(id + ".downloaded");
+}
+
 QString DownloadManager::getStateFile(const QString& id) { return getTempDirectory() + "/" + id + ".state"; }
-QString DownloadManager::getChunkFile(const QString& id, int c) { return getTempDirectory() + "/" + id + ".part" + QString::number(c); }
 
-bool DownloadManager::saveState(const QString& id, const QString& url,
-                            const QString& outPath, const QString& name,
-                            int chunks, curl_off_t size)
+QString DownloadManager::getChunkFile(const QString& outPath, const QString& id, int c)
 {
-    QFile f(getStateFile(id));
-    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
-    QTextStream out(&f);
-    out << url << "\n" << outPath << "\n" << name << "\n" << chunks << "\n" << size;
+    QString name = id + ".part" + QString::number(c);
+    QString staged = getStagingDirectory(outPath) + "/" + name;
+    QString legacy = getTempDirectory() + "/" + name;
+    if (!QFile::exists(staged) && QFile::exists(legacy)) return legacy;
+    return staged;
+}
+
+QString DownloadManager::getPartialFile(const QString& outPath, const QString& name, const QString& id)
+{
+    QString fileName = name + "." + id.left(8) + ".part";
+    QString staged = getStagingDirectory(outPath) + "/" + fileName;
+    QString legacy = QDir(outPath).filePath(fileName);
+    if (!QFile::exists(staged) && QFile::exists(legacy)) return legacy;
+    return staged;
+}
+
+namespace {
+const int kStateVersion = 2;
+
+// Line-based states written before version 2: url, output path, name,
+// chunk count, size, an optional mode line, then "id start end [downloaded]".
+bool loadLegacyState(QFile& f, DownloadState& state)
+{
+    QTextStream in(&f);
+    state.url = in.readLine();
+    state.outputPath = in.readLine();
+    state.filename = in.readLine();
+    int chunks = in.readLine().toInt();
+    state.fileSize = in.readLine().toLongLong();
+    if (chunks <= 0 || state.fileSize <= 0) return false;
+
+    bool modeKnown = false;
+    while (!in.atEnd()) {
+        QStringList parts = in.readLine().split(' ', Qt::SkipEmptyParts);
+        if (parts.size() == 2 && parts[0] == "mode") {
+            state.inPlace = parts[1] == "inplace";
+            modeKnown = true;
+            continue;
+        }
+        if (parts.size() != 3 && parts.size() != 4) continue;
+        ChunkRange r{parts[0].toInt(), parts[1].toLongLong(), parts[2].toLongLong()};
+        if (parts.size() == 4) {
+            r.downloaded = parts[3].toLongLong();
+            state.done.add(r.start, r.start + r.downloaded);
+        }
+        state.ranges.push_back(r);
+    }
+
+    // States without a mode line recorded progress only when in place.
+    if (!modeKnown) state.inPlace = !state.ranges.empty() && state.ranges.front().downloaded >= 0;
+
+    // States written before ranges were recorded use an equal static split.
+    if (state.ranges.empty()) {
+        curl_off_t chunkSize = state.fileSize / chunks;
+        for (int i = 0; i < chunks; ++i) {
+            curl_off_t end = (i == chunks - 1) ? state.fileSize - 1 : (i + 1) * chunkSize - 1;
+            state.ranges.push_back({i + 1, i * chunkSize, end});
+        }
+    }
+    return true;
+}
+}
+
+bool DownloadManager::saveState(const QString& id, const DownloadState& state)
+{
+    QJsonArray ranges;
+    for (const auto& r : state.ranges) {
+        QJsonObject range;
+        range.insert("id", r.id);
+        range.insert("start", (qint64)r.start);
+        range.insert("end", (qint64)r.end);
+        ranges.append(range);
+    }
+    QJsonArray done;
+    for (const auto& i : state.done.intervals())
+        done.append(QJsonArray{(qint64)i.first, (qint64)i.second});
+
+    QJsonObject o;
+    o.insert("version", kStateVersion);
+    o.insert("url", state.url);
+    o.insert("outputPath", state.outputPath);
+    o.insert("filename", state.filename);
+    o.insert("size", (qint64)state.fileSize);
+    o.insert("mode", state.inPlace ? "inplace" : "parts");
+    if (!state.etag.isEmpty()) o.insert("etag", state.etag);
+    if (!state.lastModified.isEmpty()) o.insert("lastModified", state.lastModified);
+    if (!state.checksum.isEmpty()) o.insert("checksum", state.checksum);
+    o.insert("ranges", ranges);
+    o.insert("done", done);
+
+    // Written beside the old state and renamed over it. No fsync: this runs
+    // every second on the network thread, and the bytes it vouches for
+    // are themselves only in the page cache, so it guards against a crash
+    // of the process, not of the machine.
+    QString path = getStateFile(id);
+    QString temp = path + ".tmp";
+    QFile f(temp);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+    QByteArray data = QJsonDocument(o).toJson(QJsonDocument::Compact);
+    bool ok = f.write(data) == data.size();
+    f.close();
+    if (!ok || ::rename(temp.toLocal8Bit().constData(), path.toLocal8Bit().constData()) != 0) {
+        QFile::remove(temp);
+        return false;
+    }
     return true;
 }
 
-bool DownloadManager::loadState(const QString& id, QString& url,
-                                QString& outPath, QString& name,
-                                int& chunks, curl_off_t& size)
+bool DownloadManager::loadState(const QString& id, DownloadState& state)
 {
     QFile f(getStateFile(id));
-    if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) return false;
-    QTextStream in(&f);
-    url = in.readLine();
-    outPath = in.readLine();
-    name = in.readLine();
-    chunks = in.readLine().toInt();
-    size = in.readLine().toLongLong();
+    if (!f.open(QIODevice::ReadOnly)) return false;
+    state = DownloadState();
+    if (!f.peek(1).startsWith('{')) return loadLegacyState(f, state);
+
+    QJsonObject o = QJsonDocument::fromJson(f.readAll()).object();
+    if (o.value("version").toInt() != kStateVersion) return false;
+    state.url = o.value("url").toString();
+    state.outputPath = o.value("outputPath").toString();
+    state.filename = o.value("filename").toString();
+    state.fileSize = o.value("size").toInteger();
+    state.inPlace = o.value("mode").toString() == "inplace";
+    state.etag = o.value("etag").toString();
+    state.lastModified = o.value("lastModified").toString();
+    state.checksum = o.value("checksum").toString();
+    for (const auto& v : o.value("ranges").toArray()) {
+        QJsonObject r = v.toObject();
+        state.ranges.push_back({r.value("id").toInt(), r.value("start").toInteger(), r.value("end").toInteger()});
+    }
+    for (const auto& v : o.value("done").toArray()) {
+        QJsonArray i = v.toArray();
+        state.done.add(i.at(0).toInteger(), i.at(1).toInteger());
+    }
+    if (state.fileSize <= 0 || state.ranges.empty()) return false;
+
+    // The journal only holds bytes that were synced to disk; after a power
+    // loss the state may claim more than survived.
+    std::vector<ChunkRange> durable;
+    if (ProgressJournal::read(id, durable)) {
+        state.ranges = durable;
+        state.done.clear();
+        for (const auto& r : durable) state.done.add(r.start, r.start + r.downloaded);
+        return true;
+    }
+    for (auto& r : state.ranges)
+        r.downloaded = std::min(state.done.coveredFrom(r.start), r.end - r.start + 1);
     return true;
 }
 
 bool DownloadManager::deleteState(const QString& id) { return QFile::remove(getStateFile(id)); }
 
-bool DownloadManager::mergeChunks(const QString& id, const QString& outPath, int chunks, QString& finalPath)
+qint64 DownloadManager::mergedBytes(const QString& id)
+{
+    QFile f(mergeJournal(id));
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) return 0;
+    return f.readAll().trimmed().toLongLong();
+}
+
+bool DownloadManager::mergeChunks(const QString& id, const QString& outPath,
+                                  const std::vector<ChunkRange>& ranges, QString& finalPath,
+                                  const Progress& progress)
 {
-    QDir dir(outPath);
-    finalPath = dir.absoluteFilePath(id + ".downloaded");
+    finalPath = getMergeFile(outPath, id);
 
-    QFile out(finalPath);
-    if (!out.open(QIODevice::WriteOnly)) return false;
+    std::vector<ChunkRange> ordered = ranges;
+    std::sort(ordered.begin(), ordered.end(),
+              [](const ChunkRange& a, const ChunkRange& b) { return a.start < b.start; });
+    qint64 total = ordered.empty() ? 0 : ordered.back().end + 1;
 
-    for (int i = 1; i <= chunks; ++i) {
-        QFile in(getChunkFile(id, i));
-        if (!in.open(QIODevice::ReadOnly)) {
-            out.close();
-            QFile::remove(finalPath);
+    // Ranges are contiguous from offset 0, so the journal's offset says
+    // exactly which ranges (and how much of the next one) are merged.
+    qint64 merged = mergedBytes(id);
+    if (merged > 0 && QFileInfo(finalPath).size() < merged) merged = 0;
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (merged == 0 ? O_TRUNC : 0);
+    int out = ::open(finalPath.toLocal8Bit().constData(), flags, 0644);
+    if (out < 0) return false;
+
+    for (const auto& r : ordered) {
+        qint64 length = r.end - r.start + 1;
+        if (r.end < merged) continue; // merged before an interruption
+
+        // A part can hold a few bytes past its range when the range was
+        // shrunk by a split while data was in flight; copy only the range.
+        QString part = getChunkFile(outPath, id, r.id);
+        int in = ::open(part.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+        if (in < 0 || QFileInfo(part).size() < length) {
+            if (in >= 0) ::close(in);
+            ::close(out);
             return false;
         }
-        out.write(in.readAll());
-        in.close();
+#ifdef __linux__
+        posix_fadvise(in, 0, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        for (qint64 pos = merged - r.start; pos < length; ) {
+            if (pos < 0) pos = 0;
+            qint64 step = std::min(kMergeStep, length - pos);
+            if (!copyRange(in, pos, out, r.start + pos, step)) {
+                ::close(in);
+                ::close(out);
+                return false;
+            }
+            pos += step;
+            merged = r.start + pos;
+            fdatasync(out);
+            writeMergeJournal(id, merged);
+            if (progress && !progress(merged, total)) {
+                // Stopped; the journal lets the next attempt carry on.
+                ::close(in);
+                ::close(out);
+                return false;
+            }
+        }
+        ::close(in);
+        // Free the part's space right away; the journal covers it now.
+        QFile::remove(part);
     }
-    out.close();
-    cleanupChunks(id, chunks);
+    ::close(out);
+    cleanupChunks(outPath, id, ranges);
     return true;
 }
 
-void DownloadManager::cleanupChunks(const QString& id, int chunks)
+bool DownloadManager::moveFile(const QString& source, const QString& target, const Progress& progress)
 {
-    for (int i = 1; i <= chunks; ++i) QFile::remove(getChunkFile(id, i));
+    QByteArray src = source.toLocal8Bit();
+    QByteArray dst = target.toLocal8Bit();
+    if (::rename(src.constData(), dst.constData()) == 0) return true;
+    if (errno != EXDEV) return false;
+
+    QFileInfo info(target);
+    QString hidden = info.dir().filePath("." + info.fileName() + ".moving");
+    int in = ::open(src.constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    int out = ::open(hidden.toLocal8Bit().constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) { ::close(in); return false; }
+
+    struct stat st;
+    bool ok = fstat(in, &st) == 0;
+    qint64 total = ok ? (qint64)st.st_size : 0;
+#ifdef __linux__
+    if (ok && total > 0) {
+        posix_fadvise(in, 0, total, POSIX_FADV_SEQUENTIAL);
+        // Fails early on a full disk instead of after most of the copy.
+        if (fallocate(out, 0, 0, total) != 0 && errno == ENOSPC) ok = false;
+    }
+#endif
+    for (qint64 pos = 0; ok && pos < total; ) {
+        qint64 step = std::min(kMergeStep, total - pos);
+        ok = copyRange(in, pos, out, pos, step);
+        pos += step;
+        if (ok && progress) ok = progress(pos, total);
+    }
+    ok = ok && fdatasync(out) == 0;
+    ::close(in);
+    ::close(out);
+    if (!ok || ::rename(hidden.toLocal8Bit().constData(), dst.constData()) != 0) {
+        QFile::remove(hidden);
+        return false;
+    }
+    QFile::remove(source);
+    return true;
+}
+
+void DownloadManager::cleanupChunks(const QString& outPath, const QString& id, const std::vector<ChunkRange>& ranges)
+{
+    for (const auto& r : ranges) QFile::remove(getChunkFile(outPath, id, r.id));
+    QFile::remove(mergeJournal(id));
+    QFile::remove(ProgressJournal::path(id));
+    QFile::remove(PieceManifest::path(id));
     deleteState(id);
-}
\ No newline at end of file
+    // Only goes away once no other download is staged there.
+    QDir(outPath).rmdir(".parafetch");
+}
+
+void DownloadManager::discardDownload(const QString& id)
+{
+    DownloadState state;
+    if (loadState(id, state)) {
+        if (state.inPlace) QFile::remove(getPartialFile(state.outputPath, state.filename, id));
+        QFile::remove(getMergeFile(state.outputPath, id));
+        cleanupChunks(state.outputPath, id, state.ranges);
+    } else {
+        deleteState(id);
+    }
+}
+
+namespace {
+// Disk blocks a file holds, including those reserved past its end.
+qint64 allocatedBytes(const QString& path)
+{
+    struct stat st;
+    if (::stat(path.toLocal8Bit().constData(), &st) != 0) return 0;
+    return (qint64)st.st_blocks * 512;
+}
+}
+
+qint64 DownloadManager::spaceShortfall(const QString& id, const QString& outPath, const QString& name,
+                                       const std::vector<ChunkRange>& ranges, qint64 fileSize, bool inPlace,
+                                       QString& where)
+{
+    if (fileSize <= 0) return 0;
+    QStorageInfo target(outPath);
+
+    if (inPlace) {
+        qint64 need = fileSize - allocatedBytes(getPartialFile(outPath, name, id));
+        qint64 missing = need - target.bytesAvailable();
+        if (missing <= 0) return 0;
+        where = target.rootPath();
+        return missing;
+    }
+
+    qint64 parts = 0;
+    qint64 largest = ranges.empty() ? fileSize : 0;
+    for (const auto& r : ranges) {
+        parts += allocatedBytes(getChunkFile(outPath, id, r.id));
+        largest = std::max<qint64>(largest, r.end - r.start + 1);
+    }
+    qint64 merged = allocatedBytes(getMergeFile(outPath, id));
+    QStorageInfo temp(getStagingDirectory(outPath));
+
+    if (temp.device() == target.device()) {
+        // The merge deletes each part once it is copied, so at its peak the
+        // filesystem holds the whole file plus the largest part.
+        qint64 missing = fileSize + largest - parts - merged - target.bytesAvailable();
+        if (missing <= 0) return 0;
+        where = target.rootPath();
+        return missing;
+    }
+    qint64 missing = fileSize - parts - temp.bytesAvailable();
+    if (missing > 0) { where = temp.rootPath(); return missing; }
+    missing = fileSize - merged - target.bytesAvailable();
+    if (missing > 0) { where = target.rootPath(); return missing; }
+    return 0;
+}
@@ -6,22 +6,87 @@
 #include <QMutex>
 #include <QFile>
 #include <curl/curl.h>
+#include <vector>
+#include <functional>
+#include "rangeset.h"
+
+// A byte range of the target file and the part file (by chunk id) holding it.
+struct ChunkRange {
+    int id;
+    curl_off_t start;
+    curl_off_t end; // inclusive
+    // Bytes of the range known to be on disk; -1 in states that predate
+    // it, where the part file's size says so.
+    curl_off_t downloaded = -1;
+};
+
+// What a paused or interrupted download resumes from.
+struct DownloadState {
+    QString url;
+    QString outputPath;
+    QString filename;
+    curl_off_t fileSize = 0;
+    // The ranges are written straight into the partial target file rather
+    // than into part files.
+    bool inPlace = false;
+    // Validators from the probe; resumed requests send them as If-Range so
+    // a changed file comes back whole instead of being spliced.
+    QString etag;
+    QString lastModified;
+    // Expected digest ("sha256:<hex>"), if one was given.
+    QString checksum;
+    std::vector<ChunkRange> ranges;
+    // Bytes of the target file known to be on disk, in file offsets.
+    // loadState() fills each range's `downloaded` from it.
+    RangeSet done;
+};
 
 class DownloadManager {
 public:
-    static QString getTempDirectory();
+    static QString getTempDirectory(); // state files and merge journals
+    // Hidden <outputPath>/.parafetch, where part files and in-place targets
+    // are staged so that finishing stays on one filesystem; the temp
+    // directory if it cannot be created.
+    static QString getStagingDirectory(const QString& outputPath);
     static QString getStateFile(const QString& downloadId);
-    static QString getChunkFile(const QString& downloadId, int chunkId);
-    static bool saveState(const QString& downloadId, const QString& url, 
-                         const QString& outputPath, const QString& filename,
-                         int numChunks, curl_off_t fileSize);
-    static bool loadState(const QString& downloadId, QString& url, 
-                         QString& outputPath, QString& filename,
-                         int& numChunks, curl_off_t& fileSize);
+    // Part files and partial targets of downloads started before staging
+    // are still found where they were.
+    static QString getChunkFile(const QString& outputPath, const QString& downloadId, int chunkId);
+    // In-place download target until it completes and is renamed.
+    static QString getPartialFile(const QString& outputPath, const QString& filename, const QString& downloadId);
+    // Where mergeChunks() assembles the parts.
+    static QString getMergeFile(const QString& outputPath, const QString& downloadId);
+    // Replaces the state file atomically, so a crash mid-write leaves the
+    // previous checkpoint intact.
+    static bool saveState(const QString& downloadId, const DownloadState& state);
+    // Also reads the line-based states of earlier versions. Progress comes
+    // from the download's ProgressJournal when it has one.
+    static bool loadState(const QString& downloadId, DownloadState& state);
     static bool deleteState(const QString& downloadId);
+    // Reports (bytes done, total); returning false stops the operation.
+    using Progress = std::function<bool(qint64, qint64)>;
+    // Streams the parts into <outputPath>/<id>.downloaded, in-kernel where
+    // the filesystem allows. Resumes a merge that was interrupted. Blocks;
+    // workers run it off their network thread.
     static bool mergeChunks(const QString& downloadId, const QString& outputPath, 
-                           int numChunks, QString& finalPath);
-    static void cleanupChunks(const QString& downloadId, int numChunks);
+                           const std::vector<ChunkRange>& ranges, QString& finalPath,
+                           const Progress& progress = {});
+    // Renames source over target. Across filesystems it copies to a hidden
+    // name next to the target, syncs, renames that into place and removes
+    // the source, so the target never exists half-written. Blocks.
+    static bool moveFile(const QString& source, const QString& target, const Progress& progress = {});
+    static qint64 mergedBytes(const QString& downloadId); // prefix already merged, 0 if none
+    static void cleanupChunks(const QString& outputPath, const QString& downloadId,
+                              const std::vector<ChunkRange>& ranges);
+    static void discardDownload(const QString& downloadId); // parts + state of a paused download
+    // Bytes still missing on the filesystems a download writes to before it
+    // can run to completion, merge included; 0 if it fits. Space already
+    // allocated to its files counts as available. `where` names the short
+    // filesystem. With no ranges yet, the merge is assumed to need the file
+    // twice on a shared filesystem.
+    static qint64 spaceShortfall(const QString& downloadId, const QString& outputPath, const QString& filename,
+                                 const std::vector<ChunkRange>& ranges, qint64 fileSize, bool inPlace,
+                                 QString& where);
 };
 
 #endif
\ No newline at end of file
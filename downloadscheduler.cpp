@@ -0,0 +1,416 @@
+#include "downloadscheduler.h"
+#include "downloadworker.h"
+#include "downloadmanager.h"
+#include "ratelimiter.h"
+#include <QFile>
+#include <QUrl>
+#include <QStorageInfo>
+#include <climits>
+
+DownloadScheduler::DownloadScheduler(QObject *parent)
+    : QObject(parent), m_maxActive(5), m_maxTotalConnections(64),
+      m_connectionsPerDownload(8), m_connectionsInUse(0),
+      m_directWrite(true), m_unbufferedIO(false),
+      m_mappedOutput(false), m_mapWindowSize(0), m_mapSyncInterval(0),
+      m_checkpointBytes(0), m_checkpointSeconds(0), m_hashPieces(false), m_defaultHostLimit(16)
+{
+    // Transfers are event driven, so a handful of network threads is plenty
+    // no matter how many downloads are queued.
+    int poolSize = qBound(1, QThread::idealThreadCount() / 2, 4);
+    for (int i = 0; i < poolSize; ++i) {
+        QThread* thread = new QThread(this);
+        thread->setObjectName(QString("ParaFetch-net-%1").arg(i));
+        thread->start();
+        m_pool.append(thread);
+    }
+    m_spaceTimer = new QTimer(this);
+    m_spaceTimer->setInterval(kSpacePollMs);
+    connect(m_spaceTimer, &QTimer::timeout, this, &DownloadScheduler::checkParked);
+}
+
+DownloadScheduler::~DownloadScheduler() {
+    for (auto thread : m_pool) {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+void DownloadScheduler::setMaxActiveDownloads(int n) {
+    m_maxActive = qMax(1, n);
+    promote();
+}
+
+void DownloadScheduler::setMaxTotalConnections(int n) {
+    m_maxTotalConnections = qMax(1, n);
+    rebalance();
+    promote();
+}
+
+void DownloadScheduler::setConnectionsPerDownload(int n) {
+    m_connectionsPerDownload = qMax(1, n);
+    rebalance();
+}
+
+void DownloadScheduler::setHostLimits(int defaultLimit, const QMap<QString, int>& overrides) {
+    m_defaultHostLimit = qMax(1, defaultLimit);
+    m_hostLimits.clear();
+    for (auto it = overrides.constBegin(); it != overrides.constEnd(); ++it)
+        m_hostLimits.insert(it.key().toLower(), qMax(1, it.value()));
+    rebalance();
+    promote();
+}
+
+void DownloadScheduler::setSpeedLimit(double limit) {
+    // One bucket for every connection of every download.
+    RateLimiter::instance().setRate(limit);
+}
+
+void DownloadScheduler::setDirectWrite(bool enabled) {
+    // Only affects downloads started from now on; a resume keeps the mode
+    // its state was written in.
+    m_directWrite = enabled;
+}
+
+void DownloadScheduler::setUnbufferedIO(bool enabled) {
+    m_unbufferedIO = enabled;
+}
+
+void DownloadScheduler::setMappedOutput(bool enabled, int windowSize, int syncInterval) {
+    m_mappedOutput = enabled;
+    m_mapWindowSize = windowSize;
+    m_mapSyncInterval = syncInterval;
+}
+
+void DownloadScheduler::setCheckpointInterval(qint64 bytes, int seconds) {
+    m_checkpointBytes = bytes;
+    m_checkpointSeconds = seconds;
+    for (const auto& a : m_active)
+        QMetaObject::invokeMethod(a.worker, "setCheckpointInterval", Qt::QueuedConnection,
+                                  Q_ARG(qint64, bytes), Q_ARG(int, seconds));
+}
+
+void DownloadScheduler::setPieceHashing(bool enabled) {
+    m_hashPieces = enabled;
+}
+
+void DownloadScheduler::setWeight(const QString& uid, double weight) {
+    m_shares[uid].weight = qMax(0.01, weight);
+    applyShare(uid);
+}
+
+void DownloadScheduler::setGroup(const QString& uid, const QString& group) {
+    m_shares[uid].group = group;
+    applyShare(uid);
+}
+
+void DownloadScheduler::setGroupWeight(const QString& group, double weight) {
+    m_groupWeights[group] = qMax(0.01, weight);
+    for (auto it = m_shares.constBegin(); it != m_shares.constEnd(); ++it)
+        if (it.value().group == group) applyShare(it.key());
+}
+
+void DownloadScheduler::applyShare(const QString& uid) {
+    if (!m_active.contains(uid)) return;
+    Share share = m_shares.value(uid);
+    // Group names get a prefix of their own so they can never meet a uid.
+    if (share.group.isEmpty())
+        RateLimiter::instance().setFlow(uid, uid, share.weight, 1);
+    else
+        RateLimiter::instance().setFlow(uid, "group:" + share.group, groupWeight(share.group), share.weight);
+}
+
+void DownloadScheduler::enqueue(const QString& uid, const QString& url, const QString& outputPath,
+                                const QString& resumeId, const QString& checksum, const QString& pieces) {
+    if (isQueued(uid)) return; // already going to run
+    QueuedDownload q;
+    q.uid = uid;
+    q.url = url;
+    q.outputPath = outputPath;
+    q.resumeId = resumeId;
+    q.checksum = checksum;
+    q.pieces = pieces;
+    q.host = QUrl(url).host().toLower();
+    if (m_active.contains(uid)) {
+        m_requeue.insert(uid, q);
+        m_queuedIds.insert(uid);
+        return;
+    }
+
+    // Resumes were explicitly asked for by the user; let them jump the queue.
+    if (q.resumeId.isEmpty()) m_queue.append(q);
+    else m_queue.prepend(q);
+    m_queuedIds.insert(uid);
+    promote();
+}
+
+void DownloadScheduler::enqueueAll(const QList<QueuedDownload>& downloads) {
+    for (QueuedDownload q : downloads) {
+        if (m_active.contains(q.uid) || isQueued(q.uid)) continue;
+        q.host = QUrl(q.url).host().toLower();
+        m_queue.append(q);
+        m_queuedIds.insert(q.uid);
+    }
+    promote();
+}
+
+bool DownloadScheduler::unqueue(const QString& uid) {
+    if (!m_queuedIds.remove(uid)) return false;
+    if (m_requeue.remove(uid)) return true;
+    for (int i = 0; i < m_queue.size(); ++i) {
+        if (m_queue[i].uid == uid) { m_queue.removeAt(i); return true; }
+    }
+    for (int i = 0; i < m_parked.size(); ++i) {
+        if (m_parked[i].download.uid == uid) { m_parked.removeAt(i); break; }
+    }
+    if (m_parked.isEmpty()) m_spaceTimer->stop();
+    return true;
+}
+
+void DownloadScheduler::pause(const QString& uid) {
+    m_yielding.remove(uid);
+    if (unqueue(uid)) return;
+    if (m_active.contains(uid))
+        QMetaObject::invokeMethod(m_active[uid].worker, "pauseDownload", Qt::QueuedConnection);
+}
+
+void DownloadScheduler::remove(const QString& uid) {
+    m_shares.remove(uid);
+    m_yielding.remove(uid);
+    unqueue(uid);
+    if (m_active.contains(uid))
+        QMetaObject::invokeMethod(m_active[uid].worker, "cancelDownload", Qt::QueuedConnection);
+}
+
+bool DownloadScheduler::isQueued(const QString& uid) const {
+    return m_queuedIds.contains(uid);
+}
+
+void DownloadScheduler::shutdown() {
+    m_queue.clear();
+    m_parked.clear();
+    m_requeue.clear();
+    m_yielding.clear();
+    m_spaceTimer->stop();
+    m_queuedIds.clear();
+    for (const auto& a : m_active)
+        QMetaObject::invokeMethod(a.worker, "pauseDownload", Qt::BlockingQueuedConnection);
+}
+
+void DownloadScheduler::promote() {
+    // Walk the whole queue: a download whose host is saturated waits without
+    // holding up downloads from other hosts behind it.
+    for (int i = 0; i < m_queue.size(); ) {
+        if (m_active.size() >= m_maxActive || m_active.size() >= m_maxTotalConnections) break;
+        QString host = m_queue[i].host;
+        if (!hostHasRoom(host)) { ++i; continue; }
+        QueuedDownload next = m_queue.takeAt(i);
+        m_queuedIds.remove(next.uid);
+        // Only now is the state file looked at: a download paused before
+        // its probe finished never wrote one and starts fresh.
+        if (!next.resumeId.isEmpty() && !QFile::exists(DownloadManager::getStateFile(next.resumeId)))
+            next.resumeId.clear();
+
+        QThread* thread = threadFor(host);
+        DownloadWorker* worker = new DownloadWorker();
+        worker->moveToThread(thread);
+        connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+
+        ActiveDownload a;
+        a.download = next;
+        a.worker = worker;
+        a.thread = thread;
+        a.connections = 0;
+        a.host = host;
+        m_active.insert(next.uid, a);
+
+        QString uid = next.uid;
+        connect(worker, &DownloadWorker::downloadFinished, this, [this, uid, worker]() {
+            if (m_active.contains(uid) && m_active[uid].worker == worker) release(uid);
+        });
+        connect(worker, &DownloadWorker::downloadPaused, this, [this, uid, worker](const QString& downloadId) {
+            if (!m_active.contains(uid) || m_active[uid].worker != worker) return;
+            if (m_yielding.remove(uid) && !m_requeue.contains(uid)) {
+                QueuedDownload q = m_active[uid].download;
+                q.resumeId = downloadId;
+                m_requeue.insert(uid, q);
+                m_queuedIds.insert(uid);
+            }
+            release(uid);
+        });
+        connect(worker, &DownloadWorker::waitingForSpace, this,
+                [this, uid, worker](const QString& downloadId, const QString& where, qint64 bytesNeeded) {
+            if (m_active.contains(uid) && m_active[uid].worker == worker) park(uid, downloadId, where, bytesNeeded);
+        });
+        connect(worker, &DownloadWorker::serverAddressChanged, this, [this, uid, worker](const QString& address) {
+            if (!m_active.contains(uid) || m_active[uid].worker != worker) return;
+            ActiveDownload& a = m_active[uid];
+            a.address = address;
+            m_hostAddresses.insert(a.host, address);
+            // Started before its host was known to land here; others already
+            // fill the address, so it waits its turn again.
+            int running = 0;
+            for (const auto& other : m_active) if (addressOf(other) == address) ++running;
+            if (running > hostLimit(address) && !m_yielding.contains(uid)) {
+                m_yielding.insert(uid);
+                QMetaObject::invokeMethod(worker, "yieldDownload", Qt::QueuedConnection);
+            }
+            rebalance();
+        });
+
+        emit workerStarted(uid, worker);
+
+        applyShare(uid);
+        QMetaObject::invokeMethod(worker, "setRateFlow", Qt::QueuedConnection, Q_ARG(QString, uid));
+
+        // Grants every download of this host (including the new one) its share.
+        rebalance();
+        QMetaObject::invokeMethod(worker, "setDirectWrite", Qt::QueuedConnection, Q_ARG(bool, m_directWrite));
+        QMetaObject::invokeMethod(worker, "setUnbufferedIO", Qt::QueuedConnection, Q_ARG(bool, m_unbufferedIO));
+        QMetaObject::invokeMethod(worker, "setMappedOutput", Qt::QueuedConnection, Q_ARG(bool, m_mappedOutput),
+                                  Q_ARG(int, m_mapWindowSize), Q_ARG(int, m_mapSyncInterval));
+        QMetaObject::invokeMethod(worker, "setCheckpointInterval", Qt::QueuedConnection,
+                                  Q_ARG(qint64, m_checkpointBytes), Q_ARG(int, m_checkpointSeconds));
+        if (!next.checksum.isEmpty())
+            QMetaObject::invokeMethod(worker, "setExpectedChecksum", Qt::QueuedConnection, Q_ARG(QString, next.checksum));
+        if (!next.pieces.isEmpty())
+            QMetaObject::invokeMethod(worker, "setPieceManifest", Qt::QueuedConnection, Q_ARG(QString, next.pieces));
+        QMetaObject::invokeMethod(worker, "setPieceHashing", Qt::QueuedConnection, Q_ARG(bool, m_hashPieces));
+        if (next.resumeId.isEmpty())
+            QMetaObject::invokeMethod(worker, "startDownload", Qt::QueuedConnection,
+                                      Q_ARG(QString, next.url), Q_ARG(QString, next.outputPath));
+        else
+            QMetaObject::invokeMethod(worker, "resumeDownload", Qt::QueuedConnection,
+                                      Q_ARG(QString, next.resumeId));
+    }
+}
+
+void DownloadScheduler::release(const QString& uid) {
+    ActiveDownload a = m_active.take(uid);
+    m_yielding.remove(uid);
+    a.worker->deleteLater();
+    RateLimiter::instance().removeFlow(uid);
+    emit workerReleased(uid);
+    if (m_requeue.contains(uid)) {
+        QueuedDownload q = m_requeue.take(uid);
+        if (q.resumeId.isEmpty()) m_queue.append(q);
+        else m_queue.prepend(q);
+    }
+    rebalance();
+    promote();
+}
+
+void DownloadScheduler::park(const QString& uid, const QString& downloadId, const QString& where, qint64 bytesNeeded) {
+    ParkedDownload p;
+    p.download = m_active[uid].download;
+    // Whatever it saved is resumed; without a state it starts over.
+    p.download.resumeId = downloadId;
+    p.where = where;
+    p.bytesNeeded = bytesNeeded;
+    m_requeue.remove(uid); // parking covers it
+    m_parked.append(p);
+    m_queuedIds.insert(uid);
+    if (!m_spaceTimer->isActive()) m_spaceTimer->start();
+    // Its slot goes to the next download in the queue.
+    release(uid);
+}
+
+void DownloadScheduler::checkParked() {
+    bool any = false;
+    for (int i = 0; i < m_parked.size(); ) {
+        QStorageInfo storage(m_parked[i].where);
+        if (storage.bytesAvailable() < m_parked[i].bytesNeeded) { ++i; continue; }
+        // It waited its turn already; it goes ahead of the queue.
+        m_queue.prepend(m_parked.takeAt(i).download);
+        any = true;
+    }
+    if (m_parked.isEmpty()) m_spaceTimer->stop();
+    if (any) promote();
+}
+
+int DownloadScheduler::hostLimit(const QString& key) const {
+    return m_hostLimits.value(key, m_defaultHostLimit);
+}
+
+QString DownloadScheduler::addressOf(const ActiveDownload& a) const {
+    return a.address.isEmpty() ? m_hostAddresses.value(a.host) : a.address;
+}
+
+bool DownloadScheduler::hostHasRoom(const QString& host) const {
+    // Every running download needs at least one connection.
+    QString address = m_hostAddresses.value(host);
+    int onHost = 0, onAddress = 0;
+    for (const auto& a : m_active) {
+        if (a.host == host) ++onHost;
+        if (!address.isEmpty() && addressOf(a) == address) ++onAddress;
+    }
+    if (onHost >= hostLimit(host)) return false;
+    return address.isEmpty() || onAddress < hostLimit(address);
+}
+
+void DownloadScheduler::rebalance() {
+    // Fair share of every budget a download draws from (its host, its
+    // server address, the global total): connections are dealt out one per
+    // download per round, so a budget that does not divide evenly goes to
+    // some of them instead of to none. Workers give back surplus
+    // connections as their current ranges complete.
+    QMap<QString, int> grants, hostUsed, addressUsed;
+    int total = 0;
+    // The one connection each needs to run; admission keeps this in budget.
+    for (auto it = m_active.constBegin(); it != m_active.constEnd(); ++it) {
+        grants.insert(it.key(), 1);
+        ++hostUsed[it.value().host];
+        QString address = addressOf(it.value());
+        if (!address.isEmpty()) ++addressUsed[address];
+        ++total;
+    }
+    for (bool dealt = true; dealt; ) {
+        dealt = false;
+        for (auto it = m_active.constBegin(); it != m_active.constEnd(); ++it) {
+            if (total >= m_maxTotalConnections) break;
+            if (m_yielding.contains(it.key())) continue; // on its way out
+            const ActiveDownload& a = it.value();
+            int& grant = grants[it.key()];
+            if (grant >= m_connectionsPerDownload || hostUsed[a.host] >= hostLimit(a.host)) continue;
+            QString address = addressOf(a);
+            if (!address.isEmpty() && addressUsed[address] >= hostLimit(address)) continue;
+            ++grant;
+            ++hostUsed[a.host];
+            if (!address.isEmpty()) ++addressUsed[address];
+            ++total;
+            dealt = true;
+        }
+    }
+
+    m_connectionsInUse = 0;
+    for (auto it = m_active.begin(); it != m_active.end(); ++it) {
+        int grant = grants.value(it.key());
+        m_connectionsInUse += grant;
+        if (grant == it.value().connections) continue;
+        it.value().connections = grant;
+        QMetaObject::invokeMethod(it.value().worker, "setMaxConnections", Qt::QueuedConnection, Q_ARG(int, grant));
+    }
+}
+
+int DownloadScheduler::threadLoad(QThread* thread) const {
+    int load = 0;
+    for (const auto& a : m_active) if (a.thread == thread) ++load;
+    return load;
+}
+
+QThread* DownloadScheduler::threadFor(const QString& host) {
+    QThread* best = m_pool.first();
+    int bestLoad = INT_MAX;
+    for (auto thread : m_pool) {
+        int load = threadLoad(thread);
+        if (load < bestLoad) { best = thread; bestLoad = load; }
+    }
+
+    // Back-to-back downloads from one host go to the same thread so they
+    // reuse its warm connections instead of paying new handshakes, unless
+    // that thread is clearly busier than the rest.
+    QThread* warm = m_hostThreads.value(host, nullptr);
+    if (warm && threadLoad(warm) <= bestLoad + 1) best = warm;
+
+    if (!host.isEmpty()) m_hostThreads.insert(host, best);
+    return best;
+}
@@ -0,0 +1,165 @@
+#ifndef DOWNLOADSCHEDULER_H
+#define DOWNLOADSCHEDULER_H
+
+#include <QObject>
+#include <QThread>
+#include <QList>
+#include <QMap>
+#include <QSet>
+#include <QString>
+#include <QTimer>
+
+class DownloadWorker;
+
+// Lightweight record for a download waiting for a slot. No worker, thread or
+// curl state exists for it until the scheduler promotes it.
+struct QueuedDownload {
+    QString uid;
+    QString url;
+    QString outputPath;
+    QString resumeId; // non-empty: resume this paused download instead of starting fresh
+    QString host;
+    QString checksum; // expected digest ("sha256:<hex>"), verified before finishing
+    QString pieces;   // piece hash manifest (path or URL), checked as pieces land
+};
+
+// Owns a fixed pool of network threads and decides which queued downloads
+// run. At most maxActiveDownloads run at once and their connection grants
+// never add up to more than maxTotalConnections. Downloads sharing a host
+// (or, once connected, a server address) also share that host's budget,
+// split as evenly as it divides. Every running download needs at least one
+// connection, so once a budget is full nothing more starts on it; a
+// download that turns out to land on a full address goes back to the
+// queue.
+//
+// Under a speed limit, downloads share it by weight. A download can belong
+// to a group (a batch import, say); groups share the limit by their own
+// weights and the downloads of a group split its part by theirs. A
+// download in no group competes on its own, as a group of one.
+//
+// A download short of disk space gives up its slot; it is parked, off the
+// queue, until the filesystem has room for it again.
+class DownloadScheduler : public QObject {
+    Q_OBJECT
+public:
+    explicit DownloadScheduler(QObject *parent = nullptr);
+    ~DownloadScheduler();
+
+    void setMaxActiveDownloads(int n);
+    void setMaxTotalConnections(int n);
+    void setConnectionsPerDownload(int n);
+    // Default budget per host/address plus overrides keyed by host name or IP.
+    void setHostLimits(int defaultLimit, const QMap<QString, int>& overrides);
+    void setSpeedLimit(double limit); // bytes/sec for all downloads together, 0 = unlimited
+    void setDirectWrite(bool enabled);
+    void setUnbufferedIO(bool enabled);
+    void setMappedOutput(bool enabled, int windowSize, int syncInterval); // sizes in bytes
+    void setCheckpointInterval(qint64 bytes, int seconds);
+    void setPieceHashing(bool enabled);
+
+    // Weight presets; High against one Normal download gets 80% of the limit.
+    static constexpr double kHighWeight = 16;
+    static constexpr double kNormalWeight = 4;
+    static constexpr double kLowWeight = 1;
+    // Take effect right away for a running download.
+    void setWeight(const QString& uid, double weight);
+    void setGroup(const QString& uid, const QString& group); // empty = no group
+    void setGroupWeight(const QString& group, double weight);
+    double weight(const QString& uid) const { return m_shares.value(uid).weight; }
+    double groupWeight(const QString& group) const { return m_groupWeights.value(group, kNormalWeight); }
+
+    int maxActiveDownloads() const { return m_maxActive; }
+    int activeCount() const { return m_active.size(); }
+    int queuedCount() const { return m_queue.size(); }
+
+    // A download whose worker is still winding down (paused a moment ago)
+    // is queued as soon as the worker lets go of it.
+    void enqueue(const QString& uid, const QString& url, const QString& outputPath,
+                 const QString& resumeId = QString(), const QString& checksum = QString(),
+                 const QString& pieces = QString());
+    // Appends a whole restored queue, in order, and promotes once.
+    void enqueueAll(const QList<QueuedDownload>& downloads);
+    void pause(const QString& uid);
+    void remove(const QString& uid);
+
+    bool isQueued(const QString& uid) const; // waiting for a slot or for disk space
+    bool isActive(const QString& uid) const { return m_active.contains(uid); }
+
+    // Pauses every running download and waits until each has saved its
+    // state, so the next session can resume them. Call before destruction.
+    void shutdown();
+
+signals:
+    // Emitted before the worker is told to start so listeners can connect to it.
+    void workerStarted(const QString& uid, DownloadWorker* worker);
+    void workerReleased(const QString& uid);
+
+private:
+    struct ActiveDownload {
+        QueuedDownload download; // as it was promoted
+        DownloadWorker* worker;
+        QThread* thread;
+        int connections;
+        QString host;
+        QString address; // server IP, reported once the first connection lands
+    };
+
+    struct Share {
+        QString group;
+        double weight = kNormalWeight;
+    };
+
+    struct ParkedDownload {
+        QueuedDownload download;
+        QString where;      // filesystem that is short
+        qint64 bytesNeeded; // available there before it is tried again
+    };
+
+    void promote();
+    void park(const QString& uid, const QString& downloadId, const QString& where, qint64 bytesNeeded);
+    void checkParked();
+    bool unqueue(const QString& uid); // takes it off the queue or out of the parked list
+    void applyShare(const QString& uid);
+    void release(const QString& uid);
+    void rebalance();
+    int hostLimit(const QString& key) const;
+    // The server address a download draws on: reported, or last seen for its host.
+    QString addressOf(const ActiveDownload& a) const;
+    bool hostHasRoom(const QString& host) const; // host and its known address
+    int threadLoad(QThread* thread) const;
+    QThread* threadFor(const QString& host);
+
+    QList<QThread*> m_pool;
+    QList<QueuedDownload> m_queue;
+    QSet<QString> m_queuedIds;   // uids in m_queue and m_parked; the queue can be thousands long
+    QList<ParkedDownload> m_parked;
+    QMap<QString, QueuedDownload> m_requeue; // enqueued again while still active
+    QTimer* m_spaceTimer;        // polls free space while anything is parked
+    QMap<QString, ActiveDownload> m_active;
+    // Thread whose engine last talked to a host; its idle keep-alive
+    // connections to that host live in that engine's pool.
+    QMap<QString, QThread*> m_hostThreads;
+    QMap<QString, QString> m_hostAddresses; // server address each host last resolved to
+    QSet<QString> m_yielding;               // uids stopping to go back to the queue
+
+    int m_maxActive;
+    int m_maxTotalConnections;
+    int m_connectionsPerDownload;
+    int m_connectionsInUse;
+    bool m_directWrite;
+    bool m_unbufferedIO;
+    bool m_mappedOutput;
+    int m_mapWindowSize;
+    int m_mapSyncInterval;
+    qint64 m_checkpointBytes;
+    int m_checkpointSeconds;
+    bool m_hashPieces;
+    int m_defaultHostLimit;
+    QMap<QString, int> m_hostLimits;
+    QMap<QString, Share> m_shares;          // by uid; absent = Normal, no group
+    QMap<QString, double> m_groupWeights;
+
+    static constexpr int kSpacePollMs = 5000;
+};
+
+#endif
@@ -1,42 +1,49 @@
 #include "downloadworker.h"
 #include "downloadmanager.h"
 #include "httphelper.h"
+#include "ratelimiter.h"
 #include <QDebug>
 #include <QDir>
 #include <QUuid>
+#include <QUrl>
+#include <QRandomGenerator>
+#include <QThread>
+#include <QStorageInfo>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
 
 DownloadWorker::DownloadWorker(QObject *parent)
-    : QObject(parent), m_multiHandle(nullptr), m_fileSize(-1), 
-      m_numChunks(0), m_supportsRanges(false), m_speedLimit(0), m_bytesAtStart(0), // Init
-      m_userPaused(false), m_cancelled(false), m_isNetworkError(false)
+    : QObject(parent), m_nextChunkId(1), m_probeHandle(nullptr), m_manifestHandle(nullptr), m_fileSize(-1), 
+      m_numChunks(0), m_supportsRanges(false), m_remoteChanged(false), m_restarts(0), m_directWrite(true), m_inPlace(false), m_unbufferedIO(false),
+      m_mappedOutput(false), m_useMapped(false), m_mapWindowSize(MappedWriter::kDefaultWindowSize),
+      m_mapSyncInterval(MappedWriter::kDefaultSyncInterval), m_writeError(0),
+      m_checkpointBytes(64LL * 1024 * 1024), m_checkpointSeconds(10), m_checkpointedBytes(0), m_mergedBytes(0),
+      m_hashPieces(false), m_piecesShown(0), m_awaitingPieces(false), m_bytesAtStart(0), // Init
+      m_userPaused(false), m_cancelled(false), m_lastSampleBytes(0),
+      m_finishThread(nullptr), m_stopFinishing(false), m_finishedOk(false)
 {
-    curl_global_init(CURL_GLOBAL_ALL);
-    
-    m_workTimer = new QTimer(this);
-    connect(m_workTimer, &QTimer::timeout, this, &DownloadWorker::performWork);
-    
     m_progressTimer = new QTimer(this);
     connect(m_progressTimer, &QTimer::timeout, this, &DownloadWorker::updateProgress);
 
     m_networkRetryTimer = new QTimer(this);
+    m_networkRetryTimer->setSingleShot(true);
     connect(m_networkRetryTimer, &QTimer::timeout, this, &DownloadWorker::attemptNetworkRecovery);
+
+
+    m_throttleTimer = new QTimer(this);
+    m_throttleTimer->setSingleShot(true);
+    m_throttleTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_throttleTimer, &QTimer::timeout, this, &DownloadWorker::resumeThrottled);
 }
 
 DownloadWorker::~DownloadWorker() {
     cleanup();
-    curl_global_cleanup();
-}
-
-int DownloadWorker::calculateOptimalConnections(curl_off_t size) {
-    if (size <= 0) return 1;
-    long long sizeMB = size / (1024 * 1024);
-    int optimal = 1 + (sizeMB / 50); 
-    if (optimal > 8) optimal = 8;
-    return optimal;
 }
 
 bool DownloadWorker::probeFileInfo() {
+    // The probe runs on the shared engine like any other transfer so a slow
+    // server never blocks the other downloads on this network thread.
     CURL* curl = curl_easy_init();
     if (!curl) return false;
     m_headers.clear();
@@ -47,7 +54,17 @@ bool DownloadWorker::probeFileInfo() {
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HttpHelper::headerCallback);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, &m_headers);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    CURLcode res = curl_easy_perform(curl);
+
+    m_engine = TransferEngine::forCurrentThread();
+    if (!m_engine->addHandle(curl, this)) { curl_easy_cleanup(curl); return false; }
+    m_probeHandle = curl;
+    return true;
+}
+
+void DownloadWorker::onProbeFinished(CURLcode res) {
+    CURL* curl = m_probeHandle;
+    m_probeHandle = nullptr;
+    if (m_engine) m_engine->removeHandle(curl);
     if (res == CURLE_OK) {
         char *finalUrl = nullptr;
         curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &finalUrl);
@@ -55,9 +72,135 @@ bool DownloadWorker::probeFileInfo() {
         m_fileSize = HttpHelper::getContentLength(m_headers);
         m_supportsRanges = HttpHelper::supportsRanges(m_headers);
         m_filename = HttpHelper::extractFilename(m_url, m_headers);
+        m_etag = HttpHelper::getETag(m_headers);
+        m_lastModified = HttpHelper::getLastModified(m_headers);
     }
     curl_easy_cleanup(curl);
-    return res == CURLE_OK && m_fileSize > 0;
+
+    if (m_cancelled || m_userPaused) return;
+    if (res != CURLE_OK || m_fileSize <= 0) {
+        emit downloadFinished(false, "Could not connect to server.");
+        return;
+    }
+    
+    // Fetched only now: a Metalink is searched for the file's name.
+    m_manifest = PieceManifest();
+    if (!m_pieceSource.isEmpty()) { fetchManifest(); return; }
+    beginTransfers();
+}
+
+void DownloadWorker::fetchManifest() {
+    m_manifestData.clear();
+    QUrl source(m_pieceSource);
+    if (source.scheme().isEmpty() || source.isLocalFile()) {
+        QFile f(source.isLocalFile() ? source.toLocalFile() : m_pieceSource);
+        bool read = f.open(QIODevice::ReadOnly);
+        if (read) m_manifestData = f.readAll();
+        onManifestFetched(read ? CURLE_OK : CURLE_FILE_COULDNT_READ_FILE);
+        return;
+    }
+
+    CURL* curl = curl_easy_init();
+    if (!curl) { onManifestFetched(CURLE_FAILED_INIT); return; }
+    curl_easy_setopt(curl, CURLOPT_URL, m_pieceSource.toUtf8().constData());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, manifestCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &m_manifestData);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    if (!m_engine->addHandle(curl, this)) {
+        curl_easy_cleanup(curl);
+        onManifestFetched(CURLE_FAILED_INIT);
+        return;
+    }
+    m_manifestHandle = curl;
+}
+
+size_t DownloadWorker::manifestCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    QByteArray* data = static_cast<QByteArray*>(userp);
+    size_t realSize = size * nmemb;
+    if (data->size() + (qsizetype)realSize > kMaxManifestSize) return 0;
+    data->append(static_cast<const char*>(contents), (qsizetype)realSize);
+    return realSize;
+}
+
+void DownloadWorker::onManifestFetched(CURLcode result) {
+    if (m_manifestHandle) {
+        if (m_engine) m_engine->removeHandle(m_manifestHandle);
+        curl_easy_cleanup(m_manifestHandle);
+        m_manifestHandle = nullptr;
+    }
+    if (m_cancelled || m_userPaused) return;
+
+    PieceManifest manifest;
+    if (result == CURLE_OK && PieceManifest::parse(m_manifestData, m_filename, manifest) && manifest.fits(m_fileSize)) {
+        m_manifest = manifest;
+        // A Metalink names the whole file's digest as well.
+        if (!m_checksum.isValid()) m_checksum = manifest.fileChecksum;
+    } else {
+        // Not worth failing over: the download just goes without them.
+        qWarning() << "No usable piece hashes in" << m_pieceSource << ":"
+                   << (result == CURLE_OK ? "wrong format or file size" : curl_easy_strerror(result));
+    }
+    m_manifestData.clear();
+    beginTransfers();
+}
+
+void DownloadWorker::beginTransfers() {
+    // Better to wait here than to fail halfway with the bandwidth spent.
+    if (!haveDiskSpace(m_directWrite)) {
+        cleanup();
+        return;
+    }
+
+    // Start with the controller's opening bid; it grows the count from
+    // measured throughput. Tiny files are not worth splitting.
+    m_numChunks = 1;
+    if (m_supportsRanges)
+        m_numChunks = (int)std::max<curl_off_t>(1, std::min<curl_off_t>(m_controller.target(), m_fileSize / kMinSplitSize));
+    if (!initializeDownload(m_url, m_numChunks)) {
+        emit downloadFinished(false, "Initialization failed");
+        return;
+    }
+    
+    saveState();
+    m_journal.reset(new ProgressJournal(m_downloadId));
+    m_checkpointedBytes = 0;
+    m_mergedBytes = 0;
+    if (m_checksum.isValid()) m_verifier.reset(new StreamVerifier(m_checksum, m_fileSize));
+    startPieceVerifier(false);
+    keepOutputsCached();
+    
+    m_globalStartTime = std::chrono::steady_clock::now();
+    m_lastCheckpoint = m_globalStartTime;
+    m_lastSampleTime = m_globalStartTime;
+    m_lastSampleBytes = 0;
+    m_speed.reset();
+    emit statusChanged(QString("Downloading with %1 connections...").arg(m_numChunks));
+    m_progressTimer->start(200);
+}
+
+void DownloadWorker::restartDownload() {
+    m_remoteChanged = false;
+    cleanup();
+    // Nothing on disk belongs to the new version of the file.
+    if (m_inPlace && m_output) QFile::remove(m_output->path());
+    QFile::remove(DownloadManager::getMergeFile(m_outputPath, m_downloadId));
+    DownloadManager::cleanupChunks(m_outputPath, m_downloadId, chunkRanges());
+    m_chunks.clear();
+    m_output.reset();
+    m_nextChunkId = 1;
+    m_bytesAtStart = 0;
+    m_etag.clear();
+    m_lastModified.clear();
+
+    if (++m_restarts > kMaxRestarts) {
+        emit downloadFinished(false, "Remote file keeps changing");
+        return;
+    }
+    emit statusChanged("Remote file changed, restarting...");
+    if (!probeFileInfo()) emit downloadFinished(false, "Could not connect to server.");
 }
 
 void DownloadWorker::startDownload(const QString& url, const QString& outputPath) {
@@ -69,150 +212,823 @@ void DownloadWorker::startDownload(const QString& url, const QString& outputPath
 
     m_userPaused = false;
     m_cancelled = false;
-    m_isNetworkError = false;
     m_bytesAtStart = 0; // Fresh download
+    m_restarts = 0;
+    m_remoteChanged = false;
     
     emit statusChanged("Connecting...");
     if (!probeFileInfo()) {
         emit downloadFinished(false, "Could not connect to server.");
-        return;
-    }
-    
-    m_numChunks = m_supportsRanges ? calculateOptimalConnections(m_fileSize) : 1;
-    if (!initializeDownload(m_url, m_numChunks)) {
-        emit downloadFinished(false, "Initialization failed");
-        return;
     }
-    
-    DownloadManager::saveState(m_downloadId, m_url, m_outputPath, m_filename, m_numChunks, m_fileSize);
-    
-    m_globalStartTime = std::chrono::steady_clock::now();
-    emit statusChanged(QString("Downloading with %1 connections...").arg(m_numChunks));
-    m_progressTimer->start(200);
-    m_workTimer->start(0);
 }
 
 bool DownloadWorker::initializeDownload(const QString& url, int numChunks) {
     m_chunks.clear();
     m_chunks.resize(numChunks);
+
+    m_output.reset();
+    m_inPlace = m_directWrite;
+    if (m_inPlace) {
+        m_output = std::make_shared<OutputFile>();
+        QString partial = DownloadManager::getPartialFile(m_outputPath, m_filename, m_downloadId);
+        if (!m_output->open(partial, m_fileSize, true)) {
+            qWarning() << "Cannot create" << partial << ":" << m_output->errorString();
+            m_output.reset();
+            return false;
+        }
+    }
+    prepareOutput();
+    attachWriter();
     curl_off_t chunkSize = m_fileSize / numChunks;
     
     for (int i = 0; i < numChunks; ++i) {
-        m_chunks[i].id = i + 1;
+        m_chunks[i].id = m_nextChunkId++;
         m_chunks[i].start = i * chunkSize;
         m_chunks[i].end = (i == numChunks - 1) ? m_fileSize - 1 : (i + 1) * chunkSize - 1;
         m_chunks[i].size = m_chunks[i].end - m_chunks[i].start + 1;
         m_chunks[i].downloaded = 0;
         m_chunks[i].completed = false;
-        m_chunks[i].filename = DownloadManager::getChunkFile(m_downloadId, m_chunks[i].id);
+        m_chunks[i].handle = nullptr;
+        m_chunks[i].filename = DownloadManager::getChunkFile(m_outputPath, m_downloadId, m_chunks[i].id);
         m_chunks[i].lastUpdate = std::chrono::steady_clock::now();
-        m_chunks[i].file = fopen(m_chunks[i].filename.toLocal8Bit().constData(), "wb");
-        if (!m_chunks[i].file) { cleanup(); return false; }
+        if (!openChunkOutput(m_chunks[i], true)) { cleanup(); return false; }
     }
+    reserveSpace();
 
-    m_multiHandle = curl_multi_init();
-    curl_multi_setopt(m_multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, numChunks);
-    curl_multi_setopt(m_multiHandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    m_url = url;
+    m_engine = TransferEngine::forCurrentThread();
 
-    for (int i = 0; i < numChunks; ++i) {
-        CURL* eh = curl_easy_init();
-        m_easyHandles.push_back(eh);
-        QString range = QString("%1-%2").arg(m_chunks[i].start).arg(m_chunks[i].end);
-        curl_easy_setopt(eh, CURLOPT_URL, url.toUtf8().constData());
-        if(m_supportsRanges) curl_easy_setopt(eh, CURLOPT_RANGE, range.toUtf8().constData());
-        curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writeCallback);
-        curl_easy_setopt(eh, CURLOPT_WRITEDATA, &m_chunks[i]);
-        curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(eh, CURLOPT_SSL_VERIFYPEER, 0L);
-        curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT, 10L);
-        
-        // Apply speed limit if set
-        if (m_speedLimit > 0) {
-            curl_off_t limitPerHandle = (curl_off_t)(m_speedLimit / numChunks);
-            curl_easy_setopt(eh, CURLOPT_MAX_RECV_SPEED_LARGE, limitPerHandle);
+    for (auto& chunk : m_chunks) {
+        if (!startChunkTransfer(chunk)) { cleanup(); return false; }
+    }
+    return true;
+}
+
+bool DownloadWorker::startChunkTransfer(ChunkData& chunk, const QString& avoidAddress) {
+    CURL* eh = curl_easy_init();
+    if (!eh) return false;
+
+    curl_off_t currentPos = chunk.start + chunk.downloaded;
+    QString range = QString("%1-%2").arg(currentPos).arg(chunk.end);
+    curl_easy_setopt(eh, CURLOPT_URL, m_url.toUtf8().constData());
+    if (m_supportsRanges) {
+        curl_easy_setopt(eh, CURLOPT_RANGE, range.toUtf8().constData());
+        // Only serve the range if the file is still the one probed;
+        // otherwise the server sends it whole with a 200.
+        QString validator = HttpHelper::ifRangeValue(m_etag, m_lastModified);
+        if (!validator.isEmpty()) {
+            chunk.requestHeaders = curl_slist_append(nullptr, ("If-Range: " + validator).toUtf8().constData());
+            curl_easy_setopt(eh, CURLOPT_HTTPHEADER, chunk.requestHeaders);
+        }
+    }
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, &chunk);
+    long bufferSize = kReceiveBufferSize;
+    double limit = RateLimiter::instance().rate();
+    if (limit > 0)
+        bufferSize = (long)std::clamp<double>(limit * RateLimiter::kBurstSeconds, kMinReceiveBufferSize, kReceiveBufferSize);
+    curl_easy_setopt(eh, CURLOPT_BUFFERSIZE, bufferSize);
+    curl_easy_setopt(eh, CURLOPT_PRIVATE, &chunk);
+    curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(eh, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT, 10L);
+    // Error bodies (429/503 pages) must never land in a part file.
+    curl_easy_setopt(eh, CURLOPT_FAILONERROR, 1L);
+
+    if (!avoidAddress.isEmpty()) {
+        // A hedge must not share the straggler's TCP flow. If another
+        // connection of ours reached a different server address, go there.
+        curl_easy_setopt(eh, CURLOPT_FRESH_CONNECT, 1L);
+        QString other;
+        for (const auto& c : m_chunks) {
+            if (!c.peerAddress.isEmpty() && c.peerAddress != avoidAddress) { other = c.peerAddress; break; }
+        }
+        if (!other.isEmpty()) {
+            QUrl u(m_url);
+            int port = u.port(u.scheme() == "https" ? 443 : 80);
+            if (other.contains(':')) other = "[" + other + "]";
+            QString rule = QString("%1:%2:%3:%2").arg(u.host()).arg(port).arg(other);
+            chunk.connectTo = curl_slist_append(nullptr, rule.toUtf8().constData());
+            curl_easy_setopt(eh, CURLOPT_CONNECT_TO, chunk.connectTo);
         }
-        
-        curl_multi_add_handle(m_multiHandle, eh);
     }
+
+    if (!m_engine->addHandle(eh, this)) {
+        curl_easy_cleanup(eh);
+        curl_slist_free_all(chunk.connectTo);
+        chunk.connectTo = nullptr;
+        curl_slist_free_all(chunk.requestHeaders);
+        chunk.requestHeaders = nullptr;
+        return false;
+    }
+    chunk.handle = eh;
+    chunk.responseChecked = false;
+    chunk.lastUpdate = std::chrono::steady_clock::now();
+    chunk.connectedAt = chunk.lastUpdate;
+    chunk.peerAddress.clear();
+    chunk.bytesAtAttempt = chunk.downloaded;
+    chunk.waitingRetry = false;
+    chunk.throttled = false;
+    m_easyHandles.push_back(eh);
     return true;
 }
 
-void DownloadWorker::performWork() {
-    if (!m_multiHandle || m_userPaused || m_cancelled || m_isNetworkError) return;
-    
-    int stillRunning = 0;
-    CURLMcode mc = curl_multi_perform(m_multiHandle, &stillRunning);
-    
-    if (mc != CURLM_OK) {
-        m_isNetworkError = true;
-        m_workTimer->stop();
-        m_networkRetryTimer->start(3000); 
-        emit statusChanged("Network lost. Retrying...");
-        return;
+void DownloadWorker::closeTransfer(CURL* handle) {
+    ChunkData* chunk = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, &chunk);
+    // Whatever the connection received is valid; write it out.
+    if (chunk) flushBuffer(*chunk);
+    if (m_engine) m_engine->removeHandle(handle);
+    curl_easy_cleanup(handle);
+    m_easyHandles.erase(std::remove(m_easyHandles.begin(), m_easyHandles.end(), handle), m_easyHandles.end());
+    if (chunk) {
+        chunk->handle = nullptr;
+        curl_slist_free_all(chunk->connectTo);
+        chunk->connectTo = nullptr;
+        curl_slist_free_all(chunk->requestHeaders);
+        chunk->requestHeaders = nullptr;
     }
+}
+
+int DownloadWorker::activeConnections() const {
+    // Hedges are temporary extras and do not count against the target.
+    int active = 0;
+    for (const auto& c : m_chunks) if (c.handle && !c.isHedge) ++active;
+    return active;
+}
+
+bool DownloadWorker::assignWork() {
+    // Ranges left without a connection (e.g. after a resume) come first.
+    for (auto& c : m_chunks) {
+        if (!c.completed && !c.handle && !c.waitingRetry && c.downloaded < c.size) return startChunkTransfer(c);
+    }
+    return stealWork();
+}
 
-    int msgsLeft;
-    CURLMsg* msg;
-    while ((msg = curl_multi_info_read(m_multiHandle, &msgsLeft))) {
-        if (msg->msg == CURLMSG_DONE) {
-            if (msg->data.result != CURLE_OK && msg->data.result != CURLE_PARTIAL_FILE) {
-                m_isNetworkError = true;
-                m_workTimer->stop();
-                m_networkRetryTimer->start(3000);
-                emit statusChanged("Connection dropped. Retrying...");
-                return;
+bool DownloadWorker::stealWork() {
+    if (!m_supportsRanges) return false;
+
+    ChunkData* victim = nullptr;
+    curl_off_t victimRemaining = 0;
+    for (auto& c : m_chunks) {
+        if (!c.handle || c.completed || c.partner || c.repairPiece >= 0) continue;
+        curl_off_t remaining = c.size - c.downloaded;
+        if (remaining > victimRemaining) { victim = &c; victimRemaining = remaining; }
+    }
+    if (!victim || victimRemaining < 2 * kMinSplitSize) return false;
+
+    // The victim keeps the lower half; its connection is cut off at the new
+    // end by writeCallback. The upper half goes to a fresh part file.
+    curl_off_t mid = victim->start + victim->downloaded + victimRemaining / 2;
+    ChunkData stolen;
+    stolen.id = m_nextChunkId;
+    stolen.start = mid;
+    stolen.end = victim->end;
+    stolen.size = stolen.end - stolen.start + 1;
+    stolen.downloaded = 0;
+    stolen.completed = false;
+    stolen.handle = nullptr;
+    stolen.filename = DownloadManager::getChunkFile(m_outputPath, m_downloadId, stolen.id);
+    stolen.lastUpdate = std::chrono::steady_clock::now();
+    if (!openChunkOutput(stolen, true)) return false;
+
+    ++m_nextChunkId;
+    victim->end = mid - 1;
+    victim->size = victim->end - victim->start + 1;
+
+    m_chunks.push_back(std::move(stolen));
+    bool started = startChunkTransfer(m_chunks.back());
+    saveState();
+    return started;
+}
+
+void DownloadWorker::checkStragglers() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<double> rates;
+    int hedges = 0;
+    for (auto& c : m_chunks) {
+        if (!c.handle) continue;
+        if (c.peerAddress.isEmpty()) {
+            char* ip = nullptr;
+            if (curl_easy_getinfo(c.handle, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK && ip && *ip)
+                c.peerAddress = QString::fromLatin1(ip);
+            // The scheduler budgets per server address as well as per host.
+            if (m_serverAddress.isEmpty() && !c.peerAddress.isEmpty()) {
+                m_serverAddress = c.peerAddress;
+                emit serverAddressChanged(m_serverAddress);
             }
         }
+        if (c.isHedge) ++hedges;
+        else rates.push_back(c.speed.rate());
     }
-    
-    if (stillRunning == 0) {
-        curl_off_t totalDownloaded = 0;
-        for(const auto& c : m_chunks) totalDownloaded += c.downloaded;
-        
-        if (totalDownloaded < m_fileSize) {
-             m_isNetworkError = true;
-             m_workTimer->stop();
-             m_networkRetryTimer->start(3000);
-             emit statusChanged("Stream stalled. Retrying...");
-             return;
+    if (!m_supportsRanges || hedges >= kMaxHedges || rates.empty()) return;
+    // Under a speed limit, slow connections are the limit at work.
+    if (RateLimiter::instance().rate() > 0) return;
+    // Hedges are extra connections to the same host; stay inside its budget.
+    if (activeConnections() + hedges >= m_controller.cap()) return;
+
+    std::nth_element(rates.begin(), rates.begin() + rates.size() / 2, rates.end());
+    double median = rates[rates.size() / 2];
+
+    // Hedge the connection that would finish last, if it is lagging.
+    ChunkData* worst = nullptr;
+    double worstFinish = 0;
+    for (auto& c : m_chunks) {
+        if (!c.handle || c.partner || c.writePaused || c.repairPiece >= 0) continue;
+        curl_off_t remaining = c.size - c.downloaded;
+        if (remaining < kMinSplitSize) continue;
+        if (now - c.connectedAt < std::chrono::seconds(kHedgeWarmupSeconds)) continue;
+
+        bool stalled = now - c.lastUpdate > std::chrono::seconds(kStallSeconds);
+        bool slow = rates.size() > 1 && c.speed.rate() < median * kStragglerRatio;
+        if (!stalled && !slow) continue;
+
+        double finish = c.speed.rate() > 0 ? remaining / c.speed.rate() : HUGE_VAL;
+        if (!worst || finish > worstFinish) { worst = &c; worstFinish = finish; }
+    }
+    if (worst) hedgeRange(*worst);
+}
+
+bool DownloadWorker::hedgeRange(ChunkData& slow) {
+    // The hedge races the straggler for the rest of its range on a fresh
+    // connection; whichever reaches the end first keeps it.
+    ChunkData hedge;
+    hedge.id = m_nextChunkId;
+    hedge.start = slow.start + slow.downloaded;
+    hedge.end = slow.end;
+    hedge.size = hedge.end - hedge.start + 1;
+    hedge.downloaded = 0;
+    hedge.completed = false;
+    hedge.handle = nullptr;
+    hedge.isHedge = true;
+    hedge.partner = &slow;
+    hedge.filename = DownloadManager::getChunkFile(m_outputPath, m_downloadId, hedge.id);
+    hedge.lastUpdate = std::chrono::steady_clock::now();
+    if (!openChunkOutput(hedge, true)) return false;
+
+    ++m_nextChunkId;
+    m_chunks.push_back(std::move(hedge));
+    ChunkData& h = m_chunks.back();
+    slow.partner = &h;
+    if (!startChunkTransfer(h, slow.peerAddress)) {
+        dropChunk(h);
+        return false;
+    }
+    saveState();
+    return true;
+}
+
+void DownloadWorker::settleHedge(ChunkData& original, bool hedgeWon) {
+    ChunkData* hedge = original.partner;
+    if (!hedge) return;
+    original.partner = nullptr;
+    hedge->partner = nullptr;
+
+    if (hedgeWon) {
+        // The original already holds everything up to where the hedge
+        // started, so cutting it there completes it.
+        if (original.handle) closeTransfer(original.handle);
+        original.end = hedge->start - 1;
+        original.size = original.end - original.start + 1;
+        original.downloaded = std::min(original.downloaded, original.size);
+        original.completed = original.downloaded >= original.size;
+        hedge->isHedge = false;
+    } else {
+        dropChunk(*hedge);
+    }
+    saveState();
+}
+
+void DownloadWorker::dropChunk(ChunkData& chunk) {
+    // Chunks live in a deque that others point into, so a dropped one stays
+    // as an empty, completed range that is never saved or merged.
+    if (chunk.partner) chunk.partner->partner = nullptr;
+    chunk.partner = nullptr;
+    if (chunk.handle) closeTransfer(chunk.handle);
+    // Pieces may have been hashed from its file.
+    if (m_pieces && chunk.size > 0) m_pieces->invalidate(chunk.start, chunk.end + 1);
+    // Writes still in flight keep the file open until they land.
+    chunk.mapped.reset();
+    chunk.output.reset();
+    if (!m_inPlace) QFile::remove(chunk.filename);
+    chunk.pendingWrites.clear();
+    chunk.written = 0;
+    chunk.end = chunk.start - 1;
+    chunk.size = 0;
+    chunk.downloaded = 0;
+    chunk.speed.reset();
+    chunk.completed = true;
+    chunk.isHedge = false;
+}
+
+bool DownloadWorker::openChunkOutput(ChunkData& chunk, bool truncate) {
+    chunk.worker = this;
+    if (m_inPlace) {
+        chunk.output = m_output;
+        chunk.fileOffset = chunk.start;
+        if (m_useMapped) chunk.mapped.reset(new MappedWriter(m_output, m_mapWindowSize, m_mapSyncInterval));
+        return true;
+    }
+    chunk.output = std::make_shared<OutputFile>();
+    chunk.fileOffset = 0;
+    if (!chunk.output->open(chunk.filename, -1, truncate)) {
+        chunk.output.reset();
+        return false;
+    }
+    if (useDirectIO()) chunk.output->enableDirectIO();
+    chunk.output->setKeepCached(m_verifier || m_pieces);
+    return true;
+}
+
+void DownloadWorker::keepOutputsCached() {
+    // The verifiers hash what was written from the page cache; Writeback
+    // must not evict it first.
+    bool keep = m_verifier || m_pieces;
+    if (m_output) m_output->setKeepCached(keep);
+    for (auto& c : m_chunks) if (c.output) c.output->setKeepCached(keep);
+}
+
+void DownloadWorker::flushBuffer(ChunkData& chunk) {
+    if (!chunk.buffer) return;
+    if (chunk.buffered == 0 || !chunk.output || !m_writer || m_writeError) {
+        chunk.buffer.reset();
+        chunk.buffered = 0;
+        return;
+    }
+    auto request = std::make_unique<DiskWriter::Request>();
+    request->file = chunk.output;
+    request->length = chunk.buffered;
+    request->offset = chunk.fileOffset + chunk.downloaded - (curl_off_t)chunk.buffered;
+    request->data = std::move(chunk.buffer);
+    request->client = this;
+    request->tag = &chunk;
+    chunk.buffered = 0;
+    chunk.pendingWrites.push_back({chunk.downloaded, false});
+    m_writer->submit(std::move(request));
+}
+
+void DownloadWorker::prepareOutput() {
+    m_useMapped = false;
+    if (!m_output) return;
+    // A mapping over a sparse file turns a full disk into SIGBUS.
+    if (m_mappedOutput) {
+        m_useMapped = m_output->isPreallocated();
+        if (!m_useMapped) qWarning() << "Cannot reserve space for" << m_output->path() << "- not mapping it";
+    }
+    if (!m_useMapped && useDirectIO()) m_output->enableDirectIO();
+}
+
+bool DownloadWorker::useDirectIO() const {
+    return m_unbufferedIO && m_fileSize >= kDirectIOMinSize;
+}
+
+void DownloadWorker::attachWriter() {
+    m_writer = DiskWriter::forCurrentThread();
+    connect(m_writer, &DiskWriter::decongested, this, &DownloadWorker::resumePausedWrites, Qt::UniqueConnection);
+}
+
+std::vector<ChunkRange> DownloadWorker::chunkRanges() const {
+    std::vector<ChunkRange> ranges;
+    for (const auto& c : m_chunks) {
+        if (c.size <= 0 || c.repairPiece >= 0) continue; // dropped hedge, or rewriting part of another range
+        ChunkRange r{c.id, c.start, c.end};
+        // While a hedge races, record the split it would leave behind so a
+        // saved state never has overlapping ranges.
+        if (c.partner && !c.isHedge) r.end = c.partner->start - 1;
+        // Only what has reached the disk counts; with writes completing out
+        // of order, a part file's size is no proof either.
+        r.downloaded = std::min(c.written, r.end - r.start + 1);
+        ranges.push_back(r);
+    }
+    return ranges;
+}
+
+void DownloadWorker::checkpoint(bool now) {
+    // Without range requests a retry starts over at byte zero; there is no
+    // progress worth making durable.
+    if (!m_journal || !m_supportsRanges) return;
+    std::vector<ChunkRange> ranges = chunkRanges();
+    curl_off_t written = 0;
+    for (const auto& r : ranges) written += r.downloaded;
+    auto t = std::chrono::steady_clock::now();
+    if (!now && written - m_checkpointedBytes < m_checkpointBytes &&
+        t - m_lastCheckpoint < std::chrono::seconds(m_checkpointSeconds)) return;
+
+    std::vector<std::shared_ptr<OutputFile>> files;
+    if (m_output) files.push_back(m_output);
+    else for (const auto& c : m_chunks) if (c.output) files.push_back(c.output);
+    if (now) m_journal->checkpointNow(files, ranges);
+    else if (!m_journal->checkpoint(files, ranges)) return; // still syncing the last one
+    m_checkpointedBytes = written;
+    m_lastCheckpoint = t;
+}
+
+void DownloadWorker::feedVerifier() {
+    if (!m_verifier && !m_pieces) return;
+    std::vector<StreamVerifier::Segment> segments;
+    for (const auto& r : chunkRanges()) {
+        StreamVerifier::Segment s{r.id, r.start, r.end - r.start + 1, r.downloaded, QString(), 0};
+        if (m_inPlace) {
+            s.path = m_output->path();
+            s.fileOffset = r.start;
+        } else if (r.end < m_mergedBytes) {
+            // Merged before an interruption; the part file is gone.
+            s.path = DownloadManager::getMergeFile(m_outputPath, m_downloadId);
+            s.fileOffset = r.start;
+        } else {
+            s.path = DownloadManager::getChunkFile(m_outputPath, m_downloadId, r.id);
         }
+        segments.push_back(s);
+    }
+    if (m_pieces) m_pieces->update(segments);
+    if (m_verifier) m_verifier->update(std::move(segments));
+}
 
-        m_workTimer->stop();
-        m_progressTimer->stop();
-        emit statusChanged("Merging files...");
-        
-        for (auto& chunk : m_chunks) { if (chunk.file) fclose(chunk.file); chunk.file = nullptr; }
-        
-        QString finalPath;
-        if (DownloadManager::mergeChunks(m_downloadId, m_outputPath, m_numChunks, finalPath)) {
-             QString targetPath = QDir(m_outputPath).filePath(m_filename);
-             if (QFile::exists(targetPath)) QFile::remove(targetPath);
-             QFile::rename(finalPath, targetPath);
-             DownloadManager::cleanupChunks(m_downloadId, m_numChunks);
-             emit downloadFinished(true, "Completed");
+void DownloadWorker::startPieceVerifier(bool resuming) {
+    m_pieces.reset();
+    m_pieceRepairs.clear();
+    m_awaitingPieces = false;
+    // A resume checks against what was settled on when the download
+    // started, local hashes computed since included.
+    PieceManifest manifest;
+    if (!resuming || !PieceManifest::load(PieceManifest::path(m_downloadId), manifest)) {
+        if (m_manifest.isValid()) manifest = m_manifest;
+        else if (m_hashPieces) manifest = PieceManifest::local(m_fileSize);
+        else return;
+        manifest.save(PieceManifest::path(m_downloadId));
+    }
+    if (!manifest.fits(m_fileSize)) {
+        qWarning() << "Piece hashes do not match the file size; not checking pieces";
+        return;
+    }
+    m_pieces.reset(new PieceVerifier(manifest, m_fileSize));
+    m_piecesShown = ~quint64(0); // the first states always go out
+}
+
+bool DownloadWorker::servicePieces() {
+    if (!m_pieces) return true;
+
+    // A piece goes back to the verifier once every repair of it is on disk.
+    QMap<int, bool> repaired;
+    for (const auto& c : m_chunks) {
+        if (c.repairPiece < 0) continue;
+        bool written = c.completed && c.written >= c.size;
+        repaired[c.repairPiece] = repaired.value(c.repairPiece, true) && written;
+    }
+    for (auto it = repaired.constBegin(); it != repaired.constEnd(); ++it) {
+        if (!it.value()) continue;
+        for (auto& c : m_chunks) {
+            if (c.repairPiece != it.key()) continue;
+            // Retired like a dropped hedge; its bytes belong to the range
+            // it rewrote.
+            c.mapped.reset();
+            c.output.reset();
+            c.end = c.start - 1;
+            c.size = 0;
+            c.downloaded = 0;
+            c.written = 0;
+            c.speed.reset();
+            c.repairPiece = -1;
+        }
+        m_pieces->recheck(it.key());
+        // The whole-file digest may have taken in the bad copy.
+        if (m_verifier) m_verifier->reset();
+    }
+
+    for (int piece : m_pieces->takeFailed()) {
+        QString error;
+        if (!m_supportsRanges) error = QString("Piece %1 failed verification").arg(piece);
+        else if (++m_pieceRepairs[piece] > kMaxPieceRepairs) error = QString("Piece %1 keeps failing verification").arg(piece);
+        else if (!repairPiece(piece)) error = QString("Cannot fetch piece %1 again").arg(piece);
+        if (error.isEmpty()) continue;
+        cleanup();
+        saveState();
+        emit downloadFinished(false, error);
+        return false;
+    }
+
+    quint64 version = 0;
+    QByteArray states = m_pieces->states(version);
+    if (version != m_piecesShown) {
+        m_piecesShown = version;
+        emit pieceStatesUpdated(m_pieces->pieceLength(), states);
+    }
+    return true;
+}
+
+bool DownloadWorker::repairPiece(int piece) {
+    curl_off_t first = m_pieces->pieceStart(piece);
+    curl_off_t last = m_pieces->pieceEnd(piece) - 1;
+    emit statusChanged(QString("Piece %1 is damaged, fetching it again...").arg(piece));
+
+    // One repair per range the piece overlaps, writing where that range does.
+    for (const auto& r : chunkRanges()) {
+        if (r.end < first || r.start > last) continue;
+        auto owner = std::find_if(m_chunks.begin(), m_chunks.end(), [&r](const ChunkData& c) { return c.id == r.id; });
+        if (owner == m_chunks.end()) return false;
+
+        ChunkData repair;
+        repair.id = m_nextChunkId++;
+        repair.start = std::max(first, r.start);
+        repair.end = std::min(last, r.end);
+        repair.size = repair.end - repair.start + 1;
+        repair.downloaded = 0;
+        repair.completed = false;
+        repair.handle = nullptr;
+        repair.repairPiece = piece;
+        repair.filename = owner->filename;
+        repair.lastUpdate = std::chrono::steady_clock::now();
+        if (m_inPlace) {
+            if (!openChunkOutput(repair, false)) return false;
+        } else if (r.end < m_mergedBytes) {
+            // Merged before an interruption; the bytes live in the merge file.
+            repair.worker = this;
+            repair.output = std::make_shared<OutputFile>();
+            repair.fileOffset = repair.start;
+            if (!repair.output->open(DownloadManager::getMergeFile(m_outputPath, m_downloadId), -1, false)) return false;
         } else {
-             emit downloadFinished(false, "Merge Error");
+            if (!owner->output) return false;
+            repair.worker = this;
+            repair.output = owner->output;
+            repair.fileOffset = owner->fileOffset + (repair.start - owner->start);
         }
+        m_chunks.push_back(std::move(repair));
+        // Left for assignWork() if no connection can be had right now.
+        startChunkTransfer(m_chunks.back());
+    }
+    return true;
+}
+
+void DownloadWorker::saveState() {
+    DownloadState state;
+    state.url = m_url;
+    state.outputPath = m_outputPath;
+    state.filename = m_filename;
+    state.fileSize = m_fileSize;
+    state.inPlace = m_inPlace;
+    state.etag = m_etag;
+    state.lastModified = m_lastModified;
+    state.checksum = m_checksum.toString();
+    state.ranges = chunkRanges();
+    for (const auto& r : state.ranges) state.done.add(r.start, r.start + r.downloaded);
+    DownloadManager::saveState(m_downloadId, state);
+}
+
+void DownloadWorker::transferDone(CURL* handle, CURLcode result) {
+    if (handle == m_probeHandle) { onProbeFinished(result); return; }
+    if (handle == m_manifestHandle) { onManifestFetched(result); return; }
+
+    ChunkData* chunk = nullptr;
+    long httpCode = 0;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, &chunk);
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    closeTransfer(handle);
+
+    if (m_userPaused || m_cancelled || !chunk) return;
+    if (m_remoteChanged) { restartDownload(); return; }
+
+    if (chunk->partner) {
+        // Settle a hedge race: a finished range wins, a failed one leaves
+        // the field to the other connection. Either way this chunk ends up
+        // complete (or dropped) and its connection is free.
+        bool finished = chunk->downloaded >= chunk->size;
+        ChunkData& original = chunk->isHedge ? *chunk->partner : *chunk;
+        settleHedge(original, finished == chunk->isHedge);
+    }
+
+    // A connection cut short because its tail was stolen reports a write
+    // error, but its (shrunken) range is complete.
+    bool rangeDone = chunk->downloaded >= chunk->size;
+    bool refused = result == CURLE_COULDNT_CONNECT ||
+                   (result == CURLE_HTTP_RETURNED_ERROR && (httpCode == 429 || httpCode == 503));
+    if (!rangeDone && refused && activeConnections() > 0) {
+        // The server wants fewer connections. Lower the ceiling; the range
+        // stays unassigned until one of the remaining connections frees up.
+        m_controller.onRefused(activeConnections());
+        m_numChunks = m_controller.target();
+        emit statusChanged(QString("Server refused a connection, using %1").arg(m_numChunks));
+        return;
+    }
+    if (!rangeDone) {
+        // Only this range is retried; the other connections keep streaming.
+        QString cause;
+        if (result == CURLE_OK) cause = "Stream ended early";
+        else if (result == CURLE_HTTP_RETURNED_ERROR) cause = QString("HTTP %1").arg(httpCode);
+        else cause = QString::fromUtf8(curl_easy_strerror(result));
+        scheduleRetry(*chunk, cause);
+        return;
+    }
+    chunk->completed = true;
+
+    // Keep the freed connection busy until the very end, unless the
+    // controller has decided to run with fewer.
+    if (activeConnections() < m_numChunks) assignWork();
+
+    if (m_easyHandles.empty() && allRangesDone()) finishDownload();
+}
+
+bool DownloadWorker::scheduleRetry(ChunkData& chunk, const QString& cause) {
+    if (chunk.downloaded > chunk.bytesAtAttempt) chunk.failuresInRow = 0;
+    ++chunk.failuresInRow;
+    ++chunk.retries;
+    chunk.lastError = cause;
+
+    if (chunk.failuresInRow > kMaxRetries) {
+        cleanup();
+        saveState();
+        emit downloadFinished(false, QString("Network Error: %1").arg(cause));
+        return false;
+    }
+
+    if (!m_supportsRanges) {
+        // Without range requests the only way back in is from byte zero.
+        // Let the old attempt's writes land before truncating under them.
+        if (m_writer) m_writer->drain(this);
+        if (!m_inPlace) openChunkOutput(chunk, true);
+        chunk.pendingWrites.clear();
+        chunk.written = 0;
+        chunk.downloaded = 0;
+        chunk.speed.reset();
+        m_bytesAtStart = 0;
+        if (m_verifier) m_verifier->reset();
+        if (m_pieces) m_pieces->invalidate(chunk.start, chunk.end + 1);
+    }
+
+    // Exponential backoff with "equal jitter": half the delay is fixed, the
+    // other half random, so connections that failed together do not all
+    // come back at the same instant.
+    int delay = std::min(kRetryMaxMs, kRetryBaseMs << std::min(chunk.failuresInRow - 1, 16));
+    delay = delay / 2 + (int)QRandomGenerator::global()->bounded(delay / 2 + 1);
+    chunk.waitingRetry = true;
+    chunk.retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+    armRetryTimer();
+
+    if (m_easyHandles.empty())
+        emit statusChanged(QString("Connection lost (%1). Retrying in %2s...").arg(cause).arg((delay + 999) / 1000));
+    return true;
+}
+
+void DownloadWorker::armRetryTimer() {
+    bool waiting = false;
+    std::chrono::steady_clock::time_point next;
+    for (const auto& c : m_chunks) {
+        if (!c.waitingRetry) continue;
+        if (!waiting || c.retryAt < next) next = c.retryAt;
+        waiting = true;
+    }
+    if (!waiting) { m_networkRetryTimer->stop(); return; }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+    m_networkRetryTimer->start((int)std::max<long long>(0, ms));
+}
+
+bool DownloadWorker::allRangesDone() const {
+    for (const auto& c : m_chunks) if (!c.completed) return false;
+    return true;
+}
+
+void DownloadWorker::finishDownload() {
+    // Every range claims to be complete; double check before merging.
+    bool incomplete = false;
+    for (auto& c : m_chunks) {
+        if (c.downloaded >= c.size) continue;
+        c.completed = false;
+        if (!scheduleRetry(c, "Range incomplete")) return;
+        incomplete = true;
+    }
+    if (incomplete) return;
+
+    // Everything is received; wait for it to be written.
+    if (m_writer) m_writer->drain(this);
+    if (m_writeError) return; // onWriteError() reports it
+
+    if (m_pieces && !m_pieces->settled()) {
+        // Hashing may trail the download, and failed pieces are being
+        // fetched again; updateProgress() comes back once all check out.
+        feedVerifier();
+        if (!m_awaitingPieces) emit statusChanged("Verifying pieces...");
+        m_awaitingPieces = true;
+        if (!m_progressTimer->isActive()) m_progressTimer->start(200);
+        return;
     }
+    m_awaitingPieces = false;
+    m_progressTimer->stop();
+    // Done with checkpoints; the files are closed next.
+    m_journal.reset();
+    feedVerifier();
+    QString targetPath = QDir(m_outputPath).filePath(m_filename);
+
+    if (m_inPlace) {
+        // Every byte is already in place; finishing is a rename, unless
+        // staging had to fall back to another filesystem.
+        for (auto& chunk : m_chunks) chunk.mapped.reset();
+        m_output->close();
+        QString partial = m_output->path();
+        finishInBackground("Moving", "Finalize Error", [partial, targetPath](const DownloadManager::Progress& progress) {
+            return DownloadManager::moveFile(partial, targetPath, progress);
+        });
+        return;
+    }
+
+    emit statusChanged("Merging files...");
+    for (auto& chunk : m_chunks) chunk.output.reset();
+
+    QString id = m_downloadId;
+    QString outPath = m_outputPath;
+    std::vector<ChunkRange> ranges = chunkRanges();
+    finishInBackground("Merging", "Merge Error", [id, outPath, ranges, targetPath](const DownloadManager::Progress& progress) {
+        QString merged;
+        return DownloadManager::mergeChunks(id, outPath, ranges, merged, progress) &&
+               DownloadManager::moveFile(merged, targetPath, progress);
+    });
+}
+
+void DownloadWorker::finishInBackground(const QString& label, const QString& failure,
+                                        std::function<bool(const DownloadManager::Progress&)> job) {
+    // Merging or moving gigabytes must not stall the network thread, which
+    // other downloads share.
+    DownloadManager::Progress progress = statusProgress(label);
+    // Nothing is put in place before the checksum matched. The verifier
+    // usually kept up with the download and has little left to read.
+    std::shared_ptr<StreamVerifier> verifier(m_verifier.release());
+    DownloadManager::Progress verifying = statusProgress("Verifying");
+    auto verdict = std::make_shared<QString>();
+
+    m_stopFinishing = false;
+    m_finishedOk = false;
+    QThread* thread = QThread::create([this, job, progress, verifier, verifying, verdict]() {
+        if (verifier) {
+            if (!verifier->finish(verifying, *verdict)) return;
+            QMetaObject::invokeMethod(this, [this]() {
+                emit statusChanged(QString("Checksum OK (%1)").arg(Checksum::algorithmName(m_checksum.algorithm)));
+            }, Qt::QueuedConnection);
+        }
+        m_finishedOk = job(progress);
+    });
+    thread->setParent(this);
+    m_finishThread = thread;
+    connect(thread, &QThread::finished, this, [this, thread, failure, verdict]() {
+        thread->deleteLater();
+        if (m_finishThread != thread) return; // superseded by a later attempt
+        m_finishThread = nullptr;
+        if (m_userPaused || m_cancelled) return; // resumable: the merge journal or the source remains
+        if (m_finishedOk) {
+            // Locally computed hashes go next to the file, to check it against later.
+            if (m_pieces && m_hashPieces)
+                m_pieces->manifest().save(QDir(m_outputPath).filePath(m_filename) + PieceManifest::kSuffix);
+            DownloadManager::cleanupChunks(m_outputPath, m_downloadId, chunkRanges());
+            emit downloadFinished(true, "Completed");
+        } else {
+            emit downloadFinished(false, verdict->isEmpty() ? failure : *verdict);
+        }
+    });
+    thread->start();
+}
+
+DownloadManager::Progress DownloadWorker::statusProgress(const QString& label) {
+    auto lastPercent = std::make_shared<std::atomic<int>>(-1);
+    return [this, label, lastPercent](qint64 done, qint64 total) {
+        int percent = total > 0 ? (int)(done * 100 / total) : 100;
+        if (lastPercent->exchange(percent) != percent) {
+            QMetaObject::invokeMethod(this, [this, label, percent]() {
+                emit statusChanged(QString("%1 %2%").arg(label).arg(percent));
+            }, Qt::QueuedConnection);
+        }
+        return !m_stopFinishing;
+    };
 }
 
 void DownloadWorker::pauseDownload() {
+    suspend("Paused");
+}
+
+void DownloadWorker::yieldDownload() {
+    suspend("Queued");
+}
+
+void DownloadWorker::suspend(const QString& status) {
+    // Finished and cleaned up; a saved state would only resurrect it.
+    if (m_finishedOk) return;
     m_userPaused = true;
-    m_workTimer->stop();
     m_networkRetryTimer->stop();
     
-    for (auto& chunk : m_chunks) if (chunk.file) fflush(chunk.file);
-    
-    DownloadManager::saveState(m_downloadId, m_url, m_outputPath, m_filename, m_numChunks, m_fileSize);
+    // Closing the connections hands their buffered data to the writer.
+    releaseHandles();
+    if (m_writer) m_writer->drain(this);
+    // Paused before the probe finished: nothing to resume from yet.
+    if (!m_chunks.empty()) {
+        saveState();
+        checkpoint(true);
+        if (m_pieces) m_pieces->manifest().save(PieceManifest::path(m_downloadId));
+    }
     emit downloadPaused(m_downloadId);
     
     curl_off_t totalDownloaded = 0;
-    for(const auto& c : m_chunks) totalDownloaded += c.downloaded;
+    for(const auto& c : m_chunks) if (!c.isHedge && c.repairPiece < 0) totalDownloaded += c.downloaded;
     double progress = m_fileSize > 0 ? (double)totalDownloaded / m_fileSize : 0;
     
     // UI: Pause Speed 0
-    emit progressUpdated(progress, totalDownloaded, m_fileSize, 0, 0); 
-    emit statusChanged("Paused");
+    emit progressUpdated(progress, totalDownloaded, m_fileSize, 0, 0, 0, 0);
+    emit statusChanged(status);
     
     cleanup(); 
 }
@@ -220,116 +1036,370 @@ void DownloadWorker::pauseDownload() {
 void DownloadWorker::resumeDownload(const QString& downloadId) {
     m_downloadId = downloadId;
     
-    QString url, outPath, fname;
-    curl_off_t fsize;
-    int chunks;
-    if (!DownloadManager::loadState(downloadId, url, outPath, fname, chunks, fsize)) {
+    DownloadState state;
+    if (!DownloadManager::loadState(downloadId, state)) {
         emit downloadFinished(false, "Resume failed: State missing");
         return;
     }
     
-    m_url = url; m_outputPath = outPath; m_filename = fname; m_numChunks = chunks; m_fileSize = fsize;
+    m_url = state.url; m_outputPath = state.outputPath; m_filename = state.filename; m_fileSize = state.fileSize;
+    m_etag = state.etag; m_lastModified = state.lastModified;
+    if (!m_checksum.isValid()) m_checksum = Checksum::parse(state.checksum);
+    m_supportsRanges = true; // a resume is only possible with range requests
+    m_remoteChanged = false;
+    m_numChunks = m_controller.target();
     
     m_chunks.clear();
-    m_chunks.resize(chunks); 
     m_easyHandles.clear();
+    m_nextChunkId = 1;
     
     m_bytesAtStart = 0; // Reset accumulator
 
-    curl_off_t chunkSize = m_fileSize / chunks;
-    for(int i=0; i<chunks; ++i) {
-        m_chunks[i].id = i+1;
-        m_chunks[i].start = i * chunkSize;
-        m_chunks[i].end = (i == chunks - 1) ? m_fileSize - 1 : (i + 1) * chunkSize - 1;
-        m_chunks[i].size = m_chunks[i].end - m_chunks[i].start + 1;
-        m_chunks[i].filename = DownloadManager::getChunkFile(m_downloadId, i+1);
-        
-        QFile f(m_chunks[i].filename);
-        m_chunks[i].downloaded = f.exists() ? f.size() : 0;
-        
-        // --- ACCUMULATE EXISTING BYTES ---
-        m_bytesAtStart += m_chunks[i].downloaded;
-
-        m_chunks[i].file = fopen(m_chunks[i].filename.toLocal8Bit().constData(), "ab");
-        if(!m_chunks[i].file) { emit downloadFinished(false, "File access error"); return; }
+    m_output.reset();
+    m_inPlace = state.inPlace;
+    if (m_inPlace) {
+        m_output = std::make_shared<OutputFile>();
+        QString partial = DownloadManager::getPartialFile(m_outputPath, m_filename, m_downloadId);
+        if (!QFile::exists(partial) || !m_output->open(partial, m_fileSize, false)) {
+            m_output.reset();
+            emit downloadFinished(false, "Resume failed: partial file missing");
+            return;
+        }
     }
-    
-    m_multiHandle = curl_multi_init();
-    curl_multi_setopt(m_multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, chunks);
-    curl_multi_setopt(m_multiHandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-    
-    for(int i=0; i<chunks; ++i) {
-        if(m_chunks[i].downloaded >= m_chunks[i].size) continue;
+    prepareOutput();
 
-        CURL* eh = curl_easy_init();
-        m_easyHandles.push_back(eh);
-        curl_off_t currentPos = m_chunks[i].start + m_chunks[i].downloaded;
-        QString range = QString("%1-%2").arg(currentPos).arg(m_chunks[i].end);
-        
-        curl_easy_setopt(eh, CURLOPT_URL, m_url.toUtf8().constData());
-        curl_easy_setopt(eh, CURLOPT_RANGE, range.toUtf8().constData());
-        curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writeCallback);
-        curl_easy_setopt(eh, CURLOPT_WRITEDATA, &m_chunks[i]);
-        curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(eh, CURLOPT_SSL_VERIFYPEER, 0L);
+    // Parts already merged before an interruption were deleted.
+    qint64 merged = m_inPlace ? 0 : DownloadManager::mergedBytes(m_downloadId);
+    m_mergedBytes = merged;
+
+    for (const auto& r : state.ranges) {
+        ChunkData c;
+        c.id = r.id;
+        c.start = r.start;
+        c.end = r.end;
+        c.size = c.end - c.start + 1;
+        c.handle = nullptr;
+        c.filename = DownloadManager::getChunkFile(m_outputPath, m_downloadId, c.id);
+        c.lastUpdate = std::chrono::steady_clock::now();
         
-        // Apply speed limit if set
-        if (m_speedLimit > 0) {
-            curl_off_t limitPerHandle = (curl_off_t)(m_speedLimit / chunks);
-            curl_easy_setopt(eh, CURLOPT_MAX_RECV_SPEED_LARGE, limitPerHandle);
+        // Only bytes the state records as written count. A part may hold
+        // bytes past a range that was shrunk by a split, or fewer than
+        // recorded if it was lost; states from before byte tracking fall
+        // back to the part's size.
+        if (m_inPlace) {
+            c.downloaded = std::clamp<curl_off_t>(r.downloaded, 0, c.size);
+        } else if (c.end < merged) {
+            c.downloaded = c.size;
+        } else {
+            QFile f(c.filename);
+            c.downloaded = f.exists() ? std::min<curl_off_t>(f.size(), c.size) : 0;
+            if (r.downloaded >= 0) c.downloaded = std::min(c.downloaded, r.downloaded);
         }
+        c.written = c.downloaded;
+        c.completed = c.downloaded >= c.size;
         
-        curl_multi_add_handle(m_multiHandle, eh);
+        // --- ACCUMULATE EXISTING BYTES ---
+        m_bytesAtStart += c.downloaded;
+        m_nextChunkId = std::max(m_nextChunkId, c.id + 1);
+
+        if (!openChunkOutput(c, false)) { cleanup(); emit downloadFinished(false, "File access error"); return; }
+        m_chunks.push_back(std::move(c));
     }
 
+    if (!haveDiskSpace(m_inPlace)) {
+        cleanup();
+        return;
+    }
+    reserveSpace();
+    m_writeError = 0;
+    
     m_userPaused = false;
-    m_isNetworkError = false;
+    m_engine = TransferEngine::forCurrentThread();
+    attachWriter();
     
     // Reset timer
+    m_journal.reset(new ProgressJournal(m_downloadId));
+    m_checkpointedBytes = m_bytesAtStart;
+    // What is already on disk is read back in the background while the
+    // rest downloads.
+    if (m_checksum.isValid()) m_verifier.reset(new StreamVerifier(m_checksum, m_fileSize));
+    startPieceVerifier(true);
+    keepOutputsCached();
+    feedVerifier();
+
     m_globalStartTime = std::chrono::steady_clock::now();
+    m_lastCheckpoint = m_globalStartTime;
+    m_lastSampleTime = m_globalStartTime;
+    m_lastSampleBytes = m_bytesAtStart;
+    m_speed.reset();
     
-    m_workTimer->start(0);
+    // Fill the connection budget: unfinished ranges first, then splits.
+    while (activeConnections() < m_numChunks && assignWork()) {}
+    if (m_easyHandles.empty()) { finishDownload(); return; }
+
     m_progressTimer->start(200);
     emit statusChanged("Resumed");
 }
 
 void DownloadWorker::cleanup() {
-    m_workTimer->stop();
     m_progressTimer->stop();
     m_networkRetryTimer->stop();
-    if (m_multiHandle) {
-        for (auto h : m_easyHandles) { curl_multi_remove_handle(m_multiHandle, h); curl_easy_cleanup(h); }
-        curl_multi_cleanup(m_multiHandle);
-        m_multiHandle = nullptr;
-        m_easyHandles.clear();
+    m_throttleTimer->stop();
+    if (m_finishThread) {
+        // Stops at the next step; a merge picks up there later.
+        m_stopFinishing = true;
+        m_finishThread->wait();
     }
-    for (auto& chunk : m_chunks) { if (chunk.file) fclose(chunk.file); chunk.file = nullptr; }
+    releaseHandles();
+    if (m_writer) m_writer->drain(this);
+    m_journal.reset(); // waits for a checkpoint syncing the files
+    m_verifier.reset();
+    m_pieces.reset();
+    m_awaitingPieces = false;
+    for (auto& chunk : m_chunks) {
+        chunk.mapped.reset();
+        chunk.output.reset();
+    }
+    if (m_output) m_output->close();
+}
+
+void DownloadWorker::releaseHandles() {
+    if (m_probeHandle) {
+        if (m_engine) m_engine->removeHandle(m_probeHandle);
+        curl_easy_cleanup(m_probeHandle);
+        m_probeHandle = nullptr;
+    }
+    if (m_manifestHandle) {
+        if (m_engine) m_engine->removeHandle(m_manifestHandle);
+        curl_easy_cleanup(m_manifestHandle);
+        m_manifestHandle = nullptr;
+    }
+    std::vector<CURL*> handles = m_easyHandles;
+    for (auto h : handles) closeTransfer(h);
 }
 
 size_t DownloadWorker::writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t realSize = size * nmemb;
     ChunkData* chunk = static_cast<ChunkData*>(userp);
-    if (!chunk || !chunk->file) return 0;
-    size_t written = fwrite(contents, 1, realSize, chunk->file);
-    if (written == realSize) {
-        chunk->downloaded += written;
+    if (!chunk || !chunk->output || !chunk->worker) return 0;
+    DownloadWorker* self = chunk->worker;
+    if (!self->m_writer || self->m_writeError) return 0;
+
+    if (!chunk->responseChecked) {
+        chunk->responseChecked = true;
+        long httpCode = 0;
+        curl_easy_getinfo(chunk->handle, CURLINFO_RESPONSE_CODE, &httpCode);
+        // A range request answered with the whole file: If-Range did not
+        // match, so this body is a different version starting at byte 0.
+        // Not one byte of it may land in this range.
+        if (self->m_supportsRanges && httpCode == 200) {
+            self->m_remoteChanged = true;
+            return 0;
+        }
+    }
+
+    // Never write past the range end: another connection may own the tail.
+    // Returning short aborts this transfer once its range is full.
+    curl_off_t room = chunk->size - chunk->downloaded;
+    if (room <= 0) return 0;
+    size_t toWrite = std::min<size_t>(realSize, (size_t)room);
+
+    if (chunk->mapped) {
+        if (!self->takeTokens(*chunk, toWrite)) return CURL_WRITEFUNC_PAUSE;
+        int error = chunk->mapped->write(static_cast<const char*>(contents), toWrite,
+                                         chunk->fileOffset + chunk->downloaded);
+        if (error) {
+            self->m_writeError = error;
+            QMetaObject::invokeMethod(self, "onWriteError", Qt::QueuedConnection);
+            return 0;
+        }
+        // In the page cache now, which survives a crash of this process.
+        chunk->downloaded += toWrite;
+        chunk->written = chunk->downloaded;
         chunk->lastUpdate = std::chrono::steady_clock::now();
+        return toWrite;
+    }
+
+    // curl takes all of a piece or none of it, so get every block this
+    // piece will spill into before copying anything. Without them (disk
+    // behind, or the pool at its cap) hold the connection; curl delivers
+    // the same data again once it is resumed.
+    size_t space = chunk->buffer ? chunk->bufferLimit - chunk->buffered : 0;
+    std::vector<BufferPool::Buffer> blocks;
+    if (toWrite > space) {
+        if (self->m_writer->congested()) {
+            chunk->writePaused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        curl_off_t pos = chunk->fileOffset + chunk->downloaded + (curl_off_t)space;
+        size_t need = toWrite - space;
+        while (need > 0) {
+            BufferPool::Buffer block = BufferPool::instance().acquire();
+            if (!block) {
+                chunk->writePaused = true;
+                return CURL_WRITEFUNC_PAUSE;
+            }
+            size_t limit = block.capacity() - (size_t)(pos % (curl_off_t)block.capacity());
+            need -= std::min(need, limit);
+            pos += limit;
+            blocks.push_back(std::move(block));
+        }
+    }
+    // Last: tokens are only spent on data that is taken.
+    if (!self->takeTokens(*chunk, toWrite)) return CURL_WRITEFUNC_PAUSE;
+
+    const char* in = static_cast<const char*>(contents);
+    size_t left = toWrite;
+    size_t nextBlock = 0;
+    while (left > 0) {
+        if (!chunk->buffer) {
+            chunk->buffer = std::move(blocks[nextBlock++]);
+            curl_off_t pos = chunk->fileOffset + chunk->downloaded;
+            chunk->bufferLimit = chunk->buffer.capacity() - (size_t)(pos % (curl_off_t)chunk->buffer.capacity());
+            chunk->buffered = 0;
+        }
+        size_t n = std::min(left, chunk->bufferLimit - chunk->buffered);
+        memcpy(chunk->buffer.data() + chunk->buffered, in, n);
+        chunk->buffered += n;
+        chunk->downloaded += n;
+        in += n;
+        left -= n;
+        if (chunk->buffered == chunk->bufferLimit || chunk->downloaded >= chunk->size) self->flushBuffer(*chunk);
+    }
+    chunk->lastUpdate = std::chrono::steady_clock::now();
+    return toWrite;
+}
+
+void DownloadWorker::writeDone(void* tag, curl_off_t offset, size_t length, int error) {
+    ChunkData* chunk = static_cast<ChunkData*>(tag);
+    if (error && !m_writeError) {
+        m_writeError = error;
+        QMetaObject::invokeMethod(this, "onWriteError", Qt::QueuedConnection);
+    }
+    // A failed write stays pending forever, so `written` never passes it.
+    curl_off_t end = offset - chunk->fileOffset + (curl_off_t)length;
+    for (auto& w : chunk->pendingWrites) {
+        if (w.first == end) { w.second = !error; break; }
+    }
+    while (!chunk->pendingWrites.empty() && chunk->pendingWrites.front().second) {
+        chunk->written = chunk->pendingWrites.front().first;
+        chunk->pendingWrites.pop_front();
+    }
+}
+
+void DownloadWorker::resumePausedWrites() {
+    if (m_userPaused || m_cancelled) return;
+    if (!m_writer || m_writer->congested() || BufferPool::instance().exhausted()) return;
+    for (auto& c : m_chunks) {
+        if (!c.writePaused) continue;
+        c.writePaused = false;
+        c.lastUpdate = std::chrono::steady_clock::now();
+        // May call writeCallback right away (and pause again).
+        if (c.handle) curl_easy_pause(c.handle, CURLPAUSE_CONT);
+    }
+}
+
+bool DownloadWorker::takeTokens(ChunkData& chunk, size_t bytes) {
+    int retryMs = 0;
+    if (RateLimiter::instance().acquire(m_rateFlow, bytes, retryMs)) return true;
+    chunk.throttled = true;
+    // Passed over for a download that is due gets a sooner retry than an empty bucket.
+    if (!m_throttleTimer->isActive() || m_throttleTimer->remainingTime() > retryMs)
+        m_throttleTimer->start(retryMs);
+    return false;
+}
+
+void DownloadWorker::resumeThrottled() {
+    if (m_userPaused || m_cancelled) return;
+    for (auto& c : m_chunks) {
+        if (!c.throttled) continue;
+        c.throttled = false;
+        c.lastUpdate = std::chrono::steady_clock::now();
+        // Takes what curl held back right away, or throttles again.
+        if (c.handle) curl_easy_pause(c.handle, CURLPAUSE_CONT);
+    }
+}
+
+void DownloadWorker::onWriteError() {
+    if (m_userPaused || m_cancelled) return;
+    QString reason = QString::fromLocal8Bit(strerror(m_writeError));
+    cleanup();
+    saveState();
+    if (m_writeError == ENOSPC) {
+        // Out of space despite the preflight (something else filled the
+        // disk). Everything written so far is in the state; pick up from
+        // there once there is room again.
+        m_writeError = 0;
+        QString where;
+        qint64 missing = DownloadManager::spaceShortfall(m_downloadId, m_outputPath, m_filename, chunkRanges(),
+                                                         m_fileSize, m_inPlace, where);
+        if (missing <= 0) {
+            // By the preflight's count it fits; whatever is filling the
+            // disk has to leave some slack first.
+            where = QStorageInfo(m_inPlace ? m_outputPath : DownloadManager::getStagingDirectory(m_outputPath)).rootPath();
+            missing = kSpaceSlack;
+        }
+        waitForSpace(missing, where);
+        return;
+    }
+    emit downloadFinished(false, "Write Error: " + reason);
+}
+
+bool DownloadWorker::haveDiskSpace(bool inPlace) {
+    QString where;
+    qint64 missing = DownloadManager::spaceShortfall(m_downloadId, m_outputPath, m_filename, chunkRanges(),
+                                                     m_fileSize, inPlace, where);
+    if (missing <= 0) return true;
+    waitForSpace(missing, where);
+    return false;
+}
+
+void DownloadWorker::waitForSpace(qint64 missing, const QString& where) {
+    // The worker does not wait itself: the scheduler takes the download out
+    // of its slot and starts it again once the space is there.
+    emit statusChanged(QString("Waiting for disk space: %1 MB more needed on %2")
+                       .arg((missing + 1024 * 1024 - 1) / (1024 * 1024)).arg(where));
+    emit waitingForSpace(m_downloadId, where, QStorageInfo(where).bytesAvailable() + missing);
+}
+
+void DownloadWorker::reserveSpace() {
+    // In place, opening the target already reserved it; part files grow,
+    // so claim each range's blocks up front.
+    if (m_inPlace) return;
+    for (auto& c : m_chunks) {
+        if (c.output && !c.completed && !c.output->reserve(c.size))
+            qWarning() << "Could not reserve" << c.size << "bytes for" << c.filename;
     }
-    return written;
 }
 
 void DownloadWorker::attemptNetworkRecovery() {
-    // Network recovery logic goes here (omitted for brevity)
+    if (m_userPaused || m_cancelled) return;
+
+    // Ranges whose backoff expired become ordinary pending ranges again;
+    // assignWork() resumes each from start + downloaded.
+    auto now = std::chrono::steady_clock::now();
+    bool wasIdle = m_easyHandles.empty();
+    for (auto& c : m_chunks) {
+        if (c.waitingRetry && c.retryAt <= now) c.waitingRetry = false;
+    }
+    while (activeConnections() < std::max(1, m_numChunks) && assignWork()) {}
+    armRetryTimer();
+
+    if (wasIdle && !m_easyHandles.empty())
+        emit statusChanged(QString("Reconnected with %1 connections...").arg(activeConnections()));
 }
 
 void DownloadWorker::updateProgress() {
     if(m_userPaused) return;
 
     QMutexLocker locker(&m_chunkMutex);
+    auto now = std::chrono::steady_clock::now();
     curl_off_t totalDownloaded = 0;
     std::vector<ChunkProgress> cProgs;
     
-    for(const auto& c : m_chunks) {
+    for(auto& c : m_chunks) {
+        c.speed.addSample(c.downloaded, now);
+        if (c.isHedge || c.repairPiece >= 0 || c.size <= 0) continue; // duplicate bytes, not progress
         totalDownloaded += c.downloaded;
         ChunkProgress cp;
         cp.id = c.id;
@@ -337,43 +1407,142 @@ void DownloadWorker::updateProgress() {
         cp.size = c.size;
         cp.startOffset = c.start;
         cp.totalFileSize = m_fileSize;
+        cp.retries = c.retries;
+        if (c.retries > 0) cp.status = c.lastError;
         cProgs.push_back(cp);
     }
     
-    // --- CORRECTED ETA CALCULATION ---
-    // 1. Bytes downloaded THIS SESSION = Total on disk - Bytes present at start
-    curl_off_t sessionBytes = totalDownloaded - m_bytesAtStart;
-    if (sessionBytes < 0) sessionBytes = 0; // Safety
-
-    // 2. Time elapsed THIS SESSION
-    double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::steady_clock::now() - m_globalStartTime).count() / 1000.0;
-    
-    // 3. Speed = SessionBytes / SessionTime
-    double speed = (elapsed > 0.1) ? (double)sessionBytes / elapsed : 0.0;
-    
-    // 4. ETA = Remaining / Current Speed
-    curl_off_t remaining = m_fileSize - totalDownloaded;
-    double eta = (speed > 0) ? (double)remaining / speed : 0.0;
+    // Recent throughput, not the session average: it follows a stall or a
+    // new speed limit within seconds.
+    m_speed.addSample(totalDownloaded, now);
+    double speed = m_speed.rate();
     double progress = m_fileSize > 0 ? (double)totalDownloaded / m_fileSize : 0;
-    
-    emit progressUpdated(progress, totalDownloaded, m_fileSize, speed, eta);
+    // The pessimistic bound comes from the slower rates and vice versa.
+    emit progressUpdated(progress, totalDownloaded, m_fileSize, speed, timeLeft(0), timeLeft(1), timeLeft(-1));
     emit chunkProgressUpdated(cProgs);
+    feedVerifier();
+    if (!servicePieces()) return;
+
+    // Blocks may have come back through another thread's writer, which
+    // does not wake this one.
+    resumePausedWrites();
+
+    adjustConnections(totalDownloaded);
+    if (m_awaitingPieces && m_easyHandles.empty() && allRangesDone()) finishDownload();
+}
+
+double DownloadWorker::timeLeft(double sigmas) const {
+    // Work stealing spreads the remaining bytes over every connection, so
+    // the download cannot end before all of them have flowed at the
+    // combined rate. But a range under 2 * kMinSplitSize is not split any
+    // more: that tail ends on its own connection, at its own pace, and the
+    // slowest such tail is the critical path.
+    auto rateOf = [sigmas](const ChunkData& c) {
+        return std::max(0.0, c.speed.rate() + sigmas * c.speed.deviation());
+    };
+    curl_off_t remaining = 0;
+    double totalRate = 0;
+    double tail = 0;
+    for (const auto& c : m_chunks) {
+        if (c.isHedge || c.repairPiece >= 0 || c.size <= 0 || c.completed) continue;
+        curl_off_t left = c.size - c.downloaded;
+        if (left <= 0) continue;
+        remaining += left; // ranges waiting for a connection go to whichever frees up
+        if (!c.handle || !c.speed.isValid()) continue;
+
+        double rate = rateOf(c);
+        curl_off_t unsplittable = m_supportsRanges ? std::min(left, 2 * kMinSplitSize) : left;
+        double finish = rate > 0 ? unsplittable / rate : HUGE_VAL;
+        // A hedged range is done when the quicker of the pair is.
+        if (c.partner && c.partner->handle && c.partner->speed.isValid()) {
+            double hedgeRate = rateOf(*c.partner);
+            curl_off_t hedgeLeft = c.partner->size - c.partner->downloaded;
+            if (hedgeRate > 0) finish = std::min(finish, std::min(unsplittable, hedgeLeft) / hedgeRate);
+            rate = std::max(rate, hedgeRate);
+        }
+        totalRate += rate;
+        // A stalled connection is hedged or retried long before its own
+        // pace would matter.
+        if (rate > 0) tail = std::max(tail, finish);
+    }
+    if (remaining <= 0) return 0;
+    if (totalRate <= 0) return HUGE_VAL;
+    return std::max((double)remaining / totalRate, tail);
+}
+
+void DownloadWorker::adjustConnections(curl_off_t totalDownloaded) {
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - m_lastSampleTime).count();
+    if (dt < 1.0) return;
+
+    double throughput = (totalDownloaded - m_lastSampleBytes) / dt;
+    m_lastSampleBytes = totalDownloaded;
+    m_lastSampleTime = now;
+    // The state keeps the layout current every second; the journal lags
+    // behind by up to one checkpoint interval but survives a power loss.
+    saveState();
+    checkpoint(false);
+    checkStragglers();
+    if (!m_supportsRanges) return;
+    // Throughput while ranges sit out a backoff says nothing about the link.
+    for (const auto& c : m_chunks) if (c.waitingRetry) return;
+
+    int target = m_controller.addSample(throughput, activeConnections());
+    if (target != m_numChunks) {
+        m_numChunks = target;
+        emit statusChanged(QString("Downloading with %1 connections...").arg(m_numChunks));
+    }
+    // Extra connections come from unassigned ranges or splits; surplus ones
+    // simply are not handed new work when their range completes.
+    while (activeConnections() < m_numChunks && assignWork()) {}
 }
 
 void DownloadWorker::cancelDownload() {
     m_cancelled = true;
     cleanup();
-    DownloadManager::cleanupChunks(m_downloadId, m_numChunks);
+    if (m_inPlace && m_output) QFile::remove(m_output->path());
+    QFile::remove(DownloadManager::getMergeFile(m_outputPath, m_downloadId));
+    DownloadManager::cleanupChunks(m_outputPath, m_downloadId, chunkRanges());
     emit downloadFinished(false, "Cancelled");
 }
 
-void DownloadWorker::setSpeedLimit(double limit) {
-    m_speedLimit = limit;
-    if (m_multiHandle && !m_easyHandles.empty()) {
-        curl_off_t limitPerHandle = (limit > 0 && m_numChunks > 0) ? (curl_off_t)(limit / m_numChunks) : 0;
-        for (auto eh : m_easyHandles) {
-            curl_easy_setopt(eh, CURLOPT_MAX_RECV_SPEED_LARGE, limitPerHandle);
-        }
-    }
+void DownloadWorker::setMaxConnections(int connections) {
+    m_controller.setCap(connections);
+}
+
+void DownloadWorker::setDirectWrite(bool enabled) {
+    m_directWrite = enabled;
+}
+
+void DownloadWorker::setUnbufferedIO(bool enabled) {
+    m_unbufferedIO = enabled;
+}
+
+void DownloadWorker::setMappedOutput(bool enabled, int windowSize, int syncInterval) {
+    // Applies from the next start or resume.
+    m_mappedOutput = enabled;
+    if (windowSize > 0) m_mapWindowSize = (size_t)windowSize;
+    if (syncInterval > 0) m_mapSyncInterval = (size_t)syncInterval;
+}
+
+void DownloadWorker::setCheckpointInterval(qint64 bytes, int seconds) {
+    if (bytes > 0) m_checkpointBytes = bytes;
+    if (seconds > 0) m_checkpointSeconds = seconds;
+}
+
+void DownloadWorker::setExpectedChecksum(const QString& checksum) {
+    m_checksum = Checksum::parse(checksum);
+}
+
+void DownloadWorker::setPieceManifest(const QString& source) {
+    m_pieceSource = source.trimmed();
+}
+
+void DownloadWorker::setPieceHashing(bool enabled) {
+    // Applies from the next start or resume.
+    m_hashPieces = enabled;
+}
+
+void DownloadWorker::setRateFlow(const QString& flow) {
+    m_rateFlow = flow;
 }
\ No newline at end of file
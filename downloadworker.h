@@ -5,25 +5,88 @@
 #include <QTimer>
 #include <QMutex>
 #include <QMap>
+#include <QPointer>
 #include <curl/curl.h>
 #include <vector>
+#include <deque>
 #include <atomic>
 #include <chrono>
+#include <memory>
+#include <functional>
 #include "chunkprogress.h"
+#include "transferengine.h"
+#include "downloadmanager.h"
+#include "connectioncontroller.h"
+#include "outputfile.h"
+#include "diskwriter.h"
+#include "mappedwriter.h"
+#include "progressjournal.h"
+#include "streamverifier.h"
+#include "pieceverifier.h"
+#include "throughputestimator.h"
+
+class DownloadWorker;
 
 struct ChunkData {
     int id;
     QString filename;
-    FILE* file;
+    // Where this range's bytes go: its own part file, or the shared target
+    // file when writing in place. Range byte n lands at fileOffset + n.
+    std::shared_ptr<OutputFile> output;
+    curl_off_t fileOffset = 0;
+    DownloadWorker* worker = nullptr;
+    CURL* handle;           // connection currently fetching this range, if any
     curl_off_t start;
-    curl_off_t end;
+    curl_off_t end;         // inclusive; shrinks when another connection steals the tail
     curl_off_t size;
     curl_off_t downloaded;
     bool completed;
     std::chrono::steady_clock::time_point lastUpdate;
+    std::chrono::steady_clock::time_point connectedAt;
+
+    // Hedging: a straggler's remaining range raced on a second connection.
+    // Both point at each other until the race is settled.
+    ChunkData* partner = nullptr;
+    bool isHedge = false;
+    curl_slist* connectTo = nullptr; // pins a hedge to another server address
+    curl_slist* requestHeaders = nullptr; // If-Range
+    bool responseChecked = false;    // status of the current transfer verified
+    QString peerAddress;             // server IP this range's connection landed on
+    ThroughputEstimator speed;       // of this range's connection
+
+    // Per-range retries: a failed connection only retries its own range.
+    int retries = 0;                 // total over the life of the range
+    int failuresInRow = 0;           // consecutive failures without new data
+    curl_off_t bytesAtAttempt = 0;
+    QString lastError;
+    bool waitingRetry = false;
+    std::chrono::steady_clock::time_point retryAt;
+
+    // Writes complete asynchronously and possibly out of order. `written`
+    // is the prefix known to be on disk, which is what a saved state may
+    // claim; `downloaded` counts bytes handed to the writer.
+    curl_off_t written = 0;
+    std::deque<std::pair<curl_off_t, bool>> pendingWrites; // (downloaded after write, done)
+    bool writePaused = false;  // curl transfer paused for disk backpressure
+    bool throttled = false;    // curl transfer paused for the speed limit
+
+    // Received bytes not yet handed to the writer; they are the last
+    // `buffered` bytes of `downloaded`. The block is flushed when it reaches
+    // bufferLimit, which ends on a block-size boundary of the file.
+    BufferPool::Buffer buffer;
+    size_t buffered = 0;
+    size_t bufferLimit = 0;
+
+    // Mapped output mode: bytes are copied straight into the target file.
+    std::unique_ptr<MappedWriter> mapped;
+
+    // Set on a range that fetches a piece again after it failed
+    // verification. It writes over the bytes of the range holding them and
+    // is never saved, merged or counted as progress.
+    int repairPiece = -1;
 };
 
-class DownloadWorker : public QObject {
+class DownloadWorker : public QObject, public TransferEngine::Client, public DiskWriter::Client {
     Q_OBJECT
 public:
     explicit DownloadWorker(QObject *parent = nullptr);
@@ -32,55 +95,216 @@ public:
 public slots:
     void startDownload(const QString& url, const QString& outputPath);
     void pauseDownload();
+    // Stops like pauseDownload, but to wait in the queue again: the
+    // scheduler found its server address over budget.
+    void yieldDownload();
     void resumeDownload(const QString& downloadId);
     void cancelDownload();
-    void setSpeedLimit(double limit); // limit in bytes/sec, 0 = unlimited
+    void setMaxConnections(int connections); // budget granted by the scheduler
+    void setDirectWrite(bool enabled); // write into the target file instead of part files
+    void setUnbufferedIO(bool enabled); // O_DIRECT for files of kDirectIOMinSize and up
+    // In-place downloads copy into an mmap'd window of the target file.
+    void setMappedOutput(bool enabled, int windowSize, int syncInterval);
+    // Durable progress is recorded after this many new bytes or seconds,
+    // whichever comes first.
+    void setCheckpointInterval(qint64 bytes, int seconds);
+    // "sha256:<hex>" and the like; checked before the file is put in place.
+    void setExpectedChecksum(const QString& checksum);
+    // Sidecar or Metalink with piece hashes: a local path or a URL.
+    void setPieceManifest(const QString& source);
+    // Without a manifest, hash the pieces locally as they land.
+    void setPieceHashing(bool enabled);
+    // The RateLimiter flow this download draws its tokens as.
+    void setRateFlow(const QString& flow);
 
 private slots:
-    void performWork();
     void updateProgress();
     void attemptNetworkRecovery();
+    void resumePausedWrites();
+    void resumeThrottled();
+    void onWriteError();
 
 signals:
     void downloadIDGenerated(QString id); 
-    void progressUpdated(double totalProgress, double totalDownloaded, double totalSize, double speed, double eta);
+    // `etaLow` and `etaHigh` bound the estimate at one standard deviation of
+    // the measured rates; any of the three is infinite while unknown.
+    void progressUpdated(double totalProgress, double totalDownloaded, double totalSize, double speed,
+                         double eta, double etaLow, double etaHigh);
     void chunkProgressUpdated(const std::vector<ChunkProgress>& chunks);
     void downloadFinished(bool success, const QString& message);
     void downloadPaused(const QString& downloadId);
     void statusChanged(const QString& status);
+    // Stopped for lack of disk space, with its state saved. It can start
+    // (or resume) again once `where` has `bytesNeeded` available.
+    void waitingForSpace(const QString& downloadId, const QString& where, qint64 bytesNeeded);
+    void serverAddressChanged(const QString& address); // IP the first connection landed on
+    // One PieceVerifier::State per piece, whenever one of them changes.
+    void pieceStatesUpdated(qint64 pieceLength, const QByteArray& states);
 
 private:
     static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp);
+    static size_t manifestCallback(void* contents, size_t size, size_t nmemb, void* userp);
+    void transferDone(CURL* handle, CURLcode result) override;
+    void writeDone(void* tag, curl_off_t offset, size_t length, int error) override;
+    void finishDownload();
+    bool scheduleRetry(ChunkData& chunk, const QString& cause);
+    void armRetryTimer();
+    bool allRangesDone() const;
     
     bool initializeDownload(const QString& url, int numChunks);
+    bool startChunkTransfer(ChunkData& chunk, const QString& avoidAddress = QString());
+    void closeTransfer(CURL* handle);
+    bool assignWork();
+    bool stealWork();
+    void checkStragglers();
+    // Seconds until the last range is done, with every connection's rate
+    // moved by `sigmas` standard deviations. With m_chunkMutex held.
+    double timeLeft(double sigmas) const;
+    bool hedgeRange(ChunkData& slow);
+    void settleHedge(ChunkData& original, bool hedgeWon);
+    void dropChunk(ChunkData& chunk);
+    bool openChunkOutput(ChunkData& chunk, bool truncate);
+    void keepOutputsCached(); // while a verifier will read them back
+    void prepareOutput(); // picks the write path once m_output is open
+    void flushBuffer(ChunkData& chunk);
+    // Tokens from the RateLimiter for bytes about to be accepted; false
+    // (and the chunk marked throttled) if the transfer must pause.
+    bool takeTokens(ChunkData& chunk, size_t bytes);
+    bool useDirectIO() const;
+    void attachWriter();
+    int activeConnections() const;
+    std::vector<ChunkRange> chunkRanges() const;
+    void saveState();
+    // Syncs what has been written and records it in the journal, on its
+    // thread unless `now`. Skipped until the cadence is due, unless `now`.
+    void checkpoint(bool now);
+    // Hands the verifiers the current ranges and how much of each is written.
+    void feedVerifier();
+    void fetchManifest();
+    void onManifestFetched(CURLcode result);
+    // Takes the manifest (read from the state directory when resuming, or
+    // computed locally) and starts hashing pieces, if there is one.
+    void startPieceVerifier(bool resuming);
+    // Fetches failed pieces again and rechecks repaired ones. False if the
+    // download failed.
+    bool servicePieces();
+    bool repairPiece(int piece);
     void cleanup();
+    void releaseHandles();
+    void suspend(const QString& status); // saves everything and stops
     bool probeFileInfo();
-    int calculateOptimalConnections(curl_off_t size);
+    void onProbeFinished(CURLcode result);
+    void beginTransfers();
+    // The server answered a range request with the whole (changed) file:
+    // throw away what is on disk and start over from a new probe.
+    void restartDownload();
+    // Runs the merge or final move on its own thread, reporting "<label> N%".
+    // The checksum, if there is one, is settled first.
+    void finishInBackground(const QString& label, const QString& failure,
+                            std::function<bool(const DownloadManager::Progress&)> job);
+    DownloadManager::Progress statusProgress(const QString& label);
+    // Preflight: false (and polling for space) when the download would not
+    // fit on its filesystems.
+    bool haveDiskSpace(bool inPlace);
+    void waitForSpace(qint64 missing, const QString& where);
+    void reserveSpace();
+    void adjustConnections(curl_off_t totalDownloaded);
     
-    std::vector<ChunkData> m_chunks;
+    // Ranges never smaller than this are split off for an idle connection.
+    static constexpr curl_off_t kMinSplitSize = 1024 * 1024;
+    // A connection is a straggler when it is this far below the median
+    // per-connection rate, or has delivered nothing for kStallSeconds.
+    static constexpr double kStragglerRatio = 0.25;
+    static constexpr int kStallSeconds = 5;
+    static constexpr int kHedgeWarmupSeconds = 3; // let slow start finish first
+    static constexpr int kMaxHedges = 2;
+    // Retry backoff doubles from kRetryBaseMs up to kRetryMaxMs, with jitter.
+    // A range that fails kMaxRetries times in a row without receiving any
+    // data fails the download.
+    static constexpr int kRetryBaseMs = 1000;
+    static constexpr int kRetryMaxMs = 60000;
+    static constexpr int kMaxRetries = 10;
+    // Fewer, larger write callbacks (curl before 7.88 caps this at 512 KB).
+    static constexpr long kReceiveBufferSize = 512 * 1024;
+    // Under a speed limit deliveries shrink towards this, so a connection
+    // never takes much more than the bucket holds in one go.
+    static constexpr long kMinReceiveBufferSize = 16 * 1024;
+    // Files this big would only push everything else out of the page cache.
+    static constexpr curl_off_t kDirectIOMinSize = 1024LL * 1024 * 1024;
+    // Free space to wait for after a write hit a full disk that the
+    // preflight thought was big enough.
+    static constexpr qint64 kSpaceSlack = 64LL * 1024 * 1024;
+    // A file that changes again on every attempt is not worth chasing.
+    static constexpr int kMaxRestarts = 3;
+    // A piece that still fails after this many fresh copies is not a
+    // transfer error.
+    static constexpr int kMaxPieceRepairs = 3;
+    static constexpr qsizetype kMaxManifestSize = 64 * 1024 * 1024;
+
+    std::deque<ChunkData> m_chunks; // deque: curl holds pointers to elements
+    int m_nextChunkId;
     std::vector<CURL*> m_easyHandles;
-    CURLM* m_multiHandle;
+    CURL* m_probeHandle;
+    CURL* m_manifestHandle;
+    QByteArray m_manifestData;
+    QPointer<TransferEngine> m_engine;
     
     QString m_url;
     QString m_outputPath;
     QString m_filename;
     QString m_downloadId;
+    QString m_serverAddress;
     curl_off_t m_fileSize;
-    int m_numChunks;
+    int m_numChunks; // connection target, steered by m_controller
+    ConnectionController m_controller;
     bool m_supportsRanges;
-    double m_speedLimit; // Bytes per second
+    QString m_etag;          // validators from the probe, sent as If-Range
+    QString m_lastModified;
+    bool m_remoteChanged;    // a range request came back as a full 200
+    int m_restarts;
+    bool m_directWrite;
+    bool m_inPlace;                       // this download writes into m_output
+    bool m_unbufferedIO;
+    bool m_mappedOutput;                  // as configured
+    bool m_useMapped;                     // in effect for this download
+    size_t m_mapWindowSize;
+    size_t m_mapSyncInterval;
+    std::shared_ptr<OutputFile> m_output; // set in in-place mode
+    QPointer<DiskWriter> m_writer;
+    int m_writeError;                     // first failed write (errno), 0 if none
+    std::unique_ptr<ProgressJournal> m_journal;
+    qint64 m_checkpointBytes;
+    int m_checkpointSeconds;
+    curl_off_t m_checkpointedBytes;       // written at the last checkpoint
+    std::chrono::steady_clock::time_point m_lastCheckpoint;
+    Checksum m_checksum;
+    std::unique_ptr<StreamVerifier> m_verifier;
+    curl_off_t m_mergedBytes;             // parts already merged before a resume
+    QString m_pieceSource;
+    bool m_hashPieces;
+    QString m_rateFlow;
+    PieceManifest m_manifest;             // as fetched for this download
+    std::unique_ptr<PieceVerifier> m_pieces;
+    QMap<int, int> m_pieceRepairs;        // times each piece was fetched again
+    quint64 m_piecesShown;                // states version last emitted
+    bool m_awaitingPieces;                // finishing as soon as every piece checks out
     
     // --- NEW: Track bytes present when session started ---
     curl_off_t m_bytesAtStart; 
 
     std::atomic<bool> m_userPaused;
     std::atomic<bool> m_cancelled;
-    bool m_isNetworkError;
     
     std::chrono::steady_clock::time_point m_globalStartTime;
-    QTimer* m_workTimer;
+    std::chrono::steady_clock::time_point m_lastSampleTime;
+    curl_off_t m_lastSampleBytes;
+    ThroughputEstimator m_speed;          // of the whole download
     QTimer* m_progressTimer;
     QTimer* m_networkRetryTimer;
+    QTimer* m_throttleTimer;  // wakes throttled connections when tokens are back
+    QThread* m_finishThread;  // merging or moving into place, if running
+    std::atomic<bool> m_stopFinishing;
+    std::atomic<bool> m_finishedOk;
     QMutex m_chunkMutex;
     QMap<QString, QString> m_headers;
 };
@@ -0,0 +1,259 @@
+#include "hashkernels.h"
+#include <cstring>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PARAFETCH_X86_KERNELS 1
+#endif
+
+namespace {
+const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint32_t kCrc32cPoly = 0x82f63b78; // reflected
+
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void sha256Portable(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+    for (; blocks > 0; --blocks, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | (uint32_t)data[4 * i + 3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+uint32_t crc32cTable[256];
+
+bool initCrc32cTable()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (kCrc32cPoly & (0u - (c & 1)));
+        crc32cTable[i] = c;
+    }
+    return true;
+}
+
+uint32_t crc32cPortable(uint32_t crc, const unsigned char* p, size_t length)
+{
+    static const bool ready = initCrc32cTable();
+    (void)ready;
+    while (length--) crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef PARAFETCH_X86_KERNELS
+bool cpuHas(unsigned leaf, unsigned subleaf, int reg, unsigned bit)
+{
+    unsigned r[4];
+    if (!__get_cpuid_count(leaf, subleaf, &r[0], &r[1], &r[2], &r[3])) return false;
+    return (r[reg] >> bit) & 1;
+}
+
+// SHA extensions plus SSSE3/SSE4.1 for the shuffles and blends around them.
+const bool kHaveShaNi = cpuHas(7, 0, 1, 29) && cpuHas(1, 0, 2, 9) && cpuHas(1, 0, 2, 19);
+const bool kHaveSse42 = cpuHas(1, 0, 2, 20);
+
+// Four rounds per sha256rnds2 pair. The message schedule for group g is
+// built from groups g-4..g-1, kept in a rotating set of four registers.
+__attribute__((target("sha,sse4.1")))
+void sha256ShaNi(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // state is A..H; the instructions want ABEF and CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);         // CDGH
+
+    for (; blocks > 0; --blocks, data += 64) {
+        __m128i abefSave = state0;
+        __m128i cdghSave = state1;
+        __m128i m[4];
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4) {
+                m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), byteSwap);
+            } else {
+                __m128i w = _mm_sha256msg1_epu32(m[g & 3], m[(g - 3) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(m[(g - 1) & 3], m[(g - 2) & 3], 4));
+                m[g & 3] = _mm_sha256msg2_epu32(w, m[(g - 1) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i*)&kSha256K[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const unsigned char* p, size_t length)
+{
+    while (length > 0 && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --length;
+    }
+#ifdef __x86_64__
+    uint64_t c = crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    for (; length >= 4; length -= 4, p += 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while (length--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#else
+const bool kHaveShaNi = false;
+const bool kHaveSse42 = false;
+#endif
+
+void sha256Blocks(uint32_t state[8], const unsigned char* data, size_t blocks)
+{
+#ifdef PARAFETCH_X86_KERNELS
+    if (kHaveShaNi) { sha256ShaNi(state, data, blocks); return; }
+#endif
+    sha256Portable(state, data, blocks);
+}
+
+// GF(2) matrix helpers for combine(), as in zlib's crc32_combine().
+uint32_t gf2Times(const uint32_t* matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, ++matrix) {
+        if (vector & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+void gf2Square(uint32_t* square, const uint32_t* matrix)
+{
+    for (int n = 0; n < 32; ++n) square[n] = gf2Times(matrix, matrix[n]);
+}
+}
+
+Sha256::Sha256() : m_blockUsed(0), m_length(0) {
+    static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(m_state, init, sizeof(m_state));
+}
+
+void Sha256::update(const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    m_length += length;
+    if (m_blockUsed > 0) {
+        size_t n = std::min(length, sizeof(m_block) - m_blockUsed);
+        memcpy(m_block + m_blockUsed, p, n);
+        m_blockUsed += n;
+        p += n;
+        length -= n;
+        if (m_blockUsed < sizeof(m_block)) return;
+        sha256Blocks(m_state, m_block, 1);
+        m_blockUsed = 0;
+    }
+    size_t blocks = length / 64;
+    if (blocks > 0) sha256Blocks(m_state, p, blocks);
+    p += blocks * 64;
+    length -= blocks * 64;
+    memcpy(m_block, p, length);
+    m_blockUsed = length;
+}
+
+void Sha256::final(unsigned char digest[32]) {
+    uint64_t bits = m_length * 8;
+    m_block[m_blockUsed++] = 0x80;
+    if (m_blockUsed > 56) {
+        memset(m_block + m_blockUsed, 0, sizeof(m_block) - m_blockUsed);
+        sha256Blocks(m_state, m_block, 1);
+        m_blockUsed = 0;
+    }
+    memset(m_block + m_blockUsed, 0, 56 - m_blockUsed);
+    for (int i = 0; i < 8; ++i) m_block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256Blocks(m_state, m_block, 1);
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = (unsigned char)(m_state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(m_state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(m_state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)m_state[i];
+    }
+}
+
+bool Sha256::hardwareAccelerated() {
+    return kHaveShaNi;
+}
+
+uint32_t Crc32c::extend(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#ifdef PARAFETCH_X86_KERNELS
+    if (kHaveSse42) return ~crc32cSse42(crc, p, length);
+#endif
+    return ~crc32cPortable(crc, p, length);
+}
+
+uint32_t Crc32c::combine(uint32_t crc1, uint32_t crc2, uint64_t length2) {
+    if (length2 == 0) return crc1;
+    // Operators for one zero bit, then squared into 2, 4, ... zero bytes;
+    // crc1 is pushed through one for every set bit of length2.
+    uint32_t even[32], odd[32];
+    odd[0] = kCrc32cPoly;
+    for (int n = 1; n < 32; ++n) odd[n] = 1u << (n - 1);
+    gf2Square(even, odd);  // two zero bits
+    gf2Square(odd, even);  // four
+    do {
+        gf2Square(even, odd);
+        if (length2 & 1) crc1 = gf2Times(even, crc1);
+        length2 >>= 1;
+        if (!length2) break;
+        gf2Square(odd, even);
+        if (length2 & 1) crc1 = gf2Times(odd, crc1);
+        length2 >>= 1;
+    } while (length2);
+    return crc1 ^ crc2;
+}
+
+bool Crc32c::hardwareAccelerated() {
+    return kHaveSse42;
+}
@@ -0,0 +1,35 @@
+#ifndef HASHKERNELS_H
+#define HASHKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// The digests worth running at disk speed, with the CPU's own instructions
+// where it has them: SHA-256 through the SHA extensions, CRC32C through
+// SSE4.2. Both fall back to portable code, picked once at runtime.
+
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t length);
+    void final(unsigned char digest[32]); // the object is spent afterwards
+
+    static bool hardwareAccelerated();
+
+private:
+    uint32_t m_state[8];
+    unsigned char m_block[64];
+    size_t m_blockUsed;
+    uint64_t m_length;
+};
+
+// CRC32C (Castagnoli), with zlib's conventions: start from 0 and feed the
+// previous result back in. combine() joins the CRCs of two adjacent pieces
+// given the second one's length, so ranges can be checksummed in any order.
+namespace Crc32c {
+uint32_t extend(uint32_t crc, const void* data, size_t length);
+uint32_t combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+bool hardwareAccelerated();
+}
+
+#endif
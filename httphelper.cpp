@@ -8,6 +8,12 @@ size_t HttpHelper::headerCallback(char *buffer, size_t size, size_t nitems, void
     QMap<QString, QString>* headers = static_cast<QMap<QString, QString>*>(userdata);
     
     QString header = QString::fromUtf8(buffer, realSize).trimmed();
+    // A new status line starts the next response of a redirect chain; only
+    // the final response's headers describe the file.
+    if (header.startsWith("HTTP/")) {
+        headers->clear();
+        return realSize;
+    }
     int colonPos = header.indexOf(':');
     if (colonPos > 0) {
         QString key = header.left(colonPos).trimmed().toLower();
@@ -63,4 +69,17 @@ curl_off_t HttpHelper::getContentLength(const QMap<QString, QString>& headers) {
         return headers["content-length"].toLongLong();
     }
     return -1;
-}
\ No newline at end of file
+}
+
+QString HttpHelper::getETag(const QMap<QString, QString>& headers) {
+    return headers.value("etag");
+}
+
+QString HttpHelper::getLastModified(const QMap<QString, QString>& headers) {
+    return headers.value("last-modified");
+}
+
+QString HttpHelper::ifRangeValue(const QString& etag, const QString& lastModified) {
+    if (!etag.isEmpty() && !etag.startsWith("W/")) return etag;
+    return lastModified;
+}
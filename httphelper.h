@@ -11,6 +11,12 @@ public:
     static QString extractFilename(const QString& url, const QMap<QString, QString>& headers);
     static bool supportsRanges(const QMap<QString, QString>& headers);
     static curl_off_t getContentLength(const QMap<QString, QString>& headers);
+    // Validators identifying this version of the resource; empty if absent.
+    static QString getETag(const QMap<QString, QString>& headers);
+    static QString getLastModified(const QMap<QString, QString>& headers);
+    // Value for an If-Range header: the ETag if it is a strong one (weak
+    // tags are not allowed there), else Last-Modified; empty if neither.
+    static QString ifRangeValue(const QString& etag, const QString& lastModified);
 };
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <QApplication>
 #include "myform.h"
+#include "transferengine.h"
 
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
@@ -13,8 +14,15 @@ int main(int argc, char *argv[]) {
     font.setPointSize(10);
     app.setFont(font);
 
-    MyForm form;
-    form.show();
-
-    return app.exec();
+    // curl's global state must exist before the network threads start and
+    // outlive them; the form owns (and joins) those threads.
+    TransferEngine::initGlobal();
+    int result;
+    {
+        MyForm form;
+        form.show();
+        result = app.exec();
+    }
+    TransferEngine::cleanupGlobal();
+    return result;
 }
\ No newline at end of file
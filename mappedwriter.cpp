@@ -0,0 +1,82 @@
+#include "mappedwriter.h"
+#include "writeback.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+MappedWriter::MappedWriter(std::shared_ptr<OutputFile> file, size_t windowSize, size_t syncInterval)
+    : m_file(std::move(file)), m_windowSize(windowSize), m_syncInterval(syncInterval),
+      m_base(nullptr), m_windowStart(0), m_windowLength(0), m_syncFrom(0), m_syncTo(0)
+{
+    // Windows start on page boundaries and span whole pages.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    m_windowSize = std::max(page, m_windowSize / page * page);
+}
+
+MappedWriter::~MappedWriter() {
+    unmap();
+}
+
+int MappedWriter::write(const char* data, size_t length, curl_off_t offset) {
+    while (length > 0) {
+        if (!m_base || offset < m_windowStart || offset >= m_windowStart + (curl_off_t)m_windowLength) {
+            int error = map(offset);
+            if (error) return error;
+        }
+        size_t n = std::min(length, (size_t)(m_windowStart + (curl_off_t)m_windowLength - offset));
+        memcpy(m_base + (offset - m_windowStart), data, n);
+
+        // A connection writes its range front to back; anything else starts
+        // a new sync region.
+        if (offset != m_syncTo) {
+            sync(m_syncTo);
+            m_syncFrom = offset;
+        }
+        m_syncTo = offset + (curl_off_t)n;
+        if (m_syncTo - m_syncFrom >= (curl_off_t)m_syncInterval) sync(m_syncTo);
+
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int MappedWriter::map(curl_off_t offset) {
+    unmap();
+    curl_off_t fileSize = m_file->size();
+    if (!m_file->isOpen() || offset >= fileSize) return EINVAL;
+
+    m_windowStart = offset / (curl_off_t)m_windowSize * (curl_off_t)m_windowSize;
+    m_windowLength = (size_t)std::min<curl_off_t>(m_windowSize, fileSize - m_windowStart);
+    void* base = mmap(nullptr, m_windowLength, PROT_READ | PROT_WRITE, MAP_SHARED, m_file->fd(), m_windowStart);
+    if (base == MAP_FAILED) {
+        m_windowLength = 0;
+        return errno;
+    }
+    // Written front to back; read-ahead on faults would be wasted.
+    madvise(base, m_windowLength, MADV_SEQUENTIAL);
+    m_base = static_cast<char*>(base);
+    m_syncFrom = m_syncTo = offset;
+    return 0;
+}
+
+void MappedWriter::sync(curl_off_t end) {
+    if (!m_base || end <= m_syncFrom) return;
+    curl_off_t from = std::max(m_syncFrom, m_windowStart);
+    curl_off_t pageStart = from - from % (curl_off_t)sysconf(_SC_PAGESIZE);
+    msync(m_base + (pageStart - m_windowStart), (size_t)(end - pageStart), MS_ASYNC);
+    // The writeback thread must never see a closed file.
+    if (m_file->isOpen()) Writeback::instance().add(m_file.get(), from, (size_t)(end - from));
+    m_syncFrom = end;
+}
+
+void MappedWriter::unmap() {
+    if (!m_base) return;
+    sync(m_syncTo);
+    munmap(m_base, m_windowLength);
+    m_base = nullptr;
+    m_windowLength = 0;
+}
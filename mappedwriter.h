@@ -0,0 +1,46 @@
+#ifndef MAPPEDWRITER_H
+#define MAPPEDWRITER_H
+
+#include <curl/curl.h>
+#include <memory>
+#include "outputfile.h"
+
+// Alternative to handing buffers to the DiskWriter: one connection's range
+// of a preallocated target file is mapped a window at a time and received
+// bytes are copied straight into the mapping from the curl callback. No
+// syscall per write, no intermediate buffer; the kernel writes the pages
+// back. Every syncInterval bytes the region written since the last sync is
+// handed to Writeback (msync(MS_ASYNC) alone does nothing on Linux).
+//
+// Only for files whose blocks are reserved (OutputFile::isPreallocated()):
+// a store into a hole on a full disk raises SIGBUS instead of an error.
+class MappedWriter {
+public:
+    MappedWriter(std::shared_ptr<OutputFile> file, size_t windowSize, size_t syncInterval);
+    ~MappedWriter();
+
+    // Copies data to the file offset, moving the window as needed. Returns
+    // 0 or an errno value.
+    int write(const char* data, size_t length, curl_off_t offset);
+    // Unmaps the window; the next write maps a new one.
+    void unmap();
+
+    static constexpr size_t kDefaultWindowSize = 64 * 1024 * 1024;
+    static constexpr size_t kDefaultSyncInterval = 16 * 1024 * 1024;
+
+private:
+    int map(curl_off_t offset);
+    void sync(curl_off_t end);
+
+    std::shared_ptr<OutputFile> m_file;
+    size_t m_windowSize;
+    size_t m_syncInterval;
+
+    char* m_base;
+    curl_off_t m_windowStart;
+    size_t m_windowLength;
+    curl_off_t m_syncFrom; // start of the region written since the last sync
+    curl_off_t m_syncTo;
+};
+
+#endif
@@ -17,7 +17,15 @@
 #include <QDragEnterEvent>
 #include <QDropEvent>
 #include <QDesktopServices>
+#include <QInputDialog>
+#include <QDateTime>
+#include <QDebug>
 #include <cmath> // for isinf, isnan
+#include "downloadmanager.h"
+#include "bufferpool.h"
+#include "writeback.h"
+#include "diskwriter.h"
+#include "checksum.h"
 
 // --- Add Download Dialog ---
 AddDownloadDialog::AddDownloadDialog(QWidget* parent) : QDialog(parent) {
@@ -29,6 +37,10 @@ AddDownloadDialog::AddDownloadDialog(QWidget* parent) : QDialog(parent) {
     urlEdit = new QLineEdit();
     urlEdit->setPlaceholderText("https://example.com/file.iso");
     pathEdit = new QLineEdit(QDir::homePath() + "/Downloads");
+    checksumEdit = new QLineEdit();
+    checksumEdit->setPlaceholderText("Optional, e.g. sha256:9f86d08...");
+    piecesEdit = new QLineEdit();
+    piecesEdit->setPlaceholderText("Optional .sha256pieces or Metalink, path or URL");
     
     QPushButton* btnBrowse = new QPushButton("...");
     btnBrowse->setFixedWidth(30);
@@ -43,10 +55,21 @@ AddDownloadDialog::AddDownloadDialog(QWidget* parent) : QDialog(parent) {
 
     form->addRow("URL:", urlEdit);
     form->addRow("Save to:", pathLayout);
+    form->addRow("Checksum:", checksumEdit);
+    form->addRow("Piece hashes:", piecesEdit);
     layout->addLayout(form);
 
     QDialogButtonBox* buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
-    connect(buttons, &QDialogButtonBox::accepted, this, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::accepted, this, [=]() {
+        QString checksum = checksumEdit->text().trimmed();
+        if (!checksum.isEmpty() && !Checksum::parse(checksum).isValid()) {
+            QMessageBox::warning(this, "Invalid Checksum",
+                                 "Expected a SHA-256, SHA-1 or MD5 hex digest, optionally prefixed "
+                                 "with its algorithm (\"sha256:...\"), or \"crc32c:...\".");
+            return;
+        }
+        accept();
+    });
     connect(buttons, &QDialogButtonBox::rejected, this, &QDialog::reject);
     layout->addWidget(buttons);
 }
@@ -55,6 +78,12 @@ AddDownloadDialog::AddDownloadDialog(QWidget* parent) : QDialog(parent) {
 MyForm::MyForm(QWidget *parent) : QMainWindow(parent) {
     // Initialize settings
     settings = new QSettings("ParaFetch", "ParaFetch", this);
+    scheduler = new DownloadScheduler(this);
+    connect(scheduler, &DownloadScheduler::workerStarted, this, &MyForm::onWorkerStarted);
+    connect(scheduler, &DownloadScheduler::workerReleased, this, &MyForm::onWorkerReleased);
+    scheduleTimer = new QTimer(this);
+    scheduleTimer->setSingleShot(true);
+    connect(scheduleTimer, &QTimer::timeout, this, &MyForm::applySchedule);
     loadSettings();
     
     // Setup UI components
@@ -91,16 +120,22 @@ MyForm::MyForm(QWidget *parent) : QMainWindow(parent) {
     globalTimer = new QTimer(this);
     connect(globalTimer, &QTimer::timeout, this, &MyForm::updateGlobalStats);
     globalTimer->start(500); 
+
+    sessionTimer = new QTimer(this);
+    sessionTimer->setSingleShot(true);
+    sessionTimer->setInterval(2000);
+    connect(sessionTimer, &QTimer::timeout, this, &MyForm::saveSession);
+    restoreSession();
 }
 
 MyForm::~MyForm() {
-    for(auto task : tasks) {
-        if(task->thread && task->thread->isRunning()) {
-            task->thread->quit();
-            task->thread->wait();
-        }
-        delete task;
-    }
+    // Running downloads save their state and are listed as queued, so the
+    // next session picks them up where they stopped.
+    scheduler->shutdown();
+    saveSession();
+    // Stops the network threads before the tasks their workers report to go away.
+    delete scheduler;
+    for(auto task : tasks) delete task;
 }
 
 // --- UI Setup ---
@@ -191,7 +226,8 @@ void MyForm::setupUI() {
     QHBoxLayout* bottomLayout = new QHBoxLayout(bottomPanel);
     
     globalGraph = new GlobalSpeedGraph();
-    DiskUsagePieChart* diskChart = new DiskUsagePieChart();
+    diskChart = new DiskUsagePieChart();
+    diskChart->setPath(defaultDownloadPath);
     
     lblGlobalSpeed = new QLabel("0.00 MB/s");
     lblGlobalSpeed->setStyleSheet(R"(
@@ -203,9 +239,18 @@ void MyForm::setupUI() {
     QLabel* titleLabel = new QLabel("TOTAL DOWNLOAD SPEED");
     titleLabel->setStyleSheet("color: #8E8E93; font-size: 11px; font-weight: 600; letter-spacing: 0.5px;");
 
+    lblBufferMemory = new QLabel();
+    lblBufferMemory->setStyleSheet("color: #8E8E93; font-size: 11px;");
+
+    lblSchedule = new QLabel();
+    lblSchedule->setStyleSheet("color: #8E8E93; font-size: 11px;");
+    lblSchedule->hide();
+
     QVBoxLayout* statsLayout = new QVBoxLayout();
     statsLayout->addWidget(titleLabel);
     statsLayout->addWidget(lblGlobalSpeed);
+    statsLayout->addWidget(lblBufferMemory);
+    statsLayout->addWidget(lblSchedule);
     statsLayout->addStretch();
 
     bottomLayout->addLayout(statsLayout);
@@ -463,10 +508,60 @@ void MyForm::applyStyles() {
 void MyForm::loadSettings() {
     defaultDownloadPath = settings->value("DefaultDownloadPath", QDir::homePath() + "/Downloads").toString();
     defaultConnections = settings->value("DefaultConnections", 8).toInt();
+    maxActiveDownloads = settings->value("MaxActiveDownloads", 5).toInt();
+    maxTotalConnections = settings->value("MaxTotalConnections", 64).toInt();
+    maxConnectionsPerHost = settings->value("MaxConnectionsPerHost", 16).toInt();
     defaultSpeedLimit = settings->value("DefaultSpeedLimit", 0.0).toDouble();
     clipboardMonitoringEnabled = settings->value("ClipboardMonitoring", false).toBool();
     notificationsEnabled = settings->value("NotificationsEnabled", true).toBool();
     NotificationManager::instance().setEnabled(notificationsEnabled);
+
+    scheduler->setConnectionsPerDownload(defaultConnections);
+    scheduler->setMaxTotalConnections(maxTotalConnections);
+    scheduler->setHostLimits(maxConnectionsPerHost,
+                             SettingsDialog::parseHostLimits(settings->value("HostConnectionLimits", "").toString()));
+    scheduler->setDirectWrite(settings->value("DirectWrite", true).toBool());
+    scheduler->setUnbufferedIO(settings->value("UnbufferedIO", false).toBool());
+    BufferPool::instance().configure(settings->value("WriteBlockSizeMB", 4).toInt() * 1024 * 1024,
+                                     settings->value("WriteBufferMemoryMB", 256).toLongLong() * 1024 * 1024);
+    scheduler->setMappedOutput(settings->value("MappedOutput", false).toBool(),
+                               settings->value("MappedWindowMB", 64).toInt() * 1024 * 1024,
+                               settings->value("MappedSyncMB", 16).toInt() * 1024 * 1024);
+    scheduler->setCheckpointInterval(settings->value("CheckpointMB", 64).toLongLong() * 1024 * 1024,
+                                     settings->value("CheckpointSeconds", 10).toInt());
+    scheduler->setPieceHashing(settings->value("HashPieces", false).toBool());
+    Writeback::instance().setBudget(settings->value("WritebackBudgetMB", 64).toLongLong() * 1024 * 1024);
+
+    // The speed limit and active downloads come from the schedule, when
+    // a rule covers the moment, and from the settings above otherwise.
+    schedule = BandwidthSchedule::parse(settings->value("BandwidthSchedule", "").toString());
+    appliedSpeedLimit = -1;
+    appliedMaxActive = 0;
+    applySchedule();
+}
+
+void MyForm::applySchedule() {
+    QDateTime now = QDateTime::currentDateTime();
+    const ScheduleRule* rule = schedule.ruleAt(now);
+    double speedLimit = rule && rule->speedLimit >= 0 ? rule->speedLimit : defaultSpeedLimit;
+    int maxActive = rule && rule->maxActive > 0 ? rule->maxActive : maxActiveDownloads;
+
+    // Both reach running transfers as they are; nothing is restarted.
+    if (speedLimit != appliedSpeedLimit) scheduler->setSpeedLimit(speedLimit * 1024); // KB/s
+    if (maxActive != appliedMaxActive) scheduler->setMaxActiveDownloads(maxActive);
+    appliedSpeedLimit = speedLimit;
+    appliedMaxActive = maxActive;
+
+    if (schedule.isEmpty()) {
+        scheduleStatus.clear();
+    } else {
+        QString limits = (speedLimit > 0 ? formatSize(speedLimit * 1024) + "/s" : QString("unlimited")) +
+                         QString(", %1 active").arg(maxActive);
+        scheduleStatus = "Schedule: " + (rule ? rule->text : QString("defaults")) + " (" + limits + ")";
+    }
+
+    // Rules start and end on whole minutes.
+    scheduleTimer->start(60000 - now.time().msecsSinceStartOfDay() % 60000 + 50);
 }
 
 void MyForm::onSettingsClicked() {
@@ -474,6 +569,7 @@ void MyForm::onSettingsClicked() {
     if (dlg.exec() == QDialog::Accepted) {
         settings->sync(); // Force reload from disk/memory
         loadSettings();
+        diskChart->setPath(defaultDownloadPath);
         if (settings->value("ShowTrayIcon", false).toBool()) {
             trayIcon->show();
         } else {
@@ -493,34 +589,72 @@ void MyForm::onBatchAddClicked() {
     if (dlg.exec() == QDialog::Accepted) {
         QStringList urls = dlg.getUrls();
         QString path = dlg.getSavePath();
+        // The whole import shares the speed limit as one group.
+        QString group = urls.size() > 1 ? "Batch " + QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss")
+                                        : QString();
         
         for (const QString& url : urls) {
-            addDownload(url, path);
+            addDownload(url, path, dlg.getChecksum(url), dlg.getPieces(url), group);
         }
     }
 }
 
-void MyForm::addDownload(const QString& url, const QString& path) {
+void MyForm::addDownload(const QString& url, const QString& path, const QString& checksum, const QString& pieces,
+                         const QString& group) {
     if(url.isEmpty()) return;
 
     TaskInfo* task = new TaskInfo();
-    task->thread = new QThread();
-    task->worker = new DownloadWorker();
-    task->worker->moveToThread(task->thread);
+    task->worker = nullptr;
     task->currentSpeed = 0;
     task->url = url;
     task->outputPath = path;
+    task->checksum = checksum;
+    task->pieces = pieces;
+    task->group = group;
+
+    QString fileName = QFileInfo(QUrl(url).path()).fileName();
+    if(fileName.isEmpty()) fileName = "downloading...";
+    QString uid = addTaskRow(task, fileName);
 
+    if (!group.isEmpty()) scheduler->setGroup(uid, group);
+    scheduler->enqueue(uid, url, path, QString(), checksum, pieces);
+    scheduleSessionSave();
+}
+
+QString MyForm::addTaskRow(TaskInfo* task, const QString& name) {
     int row = table->rowCount();
     table->insertRow(row);
     
-    QString fileName = QFileInfo(QUrl(url).path()).fileName();
-    if(fileName.isEmpty()) fileName = "downloading...";
-    table->setItem(row, 0, new QTableWidgetItem(fileName)); 
+    table->setItem(row, 0, new QTableWidgetItem(name)); 
+    table->setItem(row, 1, new QTableWidgetItem(formatSize(task->downloaded)));
+    table->setItem(row, 2, new QTableWidgetItem(task->totalSize > 0 ? formatSize(task->totalSize) : "--"));
     
-    table->setItem(row, 1, new QTableWidgetItem("0 B"));
-    table->setItem(row, 2, new QTableWidgetItem("--"));
+    // Just the figure until the task reports progress; a bar widget per row
+    // would make restoring a long list slow.
+    double percent = task->totalSize > 0 ? task->downloaded * 100 / task->totalSize : 0;
+    QTableWidgetItem* progressItem = new QTableWidgetItem(QString::number(percent, 'f', 1) + " %");
+    progressItem->setTextAlignment(Qt::AlignCenter);
+    table->setItem(row, 3, progressItem);
+
+    table->setItem(row, 4, new QTableWidgetItem("0 B/s"));
+    table->setItem(row, 5, new QTableWidgetItem("--"));
+    
+    QTableWidgetItem* statusItem = new QTableWidgetItem("Queued");
+    statusItem->setForeground(QColor("#8E8E93"));
+    table->setItem(row, 6, statusItem);
     
+    task->tableRow = row;
+    // Never reused: the scheduler may still know a removed task's uid
+    // until its worker has wound down.
+    QString uid = QString::number(++lastTaskId);
+    tasks.insert(uid, task);
+    return uid;
+}
+
+TableSegmentedBar* MyForm::progressBar(int row) {
+    if (QWidget* container = table->cellWidget(row, 3))
+        return container->findChild<TableSegmentedBar*>();
+
     QWidget* progressContainer = new QWidget();
     QVBoxLayout* progressLayout = new QVBoxLayout(progressContainer);
     progressLayout->setContentsMargins(10, 5, 10, 5); 
@@ -529,50 +663,125 @@ void MyForm::addDownload(const QString& url, const QString& path) {
     TableSegmentedBar* pBar = new TableSegmentedBar();
     progressLayout->addWidget(pBar);
     
+    if (QTableWidgetItem* item = table->item(row, 3)) item->setText(QString());
     table->setCellWidget(row, 3, progressContainer);
+    return pBar;
+}
 
-    table->setItem(row, 4, new QTableWidgetItem("0 B/s"));
-    table->setItem(row, 5, new QTableWidgetItem("--"));
-    
-    QTableWidgetItem* statusItem = new QTableWidgetItem("Downloading");
-    statusItem->setForeground(QColor("#e0af68"));
-    table->setItem(row, 6, statusItem);
-    
-    task->tableRow = row;
-    QString uid = QString::number((quintptr)task); 
-    tasks.insert(uid, task);
-
-    connect(task->thread, &QThread::started, task->worker, [=](){ 
-        if (defaultSpeedLimit > 0) {
-             QMetaObject::invokeMethod(task->worker, "setSpeedLimit", Q_ARG(double, defaultSpeedLimit));
+void MyForm::restoreSession() {
+    QList<SessionEntry> entries = SessionStore::load();
+    if (entries.isEmpty()) return;
+
+    // No state file is opened here; the scheduler looks at a task's state
+    // only when it is about to run it.
+    static const char* labels[] = {"Queued", "Paused", "Completed", "Error"};
+    QList<QueuedDownload> queue;
+    QMap<QString, double> groupWeights;
+    table->setUpdatesEnabled(false);
+    for (const auto& e : entries) {
+        TaskInfo* task = new TaskInfo();
+        task->worker = nullptr;
+        task->currentSpeed = 0;
+        task->url = e.url;
+        task->outputPath = e.outputPath;
+        task->checksum = e.checksum;
+        task->pieces = e.pieces;
+        task->downloadId = e.downloadId;
+        task->downloaded = e.downloaded;
+        task->totalSize = e.size;
+        task->group = e.group;
+        task->weight = e.weight;
+        QString uid = addTaskRow(task, e.name);
+        scheduler->setWeight(uid, e.weight);
+        if (!e.group.isEmpty()) {
+            scheduler->setGroup(uid, e.group);
+            groupWeights.insert(e.group, e.groupWeight);
         }
-        task->worker->startDownload(url, path); 
-    });
+        if (e.status != SessionEntry::Queued) onWorkerStatus(uid, labels[e.status]);
+        else queue.append({uid, e.url, e.outputPath, e.downloadId, QString(), e.checksum, e.pieces});
+    }
+    table->setUpdatesEnabled(true);
+    // Once per group; each call walks every download.
+    for (auto it = groupWeights.constBegin(); it != groupWeights.constEnd(); ++it)
+        scheduler->setGroupWeight(it.key(), it.value());
+    scheduler->enqueueAll(queue);
+}
+
+void MyForm::saveSession() {
+    sessionTimer->stop();
+    std::vector<TaskInfo*> byRow(table->rowCount(), nullptr);
+    for (auto t : tasks) {
+        if (t->tableRow >= 0 && t->tableRow < (int)byRow.size()) byRow[t->tableRow] = t;
+    }
 
-    connect(task->worker, &DownloadWorker::progressUpdated, this, [=](double p, double dl, double tot, double spd, double eta){
-        this->onWorkerProgress(uid, p, dl, tot, spd, eta);
+    QList<SessionEntry> entries;
+    entries.reserve(tasks.size());
+    for (int row = 0; row < (int)byRow.size(); ++row) {
+        TaskInfo* t = byRow[row];
+        if (!t) continue;
+        SessionEntry e;
+        e.url = t->url;
+        e.outputPath = t->outputPath;
+        e.downloadId = t->downloadId;
+        e.checksum = t->checksum;
+        e.pieces = t->pieces;
+        e.weight = t->weight;
+        e.group = t->group;
+        e.groupWeight = scheduler->groupWeight(t->group);
+        e.name = table->item(row, 0)->text();
+        e.downloaded = (qint64)t->downloaded;
+        e.size = (qint64)t->totalSize;
+        // Anything running or about to run is queued again next time.
+        QString status = table->item(row, 6)->text();
+        if (status == "Paused") e.status = SessionEntry::Paused;
+        else if (status == "Completed") e.status = SessionEntry::Completed;
+        else if (status == "Error") e.status = SessionEntry::Failed;
+        else e.status = SessionEntry::Queued;
+        entries.append(e);
+    }
+    if (!SessionStore::save(entries)) qWarning() << "Could not save the download list to" << SessionStore::path();
+}
+
+void MyForm::scheduleSessionSave() {
+    // At most one write per interval, however busy the list is.
+    if (!sessionTimer->isActive()) sessionTimer->start();
+}
+
+void MyForm::onWorkerStarted(const QString& uid, DownloadWorker* worker) {
+    if(!tasks.contains(uid)) return;
+    tasks[uid]->worker = worker;
+
+    connect(worker, &DownloadWorker::progressUpdated, this,
+            [=](double p, double dl, double tot, double spd, double eta, double etaLow, double etaHigh){
+        this->onWorkerProgress(uid, p, dl, tot, spd, eta, etaLow, etaHigh);
     });
 
-    connect(task->worker, &DownloadWorker::chunkProgressUpdated, this, [=](const std::vector<ChunkProgress>& c){
+    connect(worker, &DownloadWorker::chunkProgressUpdated, this, [=](const std::vector<ChunkProgress>& c){
         this->onWorkerChunkProgress(uid, c);
     });
 
-    connect(task->worker, &DownloadWorker::statusChanged, this, [=](QString s){
+    connect(worker, &DownloadWorker::pieceStatesUpdated, this, [=](qint64 pieceLength, const QByteArray& states){
+        if (!tasks.contains(uid)) return;
+        if (TableSegmentedBar* pBar = progressBar(tasks[uid]->tableRow)) pBar->setPieces(pieceLength, states);
+    });
+
+    connect(worker, &DownloadWorker::statusChanged, this, [=](QString s){
         this->onWorkerStatus(uid, s);
     });
     
-    connect(task->worker, &DownloadWorker::downloadIDGenerated, this, [=](QString downId){
+    connect(worker, &DownloadWorker::downloadIDGenerated, this, [=](QString downId){
         this->onWorkerIDGenerated(uid, downId);
     });
 
-    connect(task->worker, &DownloadWorker::downloadFinished, this, [=](bool s, QString m){
+    connect(worker, &DownloadWorker::downloadFinished, this, [=](bool s, QString m){
         this->onWorkerFinished(uid, s, m);
     });
-    
-    connect(task->worker, &DownloadWorker::downloadFinished, task->thread, &QThread::quit);
-    connect(task->thread, &QThread::finished, task->worker, &QObject::deleteLater);
+}
 
-    task->thread->start();
+void MyForm::onWorkerReleased(const QString& uid) {
+    if(!tasks.contains(uid)) return;
+    tasks[uid]->worker = nullptr;
+    tasks[uid]->currentSpeed = 0;
 }
 
 void MyForm::onAddClicked() {
@@ -583,7 +792,7 @@ void MyForm::onAddClicked() {
     if(dlg.exec() == QDialog::Accepted) {
         QString url = dlg.urlEdit->text().trimmed();
         QString path = dlg.pathEdit->text();
-        addDownload(url, path);
+        addDownload(url, path, Checksum::parse(dlg.checksumEdit->text()).toString(), dlg.piecesEdit->text().trimmed());
     }
 }
 
@@ -609,7 +818,8 @@ void MyForm::dropEvent(QDropEvent *event) {
             dlg.urlEdit->setText(url);
             dlg.pathEdit->setText(defaultDownloadPath);
             if (dlg.exec() == QDialog::Accepted) {
-                addDownload(dlg.urlEdit->text(), dlg.pathEdit->text());
+                addDownload(dlg.urlEdit->text(), dlg.pathEdit->text(),
+                            Checksum::parse(dlg.checksumEdit->text()).toString(), dlg.piecesEdit->text().trimmed());
             }
         }
     }
@@ -656,6 +866,34 @@ void MyForm::showContextMenu(const QPoint &pos) {
     QAction* openFileAct = menu.addAction("Open File");
     QAction* copyUrlAct = menu.addAction("Copy URL");
     menu.addSeparator();
+
+    // Shares of the speed limit; they apply at once to a running download.
+    QString uid = taskAtRow(row);
+    TaskInfo* task = tasks.value(uid, nullptr);
+    auto addWeights = [](QMenu* sub, double current) {
+        const QList<QPair<QString, double>> presets = {
+            {"High", DownloadScheduler::kHighWeight},
+            {"Normal", DownloadScheduler::kNormalWeight},
+            {"Low", DownloadScheduler::kLowWeight}};
+        for (const auto& p : presets) {
+            QAction* act = sub->addAction(p.first);
+            act->setData(p.second);
+            act->setCheckable(true);
+            act->setChecked(qFuzzyCompare(current, p.second));
+        }
+        sub->addSeparator();
+        sub->addAction("Custom Weight...")->setData(0.0);
+    };
+    QMenu* priorityMenu = menu.addMenu("Priority");
+    priorityMenu->setEnabled(task != nullptr);
+    if (task) addWeights(priorityMenu, task->weight);
+    QMenu* groupMenu = nullptr;
+    if (task && !task->group.isEmpty()) {
+        groupMenu = menu.addMenu("Group Priority");
+        groupMenu->setToolTip(task->group);
+        addWeights(groupMenu, scheduler->groupWeight(task->group));
+    }
+    menu.addSeparator();
     QAction* removeAct = menu.addAction("Remove");
     
     QTableWidgetItem* statusItem = table->item(row, 6);
@@ -671,7 +909,40 @@ void MyForm::showContextMenu(const QPoint &pos) {
         copyUrlToClipboard(row);
     } else if (selectedItem == removeAct) {
         onRemoveClicked();
+    } else if (selectedItem && task && (selectedItem->parent() == priorityMenu ||
+                                       (groupMenu && selectedItem->parent() == groupMenu))) {
+        bool forGroup = selectedItem->parent() == groupMenu;
+        double weight = selectedItem->data().toDouble();
+        if (weight <= 0) {
+            bool ok = false;
+            double current = forGroup ? scheduler->groupWeight(task->group) : task->weight;
+            weight = QInputDialog::getDouble(this, forGroup ? "Group Priority" : "Priority",
+                                             "Weight (Low = 1, Normal = 4, High = 16):",
+                                             current, 0.1, 1000, 1, &ok);
+            if (!ok) return;
+        }
+        if (forGroup) setGroupWeight(task->group, weight);
+        else setTaskWeight(uid, weight);
+    }
+}
+
+QString MyForm::taskAtRow(int row) const {
+    for (auto it = tasks.constBegin(); it != tasks.constEnd(); ++it) {
+        if (it.value()->tableRow == row) return it.key();
     }
+    return QString();
+}
+
+void MyForm::setTaskWeight(const QString& uid, double weight) {
+    if (!tasks.contains(uid)) return;
+    tasks[uid]->weight = weight;
+    scheduler->setWeight(uid, weight);
+    scheduleSessionSave();
+}
+
+void MyForm::setGroupWeight(const QString& group, double weight) {
+    scheduler->setGroupWeight(group, weight);
+    scheduleSessionSave();
 }
 
 void MyForm::openDownloadFolder(int row) {
@@ -707,31 +978,41 @@ void MyForm::copyUrlToClipboard(int row) {
 void MyForm::onWorkerIDGenerated(QString uid, QString downloadId) {
     if(tasks.contains(uid)) {
         tasks[uid]->downloadId = downloadId;
+        scheduleSessionSave();
     }
 }
 
-void MyForm::onWorkerProgress(QString id, double prog, double dl, double total, double speed, double eta) {
+void MyForm::onWorkerProgress(QString id, double prog, double dl, double total, double speed, double eta,
+                              double etaLow, double etaHigh) {
     if(!tasks.contains(id)) return;
     TaskInfo* t = tasks[id];
     int row = t->tableRow;
     t->currentSpeed = speed; 
+    t->downloaded = dl;
+    t->totalSize = total;
 
-    QWidget* container = table->cellWidget(row, 3);
-    TableSegmentedBar* pBar = container ? container->findChild<TableSegmentedBar*>() : nullptr;
+    TableSegmentedBar* pBar = progressBar(row);
     if(pBar) pBar->setProgressData(dl, total); 
 
     table->item(row, 1)->setText(formatSize(dl));
     table->item(row, 2)->setText(formatSize(total));
     table->item(row, 4)->setText(formatSize(speed) + "/s");
-    table->item(row, 5)->setText(formatTime(eta));
+    // The band is shown once it is worth a mention: a second or more either way.
+    QTableWidgetItem* etaItem = table->item(row, 5);
+    double spread = (etaHigh - etaLow) / 2;
+    if (std::isfinite(eta) && std::isfinite(spread) && spread >= 1)
+        etaItem->setText(formatTime(eta) + " \u00B1 " + formatTime(spread));
+    else
+        etaItem->setText(formatTime(eta));
+    etaItem->setToolTip(std::isfinite(etaHigh) ? QString("Likely between %1 and %2").arg(formatTime(etaLow), formatTime(etaHigh))
+                                               : QString());
 }
 
 void MyForm::onWorkerChunkProgress(QString id, const std::vector<ChunkProgress>& chunks) {
     if(!tasks.contains(id)) return;
     int row = tasks[id]->tableRow;
     
-    QWidget* container = table->cellWidget(row, 3);
-    TableSegmentedBar* pBar = container ? container->findChild<TableSegmentedBar*>() : nullptr;
+    TableSegmentedBar* pBar = progressBar(row);
     if(pBar) pBar->setChunks(chunks);
 }
 
@@ -747,6 +1028,22 @@ void MyForm::onWorkerStatus(QString id, QString status) {
         displayStatus = "Paused";
         displayColor = QColor("#7aa2f7"); // Blue
     } 
+    else if (status.contains("Queued", Qt::CaseInsensitive)) {
+        displayStatus = "Queued";
+        displayColor = QColor("#8E8E93"); // Grey
+    } 
+    else if (status.startsWith("Waiting for disk space", Qt::CaseInsensitive)) {
+        // Parked by the scheduler until the filesystem has room.
+        displayStatus = "Waiting for Space";
+        displayColor = QColor("#ff9e64"); // Orange
+    }
+    else if (status.startsWith("Merging", Qt::CaseInsensitive) ||
+             status.startsWith("Moving", Qt::CaseInsensitive) ||
+             status.startsWith("Verifying", Qt::CaseInsensitive) ||
+             status.startsWith("Checksum OK", Qt::CaseInsensitive)) {
+        displayStatus = status; // carries the percentage or the checksum verdict
+        displayColor = QColor("#e0af68"); // Yellow
+    }
     else if (status.contains("Complete", Qt::CaseInsensitive)) {
         displayStatus = "Completed";
         displayColor = QColor("#9ece6a"); // Green
@@ -762,8 +1059,11 @@ void MyForm::onWorkerStatus(QString id, QString status) {
         displayColor = QColor("#e0af68"); // Yellow
     }
 
+    if (item->text() != displayStatus) scheduleSessionSave();
     item->setText(displayStatus);
     item->setForeground(displayColor);
+    // How much and where, for the states that only summarise it.
+    item->setToolTip(displayStatus == "Waiting for Space" ? status : QString());
     
     // Update pause/resume button text if this task is currently selected
     updatePauseResumeButton();
@@ -773,6 +1073,7 @@ void MyForm::onWorkerFinished(QString id, bool success, QString msg) {
     if(!tasks.contains(id)) return;
     TaskInfo* t = tasks[id];
     t->currentSpeed = 0; 
+    scheduleSessionSave();
     
     QTableWidgetItem* statusItem = table->item(t->tableRow, 6);
     
@@ -790,6 +1091,7 @@ void MyForm::onWorkerFinished(QString id, bool success, QString msg) {
     } else {
         statusItem->setText("Error");
         statusItem->setForeground(QColor("#f7768e"));
+        statusItem->setToolTip(msg); // e.g. which checksum did not match
         
         if (settings->value("NotifyOnError", true).toBool()) {
             QString fileName = table->item(t->tableRow, 0)->text();
@@ -806,8 +1108,20 @@ void MyForm::updateGlobalStats() {
     for(auto t : tasks) {
         totalSpeed += t->currentSpeed;
     }
+    // Each worker's figure comes from its ThroughputEstimator, so the
+    // total, the graph and the tray all follow the same recent rate.
     lblGlobalSpeed->setText(formatSize(totalSpeed) + "/s");
     globalGraph->addPoint(totalSpeed);
+    trayIcon->setToolTip(totalSpeed > 0 ? QString("ParaFetch Download Manager\n%1/s").arg(formatSize(totalSpeed))
+                                        : QString("ParaFetch Download Manager"));
+
+    BufferPool& pool = BufferPool::instance();
+    QString buffers = QString("Write buffers: %1 of %2 (peak %3)")
+                      .arg(formatSize(pool.inUseBytes()), formatSize(pool.capBytes()), formatSize(pool.peakBytes()));
+    if (*DiskWriter::backendName()) buffers += QString(", written by %1").arg(DiskWriter::backendName());
+    lblBufferMemory->setText(buffers);
+    lblSchedule->setText(scheduleStatus);
+    lblSchedule->setVisible(!scheduleStatus.isEmpty());
 }
 
 void MyForm::onPauseResumeToggle() {
@@ -821,13 +1135,18 @@ void MyForm::onPauseResumeToggle() {
     
     for(auto key : tasks.keys()) {
         if(tasks[key]->tableRow == row) {
+            TaskInfo* t = tasks[key];
             if(status == "Paused") {
-                // Resume the download
-                QString id = tasks[key]->downloadId;
-                QMetaObject::invokeMethod(tasks[key]->worker, "resumeDownload", Q_ARG(QString, id));
+                // Resume the download once the scheduler has a free slot
+                scheduler->enqueue(key, t->url, t->outputPath, t->downloadId, t->checksum, t->pieces);
+                onWorkerStatus(key, "Queued");
+            } else if(scheduler->isQueued(key)) {
+                // Never started: just take it out of the queue
+                scheduler->pause(key);
+                onWorkerStatus(key, "Paused");
             } else {
                 // Pause the download
-                QMetaObject::invokeMethod(tasks[key]->worker, "pauseDownload");
+                scheduler->pause(key);
             }
             break;
         }
@@ -850,7 +1169,7 @@ void MyForm::updatePauseResumeButton() {
     
     if(status == "Paused") {
         actPauseResume->setText("▶");
-    } else if(status == "Downloading") {
+    } else if(status == "Downloading" || status == "Queued" || status == "Waiting for Space") {
         actPauseResume->setText("⏸");
     } else {
         // For completed/error states, disable the button
@@ -868,9 +1187,11 @@ void MyForm::onRemoveClicked() {
     for(auto key : tasks.keys()) {
         if(tasks[key]->tableRow == row) {
             idToRemove = key;
-            QMetaObject::invokeMethod(tasks[key]->worker, "cancelDownload");
-            tasks[key]->thread->quit();
-            tasks[key]->thread->wait();
+            bool wasActive = scheduler->isActive(key);
+            scheduler->remove(key);
+            // Active workers clean up their own parts when cancelled.
+            if (!wasActive && !tasks[key]->downloadId.isEmpty())
+                DownloadManager::discardDownload(tasks[key]->downloadId);
             delete tasks[key]; 
             break;
         }
@@ -882,6 +1203,7 @@ void MyForm::onRemoveClicked() {
         for(auto t : tasks) {
             if(t->tableRow > row) t->tableRow--;
         }
+        scheduleSessionSave();
     }
 }
 
@@ -23,9 +23,12 @@
 #include <QSettings>
 #include <vector> 
 #include "downloadworker.h"
+#include "downloadscheduler.h"
 #include "settingsdialog.h"
 #include "batchdownloaddialog.h"
 #include "notificationmanager.h"
+#include "sessionstore.h"
+#include "bandwidthschedule.h"
 
 // --- Custom Widget: Segmented Progress Bar with Text Overlay ---
 class TableSegmentedBar : public QWidget
@@ -58,6 +61,22 @@ public:
             for(const auto& c : chunks) totalDownloaded += c.downloaded;
             m_progress = totalDownloaded / m_totalSize;
         }
+        // Ranges that had to be retried are listed in the tooltip.
+        QStringList retried;
+        for (const auto& c : chunks) {
+            if (c.retries > 0)
+                retried << QString("Part %1: %2 retries (%3)").arg(c.id).arg(c.retries).arg(c.status);
+        }
+        setToolTip(retried.join("\n"));
+        update();
+    }
+
+    // PieceVerifier states, drawn over the chunks: verified pieces green,
+    // failed ones red, the rest as downloaded.
+    void setPieces(qint64 pieceLength, const QByteArray &states)
+    {
+        m_pieceLength = pieceLength;
+        m_pieceStates = states;
         update();
     }
 
@@ -95,6 +114,31 @@ protected:
             p.drawRoundedRect(0, 0, width() * m_progress, height(), 4, 4);
         }
 
+        // Pieces: runs of the same state in one rectangle each.
+        if (m_pieceLength > 0 && m_totalSize > 0)
+        {
+            double scale = (double)width() / m_totalSize;
+            int n = m_pieceStates.size();
+            for (int i = 0; i < n;)
+            {
+                char state = m_pieceStates[i];
+                int j = i + 1;
+                while (j < n && m_pieceStates[j] == state) ++j;
+                QColor color;
+                if (state == PieceVerifier::Verified) color = QColor(48, 209, 88);      // Green
+                else if (state == PieceVerifier::Hashed) color = QColor(48, 209, 88, 140);
+                else if (state == PieceVerifier::Failed) color = QColor(255, 69, 58);  // Red
+                if (color.isValid())
+                {
+                    double x = i * m_pieceLength * scale;
+                    double w = std::min<double>(j * m_pieceLength, m_totalSize) * scale - x;
+                    p.setBrush(color);
+                    p.drawRect(QRectF(x, 0, std::max(w, 1.0), height()));
+                }
+                i = j;
+            }
+        }
+
         // 3. Draw Text Overlay ("X %")
         p.setBrush(Qt::NoBrush);
         
@@ -117,6 +161,8 @@ private:
     double m_downloaded;
     double m_totalSize;
     std::vector<ChunkProgress> m_chunks;
+    qint64 m_pieceLength = 0;
+    QByteArray m_pieceStates;
 };
 
 // --- Global Speed Graph with Gradient Fade ---
@@ -199,7 +245,7 @@ class DiskUsagePieChart : public QWidget
 {
     Q_OBJECT
 public:
-    DiskUsagePieChart(QWidget *parent = nullptr) : QWidget(parent)
+    DiskUsagePieChart(QWidget *parent = nullptr) : QWidget(parent), m_path(QDir::homePath())
     {
         setMinimumSize(100, 100);
         setMaximumSize(100, 100);
@@ -211,9 +257,16 @@ public:
         diskTimer->start(5000);
     }
     
+    // The filesystem downloads go to, not necessarily the one holding $HOME.
+    void setPath(const QString& path)
+    {
+        m_path = path;
+        updateDiskSpace();
+    }
+
     void updateDiskSpace()
     {
-        QStorageInfo storage(QDir::homePath());
+        QStorageInfo storage(m_path);
         m_totalSpace = storage.bytesTotal();
         m_freeSpace = storage.bytesAvailable();
         update();
@@ -271,6 +324,7 @@ protected:
     }
 
 private:
+    QString m_path;
     qint64 m_totalSpace = 0;
     qint64 m_freeSpace = 0;
 };
@@ -281,18 +335,25 @@ class AddDownloadDialog : public QDialog
 public:
     QLineEdit *urlEdit;
     QLineEdit *pathEdit;
+    QLineEdit *checksumEdit; // optional expected digest
+    QLineEdit *piecesEdit;   // optional piece hash manifest, path or URL
     AddDownloadDialog(QWidget *parent = nullptr);
 };
 
 struct TaskInfo
 {
-    QThread *thread;
-    DownloadWorker *worker;
+    DownloadWorker *worker; // null while queued or paused
     int tableRow;
     double currentSpeed;
     QString downloadId;
     QString url;
     QString outputPath;
+    QString checksum; // expected digest, empty if none
+    QString pieces;   // piece hash manifest, empty if none
+    QString group;    // batch the task was imported with, empty if none
+    double weight = DownloadScheduler::kNormalWeight; // share of the speed limit
+    double downloaded = 0; // last reported, kept for the session file
+    double totalSize = 0;
 };
 
 class MyForm : public QMainWindow
@@ -317,40 +378,67 @@ private slots:
     void onClipboardChanged();
     void onTrayIconActivated(QSystemTrayIcon::ActivationReason reason);
 
-    void onWorkerProgress(QString id, double prog, double dl, double total, double speed, double eta);
+    void onWorkerProgress(QString id, double prog, double dl, double total, double speed, double eta,
+                          double etaLow, double etaHigh);
     void onWorkerChunkProgress(QString id, const std::vector<ChunkProgress> &chunks);
     void onWorkerStatus(QString id, QString status);
     void onWorkerFinished(QString id, bool success, QString msg);
     void onWorkerIDGenerated(QString uid, QString downloadId);
+    void onWorkerStarted(const QString &uid, DownloadWorker *worker);
+    void onWorkerReleased(const QString &uid);
 
     void updateGlobalStats();
+    void applySchedule(); // the limits of the rule in effect now, or the defaults
 
 private:
     void setupUI();
     void applyStyles();
     void loadSettings();
-    void addDownload(const QString &url, const QString &path);
+    void addDownload(const QString &url, const QString &path, const QString &checksum = QString(),
+                     const QString &pieces = QString(), const QString &group = QString());
+    QString addTaskRow(TaskInfo *task, const QString &name); // returns the task's uid
+    TableSegmentedBar *progressBar(int row); // created on first use
+    void restoreSession();
+    void saveSession();
+    void scheduleSessionSave();
     void openDownloadFolder(int row);
     void openDownloadedFile(int row);
     void copyUrlToClipboard(int row);
+    QString taskAtRow(int row) const; // uid, empty if none
+    void setTaskWeight(const QString &uid, double weight);
+    void setGroupWeight(const QString &group, double weight);
     QString formatSize(double bytes);
     QString formatTime(double seconds);
 
     QTableWidget *table;
     GlobalSpeedGraph *globalGraph;
+    DiskUsagePieChart *diskChart;
     QLabel *lblGlobalSpeed;
+    QLabel *lblBufferMemory;
+    QLabel *lblSchedule;
     QAction *actPauseResume;
     QSystemTrayIcon *trayIcon;
     QClipboard *clipboard;
     QSettings *settings;
 
     QMap<QString, TaskInfo *> tasks;
+    quint64 lastTaskId = 0;
+    DownloadScheduler *scheduler;
     QTimer *globalTimer;
+    QTimer *sessionTimer;
+    QTimer *scheduleTimer;  // fires on the next minute, when a rule may start or end
     
     // Settings
     QString defaultDownloadPath;
     int defaultConnections;
+    int maxActiveDownloads;
+    int maxTotalConnections;
+    int maxConnectionsPerHost;
     double defaultSpeedLimit;
+    BandwidthSchedule schedule;
+    double appliedSpeedLimit = -1; // KB/s, as last given to the scheduler
+    int appliedMaxActive = 0;
+    QString scheduleStatus;        // empty without a schedule
     bool clipboardMonitoringEnabled;
     bool notificationsEnabled;
 };
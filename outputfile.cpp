@@ -0,0 +1,117 @@
+#include "outputfile.h"
+#include "writeback.h"
+#include <QFile>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+OutputFile::OutputFile() : m_fd(-1), m_directFd(-1), m_size(-1), m_preallocated(false) {}
+
+OutputFile::~OutputFile() {
+    close();
+}
+
+bool OutputFile::open(const QString& path, curl_off_t size, bool truncate) {
+    close();
+    m_path = path;
+    m_size = size;
+    m_preallocated = false;
+    // Read access too: a shared writable mapping needs it.
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+    m_fd = ::open(path.toLocal8Bit().constData(), flags, 0644);
+    if (m_fd < 0) { m_error = QString::fromLocal8Bit(strerror(errno)); return false; }
+
+    if (size < 0) return true;
+
+    // Reserve the space up front: a full disk fails here instead of halfway
+    // through, and the file is laid out contiguously where the filesystem
+    // can manage it. Filesystems without fallocate get a sparse file.
+    int rc = -1;
+#ifdef __linux__
+    rc = fallocate(m_fd, 0, 0, size);
+    m_preallocated = rc == 0;
+    if (rc != 0 && errno == ENOSPC) {
+        m_error = "Not enough disk space";
+        close();
+        return false;
+    }
+#endif
+    if (rc != 0 && ftruncate(m_fd, size) != 0) {
+        m_error = QString::fromLocal8Bit(strerror(errno));
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool OutputFile::enableDirectIO() {
+#ifdef O_DIRECT
+    if (m_fd < 0) return false;
+    if (m_directFd >= 0) return true;
+    m_directFd = ::open(m_path.toLocal8Bit().constData(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (m_directFd < 0) { m_error = QString::fromLocal8Bit(strerror(errno)); return false; }
+    return true;
+#else
+    return false;
+#endif
+}
+
+int OutputFile::fdFor(const char* data, size_t length, curl_off_t offset) const {
+    const size_t align = kDirectAlignment;
+    if (m_directFd >= 0 && offset % align == 0 && length % align == 0 &&
+        reinterpret_cast<quintptr>(data) % align == 0)
+        return m_directFd;
+    return m_fd;
+}
+
+int OutputFile::writeAt(const char* data, size_t length, curl_off_t offset) const {
+    int fd = fdFor(data, length, offset);
+    int error = pwriteAll(fd, data, length, offset);
+    if (error == EINVAL && fd != m_fd) error = pwriteAll(m_fd, data, length, offset);
+    return error;
+}
+
+bool OutputFile::reserve(curl_off_t length) {
+#ifdef __linux__
+    if (m_fd < 0 || length <= 0) return true;
+    if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, length) == 0) return true;
+    if (errno != ENOSPC) return true; // not supported here; nothing lost
+    m_error = "Not enough disk space";
+    return false;
+#else
+    Q_UNUSED(length);
+    return true;
+#endif
+}
+
+bool OutputFile::write(const void* data, size_t length, curl_off_t offset) {
+    int error = pwriteAll(m_fd, static_cast<const char*>(data), length, offset);
+    if (error) m_error = QString::fromLocal8Bit(strerror(error));
+    return error == 0;
+}
+
+int OutputFile::pwriteAll(int fd, const char* data, size_t length, curl_off_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) return EIO;
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+void OutputFile::close() {
+    if (m_fd >= 0) Writeback::instance().forget(this);
+    if (m_directFd >= 0) ::close(m_directFd);
+    m_directFd = -1;
+    if (m_fd < 0) return;
+    ::close(m_fd);
+    m_fd = -1;
+}
+
@@ -0,0 +1,66 @@
+#ifndef OUTPUTFILE_H
+#define OUTPUTFILE_H
+
+#include <QString>
+#include <curl/curl.h>
+#include <atomic>
+
+// A file chunk data is written to: the download's target written in place,
+// or a part file. The target is preallocated once and every connection
+// writes its range at the absolute file offset with pwrite(), so finishing
+// a download is a rename instead of a merge.
+class OutputFile {
+public:
+    OutputFile();
+    ~OutputFile();
+
+    // truncate: start a fresh file; otherwise reopen one being resumed.
+    // size < 0 skips preallocation (part files grow as they are written).
+    bool open(const QString& path, curl_off_t size, bool truncate);
+    bool write(const void* data, size_t length, curl_off_t offset);
+    // Reserves disk blocks for [0, length) without changing the file size,
+    // for files that grow as they are written. False when the disk is full.
+    bool reserve(curl_off_t length);
+    void close();
+
+    // Adds an O_DIRECT descriptor next to the normal one. Writes that are
+    // page aligned in offset, length and memory then bypass the page cache;
+    // the unaligned head and tail of a range still go through it. Fails
+    // (harmlessly) on filesystems without O_DIRECT support.
+    bool enableDirectIO();
+
+    bool isOpen() const { return m_fd >= 0; }
+    int fd() const { return m_fd; }
+    curl_off_t size() const { return m_size; } // as opened; -1 for growing files
+    // Blocks are reserved, not just a sparse file: stores through a mapping
+    // cannot fail for lack of space.
+    bool isPreallocated() const { return m_preallocated; }
+    // The descriptor a write of this shape should use.
+    int fdFor(const char* data, size_t length, curl_off_t offset) const;
+    // pwriteAll() through fdFor(), retried through the page cache if the
+    // device turns the direct write down. Returns 0 or an errno value.
+    int writeAt(const char* data, size_t length, curl_off_t offset) const;
+    // A verifier is going to read the written bytes back: Writeback still
+    // bounds the dirty pages but leaves the clean ones in the page cache.
+    void setKeepCached(bool keep) { m_keepCached = keep; }
+    bool keepCached() const { return m_keepCached; }
+    QString path() const { return m_path; }
+    QString errorString() const { return m_error; }
+
+    // Positioned write of the whole buffer; returns 0 or an errno value.
+    // Safe to call from any thread.
+    static int pwriteAll(int fd, const char* data, size_t length, curl_off_t offset);
+
+    static constexpr size_t kDirectAlignment = 4096;
+
+private:
+    int m_fd;
+    int m_directFd; // -1 unless enableDirectIO() succeeded
+    curl_off_t m_size;
+    bool m_preallocated;
+    std::atomic<bool> m_keepCached{false};
+    QString m_path;
+    QString m_error;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "piecemanifest.h"
+#include "downloadmanager.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QXmlStreamReader>
+#include <QDebug>
+#include <algorithm>
+
+namespace {
+// A locally computed manifest never has more pieces than this; larger
+// files get larger pieces.
+constexpr curl_off_t kMaxLocalPieces = 8192;
+constexpr curl_off_t kMinLocalPiece = 4 * 1024 * 1024;
+constexpr curl_off_t kMiB = 1024 * 1024;
+constexpr size_t kMaxMetalinkPieces = 1 << 24;
+
+bool algorithmFromName(const QString& name, Checksum::Algorithm& algorithm) {
+    QString n = name.toLower().remove('-');
+    for (int a = Checksum::Md5; a <= Checksum::Crc32c; ++a) {
+        if (Checksum::algorithmName((Checksum::Algorithm)a) == n) {
+            algorithm = (Checksum::Algorithm)a;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hex of the right length for the algorithm, lowercased; empty if not.
+QByteArray pieceHash(Checksum::Algorithm algorithm, const QString& hex) {
+    return Checksum::parse(Checksum::algorithmName(algorithm) + ":" + hex).hex;
+}
+
+bool parseSidecar(const QByteArray& data, PieceManifest& manifest) {
+    PieceManifest m;
+    bool haveAlgorithm = false;
+    QTextStream in(data);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+        if (line.startsWith("algorithm ")) {
+            if (!algorithmFromName(line.mid(10).trimmed(), m.algorithm)) return false;
+            haveAlgorithm = true;
+        } else if (line.startsWith("piece-length ")) {
+            m.pieceLength = line.mid(13).trimmed().toLongLong();
+        } else if (line == "-") {
+            m.hashes.push_back(QByteArray());
+        } else {
+            QByteArray hash = pieceHash(m.algorithm, line);
+            if (hash.isEmpty()) return false;
+            m.hashes.push_back(hash);
+        }
+    }
+    if (!haveAlgorithm || !m.isValid()) return false;
+    manifest = m;
+    return true;
+}
+
+bool parseMetalink(const QByteArray& data, const QString& fileName, PieceManifest& manifest) {
+    QXmlStreamReader xml(data);
+    PieceManifest current, fallback;
+    QString currentName;
+    QString piecesType;
+    bool inFile = false, inPieces = false, found = false;
+    while (!xml.atEnd() && !found) {
+        xml.readNext();
+        QStringView element = xml.name();
+        if (xml.isStartElement()) {
+            if (element == QLatin1String("file")) {
+                inFile = true;
+                current = PieceManifest();
+                currentName = xml.attributes().value("name").toString();
+            } else if (inFile && element == QLatin1String("pieces")) {
+                inPieces = true;
+                piecesType = xml.attributes().value("type").toString();
+                current.pieceLength = xml.attributes().value("length").toLongLong();
+                if (!algorithmFromName(piecesType, current.algorithm)) current.pieceLength = 0;
+            } else if (inFile && element == QLatin1String("hash")) {
+                // v3 numbers its pieces, v4 lists them in order.
+                QString piece = xml.attributes().value("piece").toString();
+                QString type = xml.attributes().value("type").toString();
+                QString hex = xml.readElementText().trimmed();
+                if (inPieces) {
+                    size_t index = piece.isEmpty() ? current.hashes.size() : (size_t)piece.toLongLong();
+                    if (index > kMaxMetalinkPieces) return false;
+                    if (index >= current.hashes.size()) current.hashes.resize(index + 1);
+                    current.hashes[index] = pieceHash(current.algorithm, hex);
+                } else if (!current.fileChecksum.isValid()) {
+                    current.fileChecksum = Checksum::parse(type + ":" + hex);
+                }
+            }
+        } else if (xml.isEndElement()) {
+            if (element == QLatin1String("pieces")) {
+                inPieces = false;
+            } else if (element == QLatin1String("file")) {
+                inFile = false;
+                bool complete = current.isValid() &&
+                                std::none_of(current.hashes.begin(), current.hashes.end(),
+                                             [](const QByteArray& h) { return h.isEmpty(); });
+                if (!complete) continue;
+                if (currentName == fileName) {
+                    fallback = current;
+                    found = true;
+                } else if (!fallback.isValid()) {
+                    fallback = current;
+                }
+            }
+        }
+    }
+    if (xml.hasError() && !found) qWarning() << "Metalink:" << xml.errorString();
+    if (!fallback.isValid()) return false;
+    manifest = fallback;
+    return true;
+}
+}
+
+bool PieceManifest::fits(curl_off_t fileSize) const {
+    return isValid() && fileSize > 0 && (curl_off_t)hashes.size() == (fileSize + pieceLength - 1) / pieceLength;
+}
+
+bool PieceManifest::parse(const QByteArray& data, const QString& fileName, PieceManifest& manifest) {
+    QByteArray head = data.left(256).trimmed();
+    if (head.startsWith("<")) return parseMetalink(data, fileName, manifest);
+    return parseSidecar(data, manifest);
+}
+
+bool PieceManifest::load(const QString& path, PieceManifest& manifest) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) return false;
+    return parseSidecar(f.readAll(), manifest);
+}
+
+bool PieceManifest::save(const QString& path) const {
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
+    QTextStream out(&f);
+    out << "# ParaFetch piece hashes\n";
+    out << "algorithm " << Checksum::algorithmName(algorithm) << "\n";
+    out << "piece-length " << pieceLength << "\n";
+    for (const auto& hash : hashes) out << (hash.isEmpty() ? QByteArray("-") : hash) << "\n";
+    out.flush();
+    return f.commit();
+}
+
+PieceManifest PieceManifest::local(curl_off_t fileSize) {
+    PieceManifest m;
+    curl_off_t length = (fileSize / kMaxLocalPieces + kMiB - 1) / kMiB * kMiB;
+    m.pieceLength = std::max(kMinLocalPiece, length);
+    m.hashes.resize((size_t)((fileSize + m.pieceLength - 1) / m.pieceLength));
+    return m;
+}
+
+QString PieceManifest::path(const QString& downloadId) {
+    return DownloadManager::getTempDirectory() + "/" + downloadId + ".pieces";
+}
@@ -0,0 +1,49 @@
+#ifndef PIECEMANIFEST_H
+#define PIECEMANIFEST_H
+
+#include <QString>
+#include <QByteArray>
+#include <curl/curl.h>
+#include <vector>
+#include "checksum.h"
+
+// Digests of the fixed-size pieces a file is cut into, so a damaged piece
+// can be fetched again on its own instead of the whole file.
+//
+// Read from a ".sha256pieces" sidecar:
+//
+//     # ParaFetch piece hashes
+//     algorithm sha256
+//     piece-length 4194304
+//     <hex of piece 0>
+//     <hex of piece 1>
+//     ...
+//
+// or from the <pieces> of a Metalink (v3 or v4). A manifest computed
+// locally starts with every hash unknown ("-" in the file) and fills in
+// as the pieces are hashed; kept next to the download it lets a later run
+// tell which pieces changed on disk.
+struct PieceManifest {
+    Checksum::Algorithm algorithm = Checksum::Sha256;
+    curl_off_t pieceLength = 0;
+    std::vector<QByteArray> hashes;  // lowercase hex; empty while unknown
+    Checksum fileChecksum;           // whole-file digest a Metalink carried along
+
+    bool isValid() const { return pieceLength > 0 && !hashes.empty(); }
+    int pieceCount() const { return (int)hashes.size(); }
+    // One hash for every piece of a file this long.
+    bool fits(curl_off_t fileSize) const;
+
+    // Either format. A Metalink can describe several files; the one named
+    // `fileName` is picked, else the first.
+    static bool parse(const QByteArray& data, const QString& fileName, PieceManifest& manifest);
+    static bool load(const QString& path, PieceManifest& manifest);
+    bool save(const QString& path) const; // atomically, in the sidecar format
+    // Unknown hashes for pieces sized to keep their number manageable.
+    static PieceManifest local(curl_off_t fileSize);
+
+    static QString path(const QString& downloadId); // kept with the download's state
+    static constexpr const char* kSuffix = ".sha256pieces";
+};
+
+#endif
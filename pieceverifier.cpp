@@ -0,0 +1,182 @@
+#include "pieceverifier.h"
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+PieceVerifier::PieceVerifier(const PieceManifest& manifest, curl_off_t fileSize)
+    : m_manifest(manifest), m_fileSize(fileSize), m_states(manifest.pieceCount(), Pending),
+      m_generations(manifest.pieceCount(), 0), m_version(0), m_stop(false)
+{
+    for (const auto& hash : m_manifest.hashes) m_known.push_back(!hash.isEmpty());
+    m_thread = std::thread([this]() { run(); });
+}
+
+PieceVerifier::~PieceVerifier() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    for (int fd : m_fds) ::close(fd);
+}
+
+curl_off_t PieceVerifier::pieceEnd(int piece) const {
+    return std::min(m_fileSize, pieceStart(piece + 1));
+}
+
+void PieceVerifier::update(std::vector<StreamVerifier::Segment> segments) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_segments = std::move(segments);
+        m_ready.clear();
+        for (const auto& s : m_segments) m_ready.add(s.start, s.start + std::min(s.ready, s.length));
+    }
+    m_cond.notify_all();
+}
+
+void PieceVerifier::recheck(int piece) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (piece < 0 || piece >= pieceCount()) return;
+        m_states[piece] = Pending;
+        ++m_generations[piece];
+        ++m_version;
+    }
+    m_cond.notify_all();
+}
+
+void PieceVerifier::invalidate(curl_off_t start, curl_off_t end) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (end <= start) return;
+    int first = (int)(start / m_manifest.pieceLength);
+    int last = (int)std::min<curl_off_t>(pieceCount() - 1, (end - 1) / m_manifest.pieceLength);
+    for (int piece = first; piece <= last; ++piece) {
+        // A failed piece is fetched again anyway and comes back by recheck().
+        if (m_states[piece] == Failed) continue;
+        if (!m_known[piece]) m_manifest.hashes[piece].clear();
+        m_states[piece] = Pending;
+        ++m_generations[piece];
+    }
+    // The layout that vouched for these bytes is stale until the next update.
+    m_segments.clear();
+    m_ready.clear();
+    ++m_version;
+}
+
+std::vector<int> PieceVerifier::takeFailed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<int> failed;
+    failed.swap(m_failed);
+    return failed;
+}
+
+bool PieceVerifier::settled() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (char state : m_states) {
+        if (state != Verified && state != Hashed) return false;
+    }
+    return true;
+}
+
+QByteArray PieceVerifier::states(quint64& version) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    version = m_version;
+    return m_states;
+}
+
+PieceManifest PieceVerifier::manifest() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_manifest;
+}
+
+int PieceVerifier::descriptor(const QString& path) {
+    auto it = m_fds.find(path);
+    if (it != m_fds.end()) return it.value();
+    int fd = ::open(path.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) m_fds.insert(path, fd);
+    return fd;
+}
+
+int PieceVerifier::nextPiece() const {
+    for (int piece = 0; piece < pieceCount(); ++piece) {
+        if (m_states[piece] == Pending && m_ready.contains(pieceStart(piece), pieceEnd(piece))) return piece;
+    }
+    return -1;
+}
+
+void PieceVerifier::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        int piece = nextPiece();
+        if (piece < 0) {
+            m_cond.wait(lock);
+            continue;
+        }
+        quint32 generation = m_generations[piece];
+        std::vector<StreamVerifier::Segment> segments = m_segments;
+        lock.unlock();
+
+        QByteArray hex;
+        bool read = hashPiece(piece, segments, hex);
+
+        lock.lock();
+        if (generation != m_generations[piece]) continue; // rewritten meanwhile
+        State state;
+        if (!read) {
+            state = Failed;
+        } else if (!m_known[piece]) {
+            m_manifest.hashes[piece] = hex;
+            state = Hashed;
+        } else {
+            state = hex == m_manifest.hashes[piece] ? Verified : Failed;
+        }
+        if (state == Failed) {
+            qWarning() << "Piece" << piece << "failed verification";
+            m_failed.push_back(piece);
+        }
+        m_states[piece] = state;
+        ++m_version;
+    }
+}
+
+bool PieceVerifier::hashPiece(int piece, const std::vector<StreamVerifier::Segment>& segments, QByteArray& hex) {
+    Digest digest(m_manifest.algorithm);
+    std::vector<char> buffer(StreamVerifier::kSliceSize);
+    curl_off_t pos = pieceStart(piece);
+    const curl_off_t end = pieceEnd(piece);
+    while (pos < end) {
+        // A piece can span ranges, and with them files.
+        const StreamVerifier::Segment* segment = nullptr;
+        curl_off_t segmentEnd = 0;
+        for (const auto& s : segments) {
+            segmentEnd = s.start + std::min(s.ready, s.length);
+            if (pos >= s.start && pos < segmentEnd) { segment = &s; break; }
+        }
+        if (!segment) return false;
+        size_t length = (size_t)std::min({end - pos, segmentEnd - pos, (curl_off_t)buffer.size()});
+        curl_off_t offset = segment->fileOffset + (pos - segment->start);
+
+        errno = 0;
+        int fd = descriptor(segment->path);
+        size_t done = 0;
+        while (fd >= 0 && done < length) {
+            ssize_t n = pread(fd, buffer.data() + done, length - done, offset + (off_t)done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done < length) {
+            qWarning() << "Cannot read back" << segment->path << ":"
+                       << (errno ? strerror(errno) : "file too short");
+            return false;
+        }
+        digest.addData(buffer.data(), length);
+        pos += (curl_off_t)length;
+    }
+    hex = digest.hexResult();
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef PIECEVERIFIER_H
+#define PIECEVERIFIER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <curl/curl.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "piecemanifest.h"
+#include "streamverifier.h"
+#include "rangeset.h"
+
+// Hashes every piece of a download as soon as all of its bytes are on
+// disk, on a thread of its own, and checks it against the manifest. A
+// piece whose hash is not known yet gets it recorded instead.
+//
+// Pieces that fail wait for the worker to fetch their bytes again; it
+// hands them back with recheck() once the new bytes are written. Like
+// StreamVerifier it reads through descriptors of its own, while the data
+// is still in the page cache.
+class PieceVerifier {
+public:
+    enum State : char { Pending, Verified, Failed, Hashed };
+
+    PieceVerifier(const PieceManifest& manifest, curl_off_t fileSize);
+    ~PieceVerifier();
+
+    // The current ranges and their written prefixes, as for StreamVerifier.
+    void update(std::vector<StreamVerifier::Segment> segments);
+    // The piece was written again; hash it once more.
+    void recheck(int piece);
+    // Bytes [start, end) no longer hold what was hashed.
+    void invalidate(curl_off_t start, curl_off_t end);
+    // Pieces that failed since the last call.
+    std::vector<int> takeFailed();
+    // Every piece verified or hashed: nothing is pending or failed.
+    bool settled() const;
+    // One State per piece. `version` changes whenever one of them does.
+    QByteArray states(quint64& version) const;
+    // With the hashes recorded so far.
+    PieceManifest manifest() const;
+
+    int pieceCount() const { return m_manifest.pieceCount(); }
+    curl_off_t pieceLength() const { return m_manifest.pieceLength; }
+    curl_off_t pieceStart(int piece) const { return piece * m_manifest.pieceLength; }
+    curl_off_t pieceEnd(int piece) const; // exclusive
+
+private:
+    void run();
+    // The first pending piece whose bytes are all written, -1 if none.
+    int nextPiece() const;          // with m_mutex held
+    bool hashPiece(int piece, const std::vector<StreamVerifier::Segment>& segments, QByteArray& hex);
+    int descriptor(const QString& path);
+
+    PieceManifest m_manifest;       // hashes filled in as they are computed
+    const curl_off_t m_fileSize;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<StreamVerifier::Segment> m_segments;
+    RangeSet m_ready;               // written bytes, in file offsets
+    QByteArray m_states;
+    std::vector<bool> m_known;      // the manifest came with this piece's hash
+    std::vector<quint32> m_generations; // bumped when a piece must be hashed again
+    std::vector<int> m_failed;
+    quint64 m_version;
+    bool m_stop;
+
+    QMap<QString, int> m_fds;
+    std::thread m_thread;
+};
+
+#endif
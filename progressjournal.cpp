@@ -0,0 +1,246 @@
+#include "progressjournal.h"
+#include <QDebug>
+#include <QFileInfo>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+struct ProgressJournal::Record {
+    enum Type : quint32 {
+        Header = 0x314a4650,  // "PFJ1"; id is the format version
+        Layout = 0x4c,        // id: number of Range records that follow
+        Range = 0x52,         // id, start, end (inclusive)
+        Progress = 0x50,      // id, bytes of the range durably written
+    };
+    quint32 type;
+    qint32 id;
+    qint64 a;
+    qint64 b;
+    quint32 reserved;
+    quint32 check;
+};
+
+namespace {
+const int kVersion = 1;
+
+// FNV-1a; records are checked over everything but the checksum itself.
+quint32 fnv1a(const void* data, size_t length)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    quint32 h = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+}
+
+ProgressJournal::ProgressJournal(const QString& id)
+    : m_id(id), m_records(0), m_running(false)
+{
+    m_fd = ::open(path(id).toLocal8Bit().constData(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        qWarning() << "Cannot open progress journal" << path(id) << ":" << strerror(errno);
+        return;
+    }
+    // Carry on from what an earlier session recorded, minus a torn tail:
+    // records appended after garbage would never be read back.
+    qint64 valid = 0;
+    replay(m_fd, m_layout, m_recorded, m_records, valid);
+    if (valid == 0) {
+        m_layout.clear();
+        m_recorded.clear();
+        m_records = 0;
+    }
+    if (ftruncate(m_fd, valid) != 0) qWarning() << "Cannot truncate progress journal:" << strerror(errno);
+    if (valid == 0) {
+        Record header{Record::Header, kVersion, 0, 0, 0, 0};
+        append({header});
+    }
+}
+
+ProgressJournal::~ProgressJournal() {
+    wait();
+    if (m_fd >= 0) ::close(m_fd);
+}
+
+QString ProgressJournal::path(const QString& id) {
+    return DownloadManager::getTempDirectory() + "/" + id + ".journal";
+}
+
+bool ProgressJournal::checkpoint(std::vector<std::shared_ptr<OutputFile>> files, std::vector<ChunkRange> ranges) {
+    if (m_running) return false;
+    if (m_thread.joinable()) m_thread.join();
+    m_running = true;
+    m_thread = std::thread([this, files = std::move(files), ranges = std::move(ranges)]() {
+        run(files, ranges);
+        m_running = false;
+    });
+    return true;
+}
+
+bool ProgressJournal::checkpointNow(const std::vector<std::shared_ptr<OutputFile>>& files,
+                                    const std::vector<ChunkRange>& ranges) {
+    wait();
+    return run(files, ranges);
+}
+
+void ProgressJournal::wait() {
+    if (m_thread.joinable()) m_thread.join();
+}
+
+bool ProgressJournal::run(const std::vector<std::shared_ptr<OutputFile>>& files, const std::vector<ChunkRange>& ranges) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd < 0) return false;
+
+    // Everything about to be recorded must be on disk first, including the
+    // extent changes of preallocated files, which only fdatasync() commits.
+    for (const auto& file : files) {
+        if (file && file->isOpen() && fdatasync(file->fd()) != 0) {
+            qWarning() << "Checkpoint sync failed for" << file->path() << ":" << strerror(errno);
+            return false;
+        }
+    }
+
+    bool layoutChanged = ranges.size() != m_layout.size();
+    for (size_t i = 0; !layoutChanged && i < ranges.size(); ++i) {
+        layoutChanged = ranges[i].id != m_layout[i].id || ranges[i].start != m_layout[i].start ||
+                        ranges[i].end != m_layout[i].end;
+    }
+
+    std::vector<Record> records;
+    if (layoutChanged) {
+        records.push_back({Record::Layout, (qint32)ranges.size(), 0, 0, 0, 0});
+        for (const auto& r : ranges) records.push_back({Record::Range, r.id, r.start, r.end, 0, 0});
+    }
+    for (const auto& r : ranges) {
+        if (r.downloaded > m_recorded.value(r.id, 0))
+            records.push_back({Record::Progress, r.id, r.downloaded, 0, 0, 0});
+    }
+    if (records.empty()) return true;
+    if (m_records + (int)records.size() > kCompactRecords) return compact(ranges);
+
+    if (!append(records)) return false;
+    m_layout = ranges;
+    for (const auto& r : ranges) {
+        if (r.downloaded > m_recorded.value(r.id, 0)) m_recorded[r.id] = r.downloaded;
+    }
+    return true;
+}
+
+bool ProgressJournal::append(const std::vector<Record>& records) {
+    std::vector<Record> out = records;
+    for (auto& r : out) r.check = fnv1a(&r, offsetof(Record, check));
+    const char* data = reinterpret_cast<const char*>(out.data());
+    size_t length = out.size() * sizeof(Record);
+    // O_APPEND: every write lands at the current end.
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = ::write(m_fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            qWarning() << "Cannot append to progress journal:" << strerror(errno);
+            return false;
+        }
+        done += n;
+    }
+    if (fdatasync(m_fd) != 0) return false;
+    m_records += (int)out.size();
+    return true;
+}
+
+bool ProgressJournal::compact(const std::vector<ChunkRange>& ranges) {
+    // The current layout and one progress record per range, written to a
+    // new file that replaces the old one in a single rename.
+    std::vector<Record> records;
+    records.push_back({Record::Header, kVersion, 0, 0, 0, 0});
+    records.push_back({Record::Layout, (qint32)ranges.size(), 0, 0, 0, 0});
+    for (const auto& r : ranges) records.push_back({Record::Range, r.id, r.start, r.end, 0, 0});
+    QMap<int, curl_off_t> recorded;
+    for (const auto& r : ranges) {
+        curl_off_t done = std::max(r.downloaded, m_recorded.value(r.id, 0));
+        if (done > 0) records.push_back({Record::Progress, r.id, done, 0, 0, 0});
+        recorded[r.id] = done;
+    }
+
+    QByteArray target = path(m_id).toLocal8Bit();
+    QByteArray temp = (path(m_id) + ".tmp").toLocal8Bit();
+    int fd = ::open(temp.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    int old = m_fd;
+    m_fd = fd;
+    m_records = 0;
+    bool ok = append(records) && ::rename(temp.constData(), target.constData()) == 0;
+    if (!ok) {
+        ::close(fd);
+        ::unlink(temp.constData());
+        m_fd = old;
+        return false;
+    }
+    ::close(old);
+    // The rename itself must survive a crash too.
+    int dir = ::open(QFileInfo(path(m_id)).absolutePath().toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        ::close(dir);
+    }
+    m_layout = ranges;
+    m_recorded = recorded;
+    return true;
+}
+
+bool ProgressJournal::replay(int fd, std::vector<ChunkRange>& ranges, QMap<int, curl_off_t>& recorded,
+                             int& records, qint64& validLength) {
+    ranges.clear();
+    recorded.clear();
+    records = 0;
+    validLength = 0;
+
+    std::vector<ChunkRange> pending;
+    int expected = -1;
+    Record r;
+    for (off_t pos = 0; ; pos += sizeof(Record)) {
+        ssize_t n = pread(fd, &r, sizeof(r), pos);
+        if (n != (ssize_t)sizeof(r) || r.check != fnv1a(&r, offsetof(Record, check))) break;
+        if (pos == 0 && (r.type != Record::Header || r.id != kVersion)) break;
+
+        switch (r.type) {
+        case Record::Layout:
+            pending.clear();
+            expected = r.id;
+            break;
+        case Record::Range:
+            if (expected < 0) break;
+            pending.push_back({r.id, r.a, r.b, 0});
+            if ((int)pending.size() == expected) {
+                ranges = pending;
+                expected = -1;
+            }
+            break;
+        case Record::Progress:
+            if (r.a > recorded.value(r.id, 0)) recorded[r.id] = r.a;
+            break;
+        default:
+            break;
+        }
+        ++records;
+        validLength = pos + sizeof(Record);
+    }
+    for (auto& c : ranges)
+        c.downloaded = std::min<curl_off_t>(recorded.value(c.id, 0), c.end - c.start + 1);
+    return !ranges.empty();
+}
+
+bool ProgressJournal::read(const QString& id, std::vector<ChunkRange>& ranges) {
+    int fd = ::open(path(id).toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    QMap<int, curl_off_t> recorded;
+    int records;
+    qint64 valid;
+    bool ok = replay(fd, ranges, recorded, records, valid);
+    ::close(fd);
+    return ok;
+}
@@ -0,0 +1,68 @@
+#ifndef PROGRESSJOURNAL_H
+#define PROGRESSJOURNAL_H
+
+#include <QString>
+#include <QMap>
+#include <curl/curl.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "downloadmanager.h"
+#include "outputfile.h"
+
+// Durable record of a download's progress. The state file is rewritten
+// every second and vouches for bytes that may still sit in the page cache;
+// the journal only records bytes after the files holding them were
+// fdatasync'd, so after a power loss a resume starts from data that is
+// really on disk.
+//
+// It is append-only: a layout record lists the ranges whenever they were
+// split, and progress records extend one range's written prefix. Every
+// record carries a checksum, so a torn tail is recognised and cut off.
+// Once it holds too many records it is compacted into a fresh file.
+class ProgressJournal {
+public:
+    explicit ProgressJournal(const QString& downloadId);
+    ~ProgressJournal(); // waits for a running checkpoint
+
+    // Syncs the files, then records the ranges and their `downloaded`
+    // prefixes. Runs on a thread of its own; false (and nothing done) if
+    // the previous checkpoint is still running.
+    bool checkpoint(std::vector<std::shared_ptr<OutputFile>> files, std::vector<ChunkRange> ranges);
+    // The same, on the calling thread. For pausing.
+    bool checkpointNow(const std::vector<std::shared_ptr<OutputFile>>& files, const std::vector<ChunkRange>& ranges);
+    // Blocks until a running checkpoint is done. Files it syncs must not be
+    // closed before.
+    void wait();
+
+    static QString path(const QString& downloadId);
+    // Replays the journal into the last recorded layout, each range's
+    // `downloaded` set to its durable prefix. False if there is no usable
+    // journal.
+    static bool read(const QString& downloadId, std::vector<ChunkRange>& ranges);
+
+    // Records beyond this trigger a compaction.
+    static constexpr int kCompactRecords = 4096;
+
+private:
+    struct Record;
+
+    bool run(const std::vector<std::shared_ptr<OutputFile>>& files, const std::vector<ChunkRange>& ranges);
+    bool append(const std::vector<Record>& records);
+    bool compact(const std::vector<ChunkRange>& ranges);
+    static bool replay(int fd, std::vector<ChunkRange>& ranges, QMap<int, curl_off_t>& recorded, int& records,
+                       qint64& validLength);
+
+    QString m_id;
+    int m_fd;
+    int m_records;
+    std::vector<ChunkRange> m_layout;    // last layout recorded
+    QMap<int, curl_off_t> m_recorded;    // durable prefix per range id
+    std::mutex m_mutex;                  // one checkpoint at a time
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+};
+
+#endif
@@ -0,0 +1,37 @@
+#include "rangeset.h"
+#include <algorithm>
+
+void RangeSet::add(curl_off_t start, curl_off_t end) {
+    if (start >= end) return;
+    // First interval that ends at or after start: everything from there up
+    // to the first one beginning after end is absorbed.
+    auto first = std::lower_bound(m_intervals.begin(), m_intervals.end(), start,
+                                  [](const Interval& i, curl_off_t pos) { return i.second < pos; });
+    auto last = first;
+    while (last != m_intervals.end() && last->first <= end) {
+        start = std::min(start, last->first);
+        end = std::max(end, last->second);
+        ++last;
+    }
+    first = m_intervals.erase(first, last);
+    m_intervals.insert(first, {start, end});
+}
+
+bool RangeSet::contains(curl_off_t start, curl_off_t end) const {
+    if (start >= end) return true;
+    return coveredFrom(start) >= end - start;
+}
+
+curl_off_t RangeSet::coveredFrom(curl_off_t pos) const {
+    auto it = std::upper_bound(m_intervals.begin(), m_intervals.end(), pos,
+                               [](curl_off_t p, const Interval& i) { return p < i.first; });
+    if (it == m_intervals.begin()) return 0;
+    --it;
+    return pos < it->second ? it->second - pos : 0;
+}
+
+curl_off_t RangeSet::total() const {
+    curl_off_t sum = 0;
+    for (const auto& i : m_intervals) sum += i.second - i.first;
+    return sum;
+}
@@ -0,0 +1,29 @@
+#ifndef RANGESET_H
+#define RANGESET_H
+
+#include <curl/curl.h>
+#include <vector>
+#include <utility>
+
+// Byte ranges of a file known to be on disk, kept as sorted, disjoint,
+// half-open intervals [start, end). Adjacent and overlapping additions
+// merge, so a finished download collapses to a single interval.
+class RangeSet {
+public:
+    using Interval = std::pair<curl_off_t, curl_off_t>;
+
+    void add(curl_off_t start, curl_off_t end);
+    void clear() { m_intervals.clear(); }
+    bool isEmpty() const { return m_intervals.empty(); }
+
+    bool contains(curl_off_t start, curl_off_t end) const;
+    // Length of the covered run beginning at pos, 0 if pos is not covered.
+    curl_off_t coveredFrom(curl_off_t pos) const;
+    curl_off_t total() const;
+    const std::vector<Interval>& intervals() const { return m_intervals; }
+
+private:
+    std::vector<Interval> m_intervals;
+};
+
+#endif
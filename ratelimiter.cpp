@@ -0,0 +1,151 @@
+#include "ratelimiter.h"
+#include <algorithm>
+#include <cmath>
+
+RateLimiter& RateLimiter::instance() {
+    static RateLimiter limiter;
+    return limiter;
+}
+
+RateLimiter::RateLimiter()
+    : m_rate(0), m_tokens(0), m_lastRefill(std::chrono::steady_clock::now())
+{
+}
+
+void RateLimiter::setRate(double bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    refill();
+    m_rate = std::max(0.0, bytesPerSecond);
+    // A new limit starts from a full bucket, not from the old one's debt.
+    m_tokens = m_rate * kBurstSeconds;
+}
+
+double RateLimiter::rate() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rate;
+}
+
+void RateLimiter::refill() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+    m_lastRefill = now;
+    if (m_rate > 0) m_tokens = std::min(m_rate * kBurstSeconds, m_tokens + m_rate * elapsed);
+}
+
+bool RateLimiter::active(const Clock& c, TimePoint now) {
+    return now - c.lastSeen < std::chrono::milliseconds(kIdleMs);
+}
+
+bool RateLimiter::hasFlows(const QString& group) const {
+    for (const auto& f : m_flows) {
+        if (f.group == group) return true;
+    }
+    return false;
+}
+
+bool RateLimiter::contending(const Flow& f, TimePoint now) const {
+    return f.waiting && active(f, now);
+}
+
+bool RateLimiter::groupContending(const QString& group, TimePoint now) const {
+    for (const auto& f : m_flows) {
+        if (f.group == group && contending(f, now)) return true;
+    }
+    return false;
+}
+
+void RateLimiter::wakeFlow(const QString& flow, TimePoint now) {
+    Flow& f = m_flows[flow];
+    bool any = false;
+    double floor = 0;
+    for (auto it = m_flows.cbegin(); it != m_flows.cend(); ++it) {
+        if (it.key() == flow || it->group != f.group || !active(*it, now)) continue;
+        floor = any ? std::min(floor, it->tag) : it->tag;
+        any = true;
+    }
+    if (any) f.tag = std::max(f.tag, floor);
+    f.waiting = false;
+}
+
+void RateLimiter::wakeGroup(const QString& group, TimePoint now) {
+    Clock& g = m_groups[group];
+    bool any = false;
+    double floor = 0;
+    for (auto it = m_groups.cbegin(); it != m_groups.cend(); ++it) {
+        if (it.key() == group || !active(*it, now)) continue;
+        floor = any ? std::min(floor, it->tag) : it->tag;
+        any = true;
+    }
+    if (any) g.tag = std::max(g.tag, floor);
+}
+
+bool RateLimiter::due(const QString& flow, TimePoint now) const {
+    const Flow& f = *m_flows.constFind(flow);
+    const double groupTag = m_groups.constFind(f.group)->tag;
+    for (auto it = m_groups.cbegin(); it != m_groups.cend(); ++it) {
+        if (it.key() != f.group && it->tag < groupTag && groupContending(it.key(), now)) return false;
+    }
+    for (auto it = m_flows.cbegin(); it != m_flows.cend(); ++it) {
+        if (it.key() != flow && it->group == f.group && it->tag < f.tag && contending(*it, now)) return false;
+    }
+    return true;
+}
+
+void RateLimiter::setFlow(const QString& flow, const QString& group, double groupWeight, double weight) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Flow& f = m_flows[flow];
+    f.group = group;
+    f.weight = std::max(0.01, weight);
+    m_groups[group].weight = std::max(0.01, groupWeight);
+    // Drop a group the flow has left.
+    for (auto it = m_groups.begin(); it != m_groups.end();) {
+        if (hasFlows(it.key())) ++it;
+        else it = m_groups.erase(it);
+    }
+}
+
+void RateLimiter::removeFlow(const QString& flow) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_flows.find(flow);
+    if (it == m_flows.end()) return;
+    QString group = it->group;
+    m_flows.erase(it);
+    if (!hasFlows(group)) m_groups.remove(group);
+}
+
+bool RateLimiter::acquire(const QString& flow, size_t bytes, int& retryMs) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    retryMs = 0;
+    if (m_rate <= 0) return true;
+    refill();
+
+    auto now = std::chrono::steady_clock::now();
+    auto it = m_flows.find(flow);
+    Flow* f = it != m_flows.end() ? &it.value() : nullptr;
+    Clock* g = nullptr;
+    if (f) {
+        g = &m_groups[f->group];
+        if (!active(*g, now)) wakeGroup(f->group, now);
+        if (!active(*f, now)) wakeFlow(flow, now);
+        f->lastSeen = g->lastSeen = now;
+    }
+
+    if (m_tokens <= 0) {
+        if (f) f->waiting = true;
+        retryMs = std::max(1, (int)std::ceil(-m_tokens * 1000.0 / m_rate));
+        return false;
+    }
+    if (f && !due(flow, now)) {
+        f->waiting = true;
+        retryMs = kTurnMs;
+        return false;
+    }
+
+    m_tokens -= (double)bytes;
+    if (f) {
+        g->tag += (double)bytes / g->weight;
+        f->tag += (double)bytes / f->weight;
+        f->waiting = false;
+    }
+    return true;
+}
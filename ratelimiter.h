@@ -0,0 +1,86 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QMap>
+#include <mutex>
+#include <chrono>
+#include <cstddef>
+
+// Process-wide token bucket behind the speed limit. Every connection of
+// every download takes tokens for the bytes it accepts from curl, so the
+// limit holds for the sum of them however many are running; a connection
+// that finishes or pauses simply stops drawing.
+//
+// The bucket holds at most kBurstSeconds of tokens, which bounds how far
+// the rate can overshoot after an idle moment. A connection may draw it
+// below zero with one delivery; the others then wait until the debt is
+// paid back, so the long-run rate stays exact.
+//
+// Who gets the tokens while downloads compete for them is decided by
+// two-level start-time fair queueing: groups share the limit by their
+// weights, and the downloads (flows) of a group share the group's part by
+// theirs. Each group and flow carries a virtual clock advanced by
+// bytes / weight as it is served; of those waiting, the one furthest
+// behind goes next. A flow that falls idle gives up its share to the
+// others and comes back without credit for the idle time.
+class RateLimiter {
+public:
+    static RateLimiter& instance();
+
+    // Bytes per second; 0 = unlimited.
+    void setRate(double bytesPerSecond);
+    double rate() const;
+
+    // Registers or updates a flow. Weights are relative, within the level.
+    void setFlow(const QString& flow, const QString& group, double groupWeight, double weight);
+    void removeFlow(const QString& flow);
+
+    // Takes tokens for `bytes` on behalf of the flow, unless the bucket is
+    // empty or another waiting flow is due first. False: the caller pauses
+    // and tries again in `retryMs`.
+    bool acquire(const QString& flow, size_t bytes, int& retryMs);
+
+    static constexpr double kBurstSeconds = 0.1;
+    // A flow that has not asked for tokens for this long is idle.
+    static constexpr int kIdleMs = 250;
+    // Retry delay for a flow passed over in favour of one that is due.
+    static constexpr int kTurnMs = 5;
+
+private:
+    struct Clock {
+        double weight = 1;
+        double tag = 0;          // virtual time: bytes served / weight
+        std::chrono::steady_clock::time_point lastSeen; // last asked for tokens
+        bool waiting = false;    // refused and not served since
+    };
+    struct Flow : Clock {
+        QString group;
+    };
+
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    RateLimiter();
+    // The rest with m_mutex held.
+    void refill();
+    static bool active(const Clock& c, TimePoint now);
+    bool hasFlows(const QString& group) const;
+    // Refused recently and not served since: competing for tokens.
+    bool contending(const Flow& f, TimePoint now) const;
+    bool groupContending(const QString& group, TimePoint now) const;
+    // Brings a flow or group back from idle level with the active ones.
+    void wakeFlow(const QString& flow, TimePoint now);
+    void wakeGroup(const QString& group, TimePoint now);
+    // No contending group or flow is further behind.
+    bool due(const QString& flow, TimePoint now) const;
+
+    mutable std::mutex m_mutex;
+    double m_rate;
+    double m_tokens;
+    TimePoint m_lastRefill;
+    QMap<QString, Flow> m_flows;
+    QMap<QString, Clock> m_groups;
+};
+
+#endif
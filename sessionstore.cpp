@@ -0,0 +1,68 @@
+#include "sessionstore.h"
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+namespace {
+const quint32 kMagic = 0x50465353; // "PFSS"
+const qint32 kVersion = 4; // 2: checksum, 3: piece manifest, 4: weights and group
+// Smallest entry on disk: four empty strings, the status and two sizes.
+const qint64 kMinEntrySize = 4 * 4 + 4 + 2 * 8;
+}
+
+QString SessionStore::path()
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    QDir().mkpath(dir);
+    return dir + "/session.dat";
+}
+
+bool SessionStore::save(const QList<SessionEntry>& entries)
+{
+    QSaveFile f(path());
+    if (!f.open(QIODevice::WriteOnly)) return false;
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_6_0);
+    out << kMagic << kVersion << (qint32)entries.size();
+    for (const auto& e : entries) {
+        out << e.url << e.outputPath << e.downloadId << e.name << (qint32)e.status
+            << e.downloaded << e.size << e.checksum << e.pieces
+            << e.weight << e.group << e.groupWeight;
+    }
+    if (out.status() != QDataStream::Ok) {
+        f.cancelWriting();
+        return false;
+    }
+    return f.commit();
+}
+
+QList<SessionEntry> SessionStore::load()
+{
+    QList<SessionEntry> entries;
+    QFile f(path());
+    if (!f.open(QIODevice::ReadOnly)) return entries;
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_6_0);
+    quint32 magic;
+    qint32 version, count;
+    in >> magic >> version >> count;
+    if (in.status() != QDataStream::Ok || magic != kMagic || version < 1 || version > kVersion || count < 0) return entries;
+
+    // The count comes from the file; a damaged one may claim more entries
+    // than the file could hold.
+    entries.reserve((qsizetype)qMin<qint64>(count, f.size() / kMinEntrySize));
+    for (qint32 i = 0; i < count; ++i) {
+        SessionEntry e;
+        qint32 status;
+        in >> e.url >> e.outputPath >> e.downloadId >> e.name >> status >> e.downloaded >> e.size;
+        if (version >= 2) in >> e.checksum;
+        if (version >= 3) in >> e.pieces;
+        if (version >= 4) in >> e.weight >> e.group >> e.groupWeight;
+        if (in.status() != QDataStream::Ok) break;
+        e.status = (SessionEntry::Status)qBound<qint32>(SessionEntry::Queued, status, SessionEntry::Failed);
+        entries.append(e);
+    }
+    return entries;
+}
@@ -0,0 +1,36 @@
+#ifndef SESSIONSTORE_H
+#define SESSIONSTORE_H
+
+#include <QString>
+#include <QList>
+
+// One row of the download list as it is kept between runs. Only what the
+// table shows and what is needed to schedule the task again; the resume
+// data stays in the task's own state file, which is not opened until the
+// task actually runs.
+struct SessionEntry {
+    enum Status { Queued, Paused, Completed, Failed };
+    QString url;
+    QString outputPath;
+    QString downloadId; // empty if the task never got past its probe
+    QString name;
+    Status status = Queued;
+    qint64 downloaded = 0;
+    qint64 size = 0;
+    QString checksum;   // expected digest, empty if none
+    QString pieces;     // piece hash manifest (path or URL), empty if none
+    double weight = 4;  // share of the speed limit, DownloadScheduler::kNormalWeight
+    QString group;      // empty if in none
+    double groupWeight = 4;
+};
+
+// The whole download list in one small binary file, so restoring
+// thousands of tasks is a single sequential read.
+class SessionStore {
+public:
+    static QString path();
+    static bool save(const QList<SessionEntry>& entries);
+    static QList<SessionEntry> load();
+};
+
+#endif
@@ -8,6 +8,8 @@
 #include <QDialogButtonBox>
 #include <QLabel>
 #include <QDir>
+#include <QMessageBox>
+#include "bandwidthschedule.h"
 
 SettingsDialog::SettingsDialog(QWidget *parent) : QDialog(parent) {
     m_settings = new QSettings("ParaFetch", "ParaFetch", this);
@@ -91,6 +93,28 @@ void SettingsDialog::setupDownloadTab(QWidget* tab) {
     m_defaultConnections->setSuffix(" connections");
     connLayout->addRow("Default connections per download:", m_defaultConnections);
     
+    m_maxActiveDownloads = new QSpinBox();
+    m_maxActiveDownloads->setRange(1, 100);
+    m_maxActiveDownloads->setValue(5);
+    m_maxActiveDownloads->setSuffix(" downloads");
+    connLayout->addRow("Maximum active downloads:", m_maxActiveDownloads);
+    
+    m_maxTotalConnections = new QSpinBox();
+    m_maxTotalConnections->setRange(1, 512);
+    m_maxTotalConnections->setValue(64);
+    m_maxTotalConnections->setSuffix(" connections");
+    connLayout->addRow("Maximum total connections:", m_maxTotalConnections);
+    
+    m_maxConnectionsPerHost = new QSpinBox();
+    m_maxConnectionsPerHost->setRange(1, 256);
+    m_maxConnectionsPerHost->setValue(16);
+    m_maxConnectionsPerHost->setSuffix(" connections");
+    connLayout->addRow("Maximum connections per host:", m_maxConnectionsPerHost);
+    
+    m_hostLimitsEdit = new QLineEdit();
+    m_hostLimitsEdit->setPlaceholderText("example.com=4, 203.0.113.7=2");
+    connLayout->addRow("Per-host overrides:", m_hostLimitsEdit);
+    
     layout->addWidget(connGroup);
     
     QGroupBox* speedGroup = new QGroupBox("Speed Limit");
@@ -110,9 +134,17 @@ void SettingsDialog::setupDownloadTab(QWidget* tab) {
         m_customSpeedLimit->setEnabled(index == 5); // Enable for "Custom"
     });
     
-    speedLayout->addRow("Default speed limit:", m_speedLimitCombo);
+    speedLayout->addRow("Speed limit (all downloads):", m_speedLimitCombo);
     speedLayout->addRow("Custom limit:", m_customSpeedLimit);
     
+    m_scheduleEdit = new QPlainTextEdit();
+    m_scheduleEdit->setPlaceholderText("Mon-Fri 08:00-18:00 speed=2MB/s\nDaily 22:00-07:00 active=20");
+    m_scheduleEdit->setToolTip("One rule per line: days, optional time range, speed=<KB/s, MB/s or unlimited>\n"
+                               "and/or active=<downloads>. The first matching rule wins; outside all\n"
+                               "rules the limits above apply.");
+    m_scheduleEdit->setFixedHeight(70);
+    speedLayout->addRow("Weekly schedule:", m_scheduleEdit);
+    
     layout->addWidget(speedGroup);
     
     QGroupBox* behaviorGroup = new QGroupBox("Behavior");
@@ -125,7 +157,72 @@ void SettingsDialog::setupDownloadTab(QWidget* tab) {
     m_clipboardMonitoring = new QCheckBox("Monitor clipboard for download URLs");
     behaviorLayout->addWidget(m_clipboardMonitoring);
     
+    m_directWrite = new QCheckBox("Write directly into the target file (no merge step)");
+    m_directWrite->setChecked(true);
+    behaviorLayout->addWidget(m_directWrite);
+    
     layout->addWidget(behaviorGroup);
+    
+    QGroupBox* diskGroup = new QGroupBox("Disk Writes");
+    QFormLayout* diskLayout = new QFormLayout(diskGroup);
+    
+    m_writeBlockSize = new QSpinBox();
+    m_writeBlockSize->setRange(1, 8);
+    m_writeBlockSize->setValue(4);
+    m_writeBlockSize->setSuffix(" MB");
+    diskLayout->addRow("Write block size:", m_writeBlockSize);
+    
+    m_writeBufferMemory = new QSpinBox();
+    m_writeBufferMemory->setRange(16, 4096);
+    m_writeBufferMemory->setValue(256);
+    m_writeBufferMemory->setSuffix(" MB");
+    diskLayout->addRow("Write buffer memory limit:", m_writeBufferMemory);
+    
+    m_writebackBudget = new QSpinBox();
+    m_writebackBudget->setRange(0, 4096);
+    m_writebackBudget->setValue(64);
+    m_writebackBudget->setSuffix(" MB");
+    m_writebackBudget->setSpecialValueText("Kernel default");
+    diskLayout->addRow("Unflushed data limit:", m_writebackBudget);
+    
+    m_unbufferedIO = new QCheckBox("Bypass the page cache for files over 1 GB");
+    diskLayout->addRow(m_unbufferedIO);
+    
+    m_mappedOutput = new QCheckBox("Write through a memory mapping of the target file");
+    diskLayout->addRow(m_mappedOutput);
+    
+    m_mappedWindow = new QSpinBox();
+    m_mappedWindow->setRange(1, 1024);
+    m_mappedWindow->setValue(64);
+    m_mappedWindow->setSuffix(" MB");
+    diskLayout->addRow("Mapping window per connection:", m_mappedWindow);
+    
+    m_mappedSync = new QSpinBox();
+    m_mappedSync->setRange(1, 1024);
+    m_mappedSync->setValue(16);
+    m_mappedSync->setSuffix(" MB");
+    diskLayout->addRow("Flush mapped data every:", m_mappedSync);
+    
+    connect(m_mappedOutput, &QCheckBox::toggled, m_mappedWindow, &QWidget::setEnabled);
+    connect(m_mappedOutput, &QCheckBox::toggled, m_mappedSync, &QWidget::setEnabled);
+    
+    m_checkpointSize = new QSpinBox();
+    m_checkpointSize->setRange(1, 4096);
+    m_checkpointSize->setValue(64);
+    m_checkpointSize->setSuffix(" MB");
+    diskLayout->addRow("Save progress durably every:", m_checkpointSize);
+    
+    m_checkpointSeconds = new QSpinBox();
+    m_checkpointSeconds->setRange(1, 600);
+    m_checkpointSeconds->setValue(10);
+    m_checkpointSeconds->setSuffix(" s");
+    diskLayout->addRow("Or at least every:", m_checkpointSeconds);
+    
+    m_hashPieces = new QCheckBox("Hash pieces as they land, so damage costs one piece, not the file");
+    m_hashPieces->setToolTip("Used when a download comes without piece hashes; they are saved next to the file");
+    diskLayout->addRow(m_hashPieces);
+    
+    layout->addWidget(diskGroup);
     layout->addStretch();
 }
 
@@ -163,6 +260,12 @@ void SettingsDialog::onBrowseClicked() {
 }
 
 void SettingsDialog::onAccepted() {
+    QStringList errors;
+    BandwidthSchedule::parse(m_scheduleEdit->toPlainText(), &errors);
+    if (!errors.isEmpty()) {
+        QMessageBox::warning(this, "Weekly schedule", "These rules cannot be used:\n\n" + errors.join("\n"));
+        return;
+    }
     saveSettings();
     accept();
 }
@@ -178,6 +281,21 @@ void SettingsDialog::loadSettings() {
     m_defaultConnections->setValue(
         m_settings->value("DefaultConnections", 8).toInt()
     );
+    m_maxActiveDownloads->setValue(
+        m_settings->value("MaxActiveDownloads", 5).toInt()
+    );
+    m_maxTotalConnections->setValue(
+        m_settings->value("MaxTotalConnections", 64).toInt()
+    );
+    m_maxConnectionsPerHost->setValue(
+        m_settings->value("MaxConnectionsPerHost", 16).toInt()
+    );
+    m_hostLimitsEdit->setText(
+        m_settings->value("HostConnectionLimits", "").toString()
+    );
+    m_scheduleEdit->setPlainText(
+        m_settings->value("BandwidthSchedule", "").toString()
+    );
     m_autoStartDownloads->setChecked(
         m_settings->value("AutoStartDownloads", true).toBool()
     );
@@ -187,6 +305,41 @@ void SettingsDialog::loadSettings() {
     m_showTrayIcon->setChecked(
         m_settings->value("ShowTrayIcon", false).toBool()
     );
+    m_directWrite->setChecked(
+        m_settings->value("DirectWrite", true).toBool()
+    );
+    m_writeBlockSize->setValue(
+        m_settings->value("WriteBlockSizeMB", 4).toInt()
+    );
+    m_writeBufferMemory->setValue(
+        m_settings->value("WriteBufferMemoryMB", 256).toInt()
+    );
+    m_unbufferedIO->setChecked(
+        m_settings->value("UnbufferedIO", false).toBool()
+    );
+    m_writebackBudget->setValue(
+        m_settings->value("WritebackBudgetMB", 64).toInt()
+    );
+    m_mappedOutput->setChecked(
+        m_settings->value("MappedOutput", false).toBool()
+    );
+    m_mappedWindow->setValue(
+        m_settings->value("MappedWindowMB", 64).toInt()
+    );
+    m_mappedSync->setValue(
+        m_settings->value("MappedSyncMB", 16).toInt()
+    );
+    m_checkpointSize->setValue(
+        m_settings->value("CheckpointMB", 64).toInt()
+    );
+    m_checkpointSeconds->setValue(
+        m_settings->value("CheckpointSeconds", 10).toInt()
+    );
+    m_hashPieces->setChecked(
+        m_settings->value("HashPieces", false).toBool()
+    );
+    m_mappedWindow->setEnabled(m_mappedOutput->isChecked());
+    m_mappedSync->setEnabled(m_mappedOutput->isChecked());
     
     // Speed limit
     double speedLimit = m_settings->value("DefaultSpeedLimit", 0.0).toDouble();
@@ -220,9 +373,25 @@ void SettingsDialog::loadSettings() {
 void SettingsDialog::saveSettings() {
     m_settings->setValue("DefaultDownloadPath", m_defaultPathEdit->text());
     m_settings->setValue("DefaultConnections", m_defaultConnections->value());
+    m_settings->setValue("MaxActiveDownloads", m_maxActiveDownloads->value());
+    m_settings->setValue("MaxTotalConnections", m_maxTotalConnections->value());
+    m_settings->setValue("MaxConnectionsPerHost", m_maxConnectionsPerHost->value());
+    m_settings->setValue("HostConnectionLimits", m_hostLimitsEdit->text().trimmed());
+    m_settings->setValue("BandwidthSchedule", m_scheduleEdit->toPlainText().trimmed());
     m_settings->setValue("AutoStartDownloads", m_autoStartDownloads->isChecked());
     m_settings->setValue("ClipboardMonitoring", m_clipboardMonitoring->isChecked());
     m_settings->setValue("ShowTrayIcon", m_showTrayIcon->isChecked());
+    m_settings->setValue("DirectWrite", m_directWrite->isChecked());
+    m_settings->setValue("WriteBlockSizeMB", m_writeBlockSize->value());
+    m_settings->setValue("WriteBufferMemoryMB", m_writeBufferMemory->value());
+    m_settings->setValue("UnbufferedIO", m_unbufferedIO->isChecked());
+    m_settings->setValue("WritebackBudgetMB", m_writebackBudget->value());
+    m_settings->setValue("MappedOutput", m_mappedOutput->isChecked());
+    m_settings->setValue("MappedWindowMB", m_mappedWindow->value());
+    m_settings->setValue("MappedSyncMB", m_mappedSync->value());
+    m_settings->setValue("CheckpointMB", m_checkpointSize->value());
+    m_settings->setValue("CheckpointSeconds", m_checkpointSeconds->value());
+    m_settings->setValue("HashPieces", m_hashPieces->isChecked());
     m_settings->setValue("NotificationsEnabled", m_enableNotifications->isChecked());
     m_settings->setValue("NotifyOnComplete", m_notifyOnComplete->isChecked());
     m_settings->setValue("NotifyOnError", m_notifyOnError->isChecked());
@@ -249,10 +418,43 @@ int SettingsDialog::getDefaultConnections() const {
     return m_settings->value("DefaultConnections", 8).toInt();
 }
 
+int SettingsDialog::getMaxActiveDownloads() const {
+    return m_settings->value("MaxActiveDownloads", 5).toInt();
+}
+
+int SettingsDialog::getMaxTotalConnections() const {
+    return m_settings->value("MaxTotalConnections", 64).toInt();
+}
+
+int SettingsDialog::getMaxConnectionsPerHost() const {
+    return m_settings->value("MaxConnectionsPerHost", 16).toInt();
+}
+
+QMap<QString, int> SettingsDialog::getHostConnectionLimits() const {
+    return parseHostLimits(m_settings->value("HostConnectionLimits", "").toString());
+}
+
+QMap<QString, int> SettingsDialog::parseHostLimits(const QString& text) {
+    // Stored as "host=limit, host=limit"; malformed entries are ignored.
+    QMap<QString, int> limits;
+    for (const QString& entry : text.split(',', Qt::SkipEmptyParts)) {
+        QStringList kv = entry.split('=');
+        if (kv.size() != 2) continue;
+        bool ok = false;
+        int limit = kv[1].trimmed().toInt(&ok);
+        if (ok && limit > 0 && !kv[0].trimmed().isEmpty()) limits.insert(kv[0].trimmed().toLower(), limit);
+    }
+    return limits;
+}
+
 bool SettingsDialog::getAutoStartDownloads() const {
     return m_settings->value("AutoStartDownloads", true).toBool();
 }
 
+bool SettingsDialog::getDirectWrite() const {
+    return m_settings->value("DirectWrite", true).toBool();
+}
+
 bool SettingsDialog::getNotificationsEnabled() const {
     return m_settings->value("NotificationsEnabled", true).toBool();
 }
@@ -7,7 +7,9 @@
 #include <QSpinBox>
 #include <QCheckBox>
 #include <QComboBox>
+#include <QPlainTextEdit>
 #include <QSettings>
+#include <QMap>
 
 class SettingsDialog : public QDialog {
     Q_OBJECT
@@ -17,7 +19,13 @@ public:
     // Getters for settings
     QString getDefaultDownloadPath() const;
     int getDefaultConnections() const;
+    int getMaxActiveDownloads() const;
+    int getMaxTotalConnections() const;
+    int getMaxConnectionsPerHost() const;
+    QMap<QString, int> getHostConnectionLimits() const; // host or IP -> limit
+    static QMap<QString, int> parseHostLimits(const QString& text);
     bool getAutoStartDownloads() const;
+    bool getDirectWrite() const;
     bool getNotificationsEnabled() const;
     bool getClipboardMonitoring() const;
     bool getShowSystemTrayIcon() const;
@@ -45,10 +53,26 @@ private:
     
     // Download settings
     QSpinBox* m_defaultConnections;
+    QSpinBox* m_maxActiveDownloads;
+    QSpinBox* m_maxTotalConnections;
+    QSpinBox* m_maxConnectionsPerHost;
+    QLineEdit* m_hostLimitsEdit;
     QCheckBox* m_autoStartDownloads;
+    QCheckBox* m_directWrite;
+    QSpinBox* m_writeBlockSize;
+    QSpinBox* m_writeBufferMemory;
+    QCheckBox* m_unbufferedIO;
+    QSpinBox* m_writebackBudget;
+    QCheckBox* m_mappedOutput;
+    QSpinBox* m_mappedWindow;
+    QSpinBox* m_mappedSync;
+    QSpinBox* m_checkpointSize;
+    QSpinBox* m_checkpointSeconds;
+    QCheckBox* m_hashPieces;
     QCheckBox* m_clipboardMonitoring;
     QComboBox* m_speedLimitCombo;
     QSpinBox* m_customSpeedLimit;
+    QPlainTextEdit* m_scheduleEdit;
     
     // Notification settings
     QCheckBox* m_enableNotifications;
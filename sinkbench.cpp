@@ -0,0 +1,145 @@
+// Compares the ways a download can land on disk on a local, synthetic
+// workload: N connections each delivering its range in 16 KB pieces,
+// interleaved the way curl's write callbacks interleave. Network and merge
+// are left out; every mode ends with an fsync so the page cache does not
+// flatter anyone.
+//
+//   sinkbench [directory] [size in MB] [connections]
+
+#include "outputfile.h"
+#include "mappedwriter.h"
+#include <QDir>
+#include <QFile>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+const size_t kPieceSize = 16 * 1024;
+const size_t kBlockSize = 4 * 1024 * 1024;
+
+struct Range {
+    curl_off_t start;
+    curl_off_t size;
+    curl_off_t done = 0;
+};
+
+std::vector<Range> splitRanges(curl_off_t size, int connections) {
+    std::vector<Range> ranges;
+    curl_off_t each = size / connections;
+    for (int i = 0; i < connections; ++i) {
+        Range r;
+        r.start = i * each;
+        r.size = (i == connections - 1) ? size - r.start : each;
+        ranges.push_back(r);
+    }
+    return ranges;
+}
+
+// Feeds every range piece by piece, round robin, to sink(range index, data,
+// length, offset within the file).
+void deliver(std::vector<Range> ranges, const std::vector<char>& piece,
+             const std::function<void(size_t, const char*, size_t, curl_off_t)>& sink) {
+    bool more = true;
+    while (more) {
+        more = false;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            Range& r = ranges[i];
+            if (r.done >= r.size) continue;
+            size_t n = (size_t)std::min<curl_off_t>(kPieceSize, r.size - r.done);
+            sink(i, piece.data(), n, r.start + r.done);
+            r.done += n;
+            more = more || r.done < r.size;
+        }
+    }
+}
+
+void report(const char* mode, curl_off_t size, std::chrono::steady_clock::time_point begin) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("%-16s %8.1f MB/s  (%.2f s)\n", mode, size / seconds / (1024 * 1024), seconds);
+}
+}
+
+int main(int argc, char* argv[]) {
+    QString dir = argc > 1 ? QString::fromLocal8Bit(argv[1]) : QDir::tempPath();
+    curl_off_t size = (argc > 2 ? atoll(argv[2]) : 1024) * 1024LL * 1024;
+    int connections = argc > 3 ? atoi(argv[3]) : 8;
+    if (size <= 0 || connections <= 0) {
+        fprintf(stderr, "usage: sinkbench [directory] [size in MB] [connections]\n");
+        return 1;
+    }
+    std::vector<Range> ranges = splitRanges(size, connections);
+    std::vector<char> piece(kPieceSize, 'x');
+    QString target = QDir(dir).filePath("sinkbench.out");
+
+    // fwrite: one stdio stream per range into its own part file, as
+    // ParaFetch originally wrote.
+    {
+        std::vector<FILE*> parts;
+        for (int i = 0; i < connections; ++i)
+            parts.push_back(fopen(QDir(dir).filePath(QString("sinkbench.part%1").arg(i)).toLocal8Bit().constData(), "wb"));
+        auto begin = std::chrono::steady_clock::now();
+        deliver(ranges, piece, [&](size_t i, const char* data, size_t n, curl_off_t) { fwrite(data, 1, n, parts[i]); });
+        for (FILE* f : parts) { fflush(f); fsync(fileno(f)); fclose(f); }
+        report("fwrite parts", size, begin);
+        for (int i = 0; i < connections; ++i) QFile::remove(QDir(dir).filePath(QString("sinkbench.part%1").arg(i)));
+    }
+
+    // pwrite: every piece written in place as it arrives.
+    {
+        OutputFile out;
+        out.open(target, size, true);
+        auto begin = std::chrono::steady_clock::now();
+        deliver(ranges, piece, [&](size_t, const char* data, size_t n, curl_off_t offset) { out.write(data, n, offset); });
+        fsync(out.fd());
+        report("pwrite", size, begin);
+        out.close();
+        QFile::remove(target);
+    }
+
+    // pwrite in blocks: pieces gathered per range into aligned blocks, the
+    // DiskWriter path minus its threads.
+    {
+        OutputFile out;
+        out.open(target, size, true);
+        std::vector<std::vector<char>> blocks(connections);
+        std::vector<curl_off_t> blockStart(connections, -1);
+        auto flush = [&](size_t i) {
+            if (blocks[i].empty()) return;
+            out.write(blocks[i].data(), blocks[i].size(), blockStart[i]);
+            blocks[i].clear();
+        };
+        auto begin = std::chrono::steady_clock::now();
+        deliver(ranges, piece, [&](size_t i, const char* data, size_t n, curl_off_t offset) {
+            if (blocks[i].empty()) blockStart[i] = offset;
+            blocks[i].insert(blocks[i].end(), data, data + n);
+            if ((offset + (curl_off_t)n) % kBlockSize == 0) flush(i);
+        });
+        for (int i = 0; i < connections; ++i) flush(i);
+        fsync(out.fd());
+        report("pwrite blocks", size, begin);
+        out.close();
+        QFile::remove(target);
+    }
+
+    // mmap: pieces copied into a mapped window per connection.
+    {
+        auto out = std::make_shared<OutputFile>();
+        out->open(target, size, true);
+        std::vector<std::unique_ptr<MappedWriter>> writers;
+        for (int i = 0; i < connections; ++i)
+            writers.emplace_back(new MappedWriter(out, MappedWriter::kDefaultWindowSize, MappedWriter::kDefaultSyncInterval));
+        auto begin = std::chrono::steady_clock::now();
+        deliver(ranges, piece, [&](size_t i, const char* data, size_t n, curl_off_t offset) { writers[i]->write(data, n, offset); });
+        writers.clear();
+        fsync(out->fd());
+        report("mmap", size, begin);
+        out->close();
+        QFile::remove(target);
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include "streamverifier.h"
+#include "hashkernels.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+StreamVerifier::StreamVerifier(const Checksum& expected, curl_off_t fileSize)
+    : m_expected(expected), m_fileSize(fileSize), m_perRange(expected.algorithm == Checksum::Crc32c),
+      m_position(0), m_generation(0), m_stop(false)
+{
+    if (!m_perRange) m_digest.reset(new Digest(expected.algorithm));
+    m_thread = std::thread([this]() { run(); });
+}
+
+StreamVerifier::~StreamVerifier() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    for (int fd : m_fds) ::close(fd);
+}
+
+void StreamVerifier::update(std::vector<Segment> segments) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_segments = std::move(segments);
+    }
+    m_cond.notify_all();
+}
+
+void StreamVerifier::reset() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_generation;
+    }
+    m_cond.notify_all();
+}
+
+int StreamVerifier::descriptor(const QString& path) {
+    // Our own descriptors: the worker closes and renames its files on its
+    // own schedule.
+    auto it = m_fds.find(path);
+    if (it != m_fds.end()) return it.value();
+    int fd = ::open(path.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) m_fds.insert(path, fd);
+    return fd;
+}
+
+bool StreamVerifier::nextWork(Work& work) {
+    if (m_perRange) {
+        // The range furthest behind first, so none of them falls so far
+        // back that its bytes have left the page cache.
+        const Segment* best = nullptr;
+        curl_off_t backlog = 0;
+        for (const auto& s : m_segments) {
+            Cursor& c = m_cursors[s.id];
+            curl_off_t ready = std::min(s.ready, s.length);
+            if (c.hashed > ready) c = Cursor();
+            if (ready - c.hashed > backlog) {
+                best = &s;
+                backlog = ready - c.hashed;
+            }
+        }
+        if (!best) return false;
+        work.id = best->id;
+        work.path = best->path;
+        work.offset = best->fileOffset + m_cursors[best->id].hashed;
+        work.length = (size_t)std::min<curl_off_t>(backlog, kSliceSize);
+        return true;
+    }
+
+    for (const auto& s : m_segments) {
+        if (m_position < s.start || m_position >= s.start + s.length) continue;
+        curl_off_t pending = std::min(s.ready, s.length) - (m_position - s.start);
+        if (pending <= 0) return false;
+        work.id = s.id;
+        work.path = s.path;
+        work.offset = s.fileOffset + (m_position - s.start);
+        work.length = (size_t)std::min<curl_off_t>(pending, kSliceSize);
+        return true;
+    }
+    return false;
+}
+
+void StreamVerifier::run() {
+    std::vector<char> buffer(kSliceSize);
+    quint64 generation = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        if (generation != m_generation) {
+            generation = m_generation;
+            m_cursors.clear();
+            m_position = 0;
+            if (!m_perRange) m_digest.reset(new Digest(m_expected.algorithm));
+        }
+        Work work;
+        if (!m_error.isEmpty() || !nextWork(work)) {
+            m_progress.notify_all();
+            m_cond.wait(lock);
+            continue;
+        }
+        Cursor cursor = m_cursors.value(work.id);
+        lock.unlock();
+
+        QString error;
+        errno = 0;
+        int fd = descriptor(work.path);
+        size_t done = 0;
+        while (fd >= 0 && done < work.length) {
+            ssize_t n = pread(fd, buffer.data() + done, work.length - done, work.offset + (off_t)done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done < work.length) {
+            error = QString("Cannot read back %1: %2").arg(work.path,
+                                                          errno ? QString::fromLocal8Bit(strerror(errno)) : "file too short");
+        } else if (m_perRange) {
+            cursor.crc = Crc32c::extend(cursor.crc, buffer.data(), done);
+        } else {
+            m_digest->addData(buffer.data(), done);
+        }
+
+        lock.lock();
+        if (generation != m_generation) continue; // hashed data that was since replaced
+        if (!error.isEmpty()) {
+            m_error = error;
+            continue;
+        }
+        if (m_perRange) {
+            cursor.hashed += (curl_off_t)done;
+            m_cursors[work.id] = cursor;
+        } else {
+            m_position += (curl_off_t)done;
+        }
+        m_progress.notify_all();
+    }
+}
+
+bool StreamVerifier::complete() const {
+    if (!m_perRange) return m_position >= m_fileSize;
+    curl_off_t covered = 0;
+    for (const auto& s : m_segments) {
+        if (m_cursors.value(s.id).hashed < s.length) return false;
+        covered += s.length;
+    }
+    return covered == m_fileSize;
+}
+
+curl_off_t StreamVerifier::hashedBytes() const {
+    if (!m_perRange) return m_position;
+    curl_off_t hashed = 0;
+    for (const auto& s : m_segments) hashed += std::min(m_cursors.value(s.id).hashed, s.length);
+    return hashed;
+}
+
+bool StreamVerifier::finish(const DownloadManager::Progress& progress, QString& error) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_error.isEmpty() && !complete()) {
+        if (progress && !progress(hashedBytes(), m_fileSize)) return false;
+        m_progress.wait_for(lock, std::chrono::milliseconds(200));
+    }
+    if (!m_error.isEmpty()) {
+        error = m_error;
+        return false;
+    }
+    if (progress) progress(m_fileSize, m_fileSize);
+
+    QByteArray actual;
+    if (m_perRange) {
+        std::vector<Segment> ordered = m_segments;
+        std::sort(ordered.begin(), ordered.end(), [](const Segment& a, const Segment& b) { return a.start < b.start; });
+        quint32 crc = 0;
+        curl_off_t pos = 0;
+        for (const auto& s : ordered) {
+            if (s.start != pos) {
+                error = "Checksum failed: ranges do not cover the file";
+                return false;
+            }
+            crc = Crc32c::combine(crc, m_cursors.value(s.id).crc, (quint64)s.length);
+            pos += s.length;
+        }
+        actual = QByteArray::number(crc, 16).rightJustified(8, '0');
+    } else {
+        actual = m_digest->hexResult();
+    }
+    if (actual != m_expected.hex) {
+        error = QString("Checksum mismatch (%1): expected %2, got %3")
+                .arg(Checksum::algorithmName(m_expected.algorithm), QString::fromLatin1(m_expected.hex),
+                     QString::fromLatin1(actual));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef STREAMVERIFIER_H
+#define STREAMVERIFIER_H
+
+#include <QString>
+#include <QMap>
+#include <curl/curl.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "checksum.h"
+#include "downloadmanager.h"
+
+// Checks a download against its expected checksum while it is still
+// downloading, so finishing does not start with a full read of the file.
+// A thread of its own reads back what the worker reports as written,
+// while it is still in the page cache, and hashes it.
+//
+// SHA and MD5 digests must see the file in order, so they follow the
+// written prefix of the file. CRC32C is computed for every range on its
+// own, as the range fills, and the results are combined at the end.
+class StreamVerifier {
+public:
+    struct Segment {
+        int id;                  // range id
+        curl_off_t start;        // in the target file
+        curl_off_t length;
+        curl_off_t ready;        // prefix of the segment that is on disk
+        QString path;            // file holding it
+        curl_off_t fileOffset;   // where the segment starts in that file
+    };
+
+    StreamVerifier(const Checksum& expected, curl_off_t fileSize);
+    ~StreamVerifier();
+
+    // The current ranges and their written prefixes.
+    void update(std::vector<Segment> segments);
+    // Everything hashed so far was overwritten; start from scratch.
+    void reset();
+    // Hashes what is left of the last update, which must cover the whole
+    // file, and compares. Blocks; progress as in DownloadManager, and
+    // returning false from it gives up with an empty `error`.
+    bool finish(const DownloadManager::Progress& progress, QString& error);
+
+    // Bytes read back per step.
+    static constexpr size_t kSliceSize = 1024 * 1024;
+
+private:
+    struct Cursor {
+        curl_off_t hashed = 0;
+        quint32 crc = 0;
+    };
+    struct Work {
+        int id = -1;
+        QString path;
+        curl_off_t offset = 0;
+        size_t length = 0;
+    };
+
+    void run();
+    bool nextWork(Work& work);     // with m_mutex held
+    bool complete() const;         // with m_mutex held
+    curl_off_t hashedBytes() const;
+    int descriptor(const QString& path);
+
+    const Checksum m_expected;
+    const curl_off_t m_fileSize;
+    const bool m_perRange;         // CRC32C: ranges hashed independently
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;      // new segments, reset or stop
+    std::condition_variable m_progress;  // a slice was hashed
+    std::vector<Segment> m_segments;
+    QMap<int, Cursor> m_cursors;         // per range, CRC32C only
+    curl_off_t m_position;               // ordered digests: hashed prefix
+    std::unique_ptr<Digest> m_digest;
+    quint64 m_generation;                // bumped by reset()
+    QString m_error;
+    bool m_stop;
+
+    QMap<QString, int> m_fds;            // the thread's own read descriptors
+    std::thread m_thread;
+};
+
+#endif
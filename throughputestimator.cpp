@@ -0,0 +1,49 @@
+#include "throughputestimator.h"
+#include <cmath>
+
+namespace {
+// Intervals shorter than this say more about timer jitter than the link.
+constexpr double kMinInterval = 0.05;
+}
+
+ThroughputEstimator::ThroughputEstimator(double halfLifeSeconds)
+    : m_halfLife(halfLifeSeconds), m_started(false), m_valid(false), m_lastTotal(0), m_rate(0), m_variance(0)
+{
+}
+
+void ThroughputEstimator::reset() {
+    m_started = false;
+    m_valid = false;
+    m_rate = 0;
+    m_variance = 0;
+}
+
+void ThroughputEstimator::addSample(qint64 total, std::chrono::steady_clock::time_point now) {
+    if (!m_started || total < m_lastTotal) {
+        m_started = true;
+        m_lastTotal = total;
+        m_lastTime = now;
+        return;
+    }
+    double dt = std::chrono::duration<double>(now - m_lastTime).count();
+    if (dt < kMinInterval) return;
+
+    double sample = (total - m_lastTotal) / dt;
+    m_lastTotal = total;
+    m_lastTime = now;
+    if (!m_valid) {
+        m_rate = sample;
+        m_variance = 0;
+        m_valid = true;
+        return;
+    }
+    // Weight for an interval of dt: a sample's influence halves every half-life.
+    double alpha = 1.0 - std::exp(-dt * std::log(2.0) / m_halfLife);
+    double diff = sample - m_rate;
+    m_rate += alpha * diff;
+    m_variance = (1.0 - alpha) * (m_variance + alpha * diff * diff);
+}
+
+double ThroughputEstimator::deviation() const {
+    return std::sqrt(m_variance);
+}
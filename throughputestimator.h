@@ -0,0 +1,41 @@
+#ifndef THROUGHPUTESTIMATOR_H
+#define THROUGHPUTESTIMATOR_H
+
+#include <QtGlobal>
+#include <chrono>
+
+// Throughput as an exponentially weighted moving average over time: a
+// sample counts half as much after every half-life, however often samples
+// arrive. It follows a stall or a new speed limit within a few half-lives,
+// where an average since the start would take as long again as the
+// transfer has run so far.
+//
+// Alongside the rate it keeps the weighted variance of the per-interval
+// rates, which gives estimates built on it a confidence band.
+class ThroughputEstimator {
+public:
+    static constexpr double kDefaultHalfLife = 2.0; // seconds
+
+    explicit ThroughputEstimator(double halfLifeSeconds = kDefaultHalfLife);
+
+    // `total` bytes transferred so far. The first sample only sets the
+    // baseline; a total that went down (bytes to be fetched again) sets a
+    // new one.
+    void addSample(qint64 total, std::chrono::steady_clock::time_point now);
+    void reset();
+
+    bool isValid() const { return m_valid; } // at least one interval measured
+    double rate() const { return m_rate; }   // bytes/sec
+    double deviation() const;                // of the rate, bytes/sec
+
+private:
+    double m_halfLife;
+    bool m_started;
+    bool m_valid;
+    qint64 m_lastTotal;
+    std::chrono::steady_clock::time_point m_lastTime;
+    double m_rate;
+    double m_variance;
+};
+
+#endif
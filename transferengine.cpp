@@ -0,0 +1,230 @@
+#include "transferengine.h"
+#include <QSocketNotifier>
+#include <QThread>
+#include <QLoggingCategory>
+#include <mutex>
+#include <time.h>
+
+// Off by default; QT_LOGGING_RULES="parafetch.transfer.debug=true" turns it on.
+Q_LOGGING_CATEGORY(lcTransfer, "parafetch.transfer", QtWarningMsg)
+
+namespace {
+thread_local TransferEngine* t_engine = nullptr;
+
+// Connections themselves stay in each engine's multi handle: curl does not
+// support sharing a connection pool between threads. Workers for the same
+// host are kept on one thread by the scheduler instead.
+CURLSH* g_share = nullptr;
+std::mutex g_shareLocks[CURL_LOCK_DATA_LAST];
+
+// Per-socket state handed to curl via curl_multi_assign().
+struct SocketWatch {
+    QSocketNotifier* read = nullptr;
+    QSocketNotifier* write = nullptr;
+};
+
+void dropNotifier(QSocketNotifier*& n) {
+    if (!n) return;
+    n->setEnabled(false);
+    n->deleteLater();
+    n = nullptr;
+}
+}
+
+TransferEngine* TransferEngine::forCurrentThread() {
+    if (!t_engine) {
+        t_engine = new TransferEngine();
+        connect(QThread::currentThread(), &QThread::finished, t_engine, &QObject::deleteLater);
+    }
+    return t_engine;
+}
+
+void TransferEngine::initGlobal() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    g_share = curl_share_init();
+    curl_share_setopt(g_share, CURLSHOPT_LOCKFUNC, lockShare);
+    curl_share_setopt(g_share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+    curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+void TransferEngine::cleanupGlobal() {
+    if (g_share) curl_share_cleanup(g_share);
+    g_share = nullptr;
+    curl_global_cleanup();
+}
+
+void TransferEngine::lockShare(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    g_shareLocks[data].lock();
+}
+
+void TransferEngine::unlockShare(CURL*, curl_lock_data data, void*) {
+    g_shareLocks[data].unlock();
+}
+
+TransferEngine::TransferEngine(QObject *parent)
+    : QObject(parent), m_multiHandle(curl_multi_init()), m_busy(false),
+      m_phaseCpuStart(threadCpuSeconds()), m_phaseWallStart(std::chrono::steady_clock::now())
+{
+    m_timeoutTimer = new QTimer(this);
+    m_timeoutTimer->setSingleShot(true);
+    connect(m_timeoutTimer, &QTimer::timeout, this, &TransferEngine::onTimeout);
+
+    curl_multi_setopt(m_multiHandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(m_multiHandle, CURLMOPT_SOCKETFUNCTION, socketCallback);
+    curl_multi_setopt(m_multiHandle, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(m_multiHandle, CURLMOPT_TIMERFUNCTION, timerCallback);
+    curl_multi_setopt(m_multiHandle, CURLMOPT_TIMERDATA, this);
+}
+
+TransferEngine::~TransferEngine() {
+    for (auto it = m_clients.begin(); it != m_clients.end(); ++it)
+        curl_multi_remove_handle(m_multiHandle, it.key());
+    m_clients.clear();
+    curl_multi_cleanup(m_multiHandle);
+    if (t_engine == this) t_engine = nullptr;
+}
+
+bool TransferEngine::addHandle(CURL* handle, Client* client) {
+    if (g_share) curl_easy_setopt(handle, CURLOPT_SHARE, g_share);
+    if (curl_multi_add_handle(m_multiHandle, handle) != CURLM_OK) return false;
+    m_clients.insert(handle, client);
+    if (!m_busy) markBusy();
+    // curl arms the timer from add_handle; the first socket_action kicks it off.
+    return true;
+}
+
+void TransferEngine::removeHandle(CURL* handle) {
+    if (!m_clients.contains(handle)) return;
+    accountHandle(handle);
+    curl_multi_remove_handle(m_multiHandle, handle);
+    m_clients.remove(handle);
+    if (m_clients.isEmpty() && m_busy) markIdle();
+}
+
+TransferEngine::Stats TransferEngine::stats() const {
+    Stats s = m_stats;
+    double cpu = threadCpuSeconds() - m_phaseCpuStart;
+    if (m_busy) s.busyCpuSeconds += cpu;
+    else {
+        s.idleCpuSeconds += cpu;
+        s.idleWallSeconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - m_phaseWallStart).count();
+    }
+    return s;
+}
+
+int TransferEngine::socketCallback(CURL*, curl_socket_t s, int what, void* userp, void* socketp) {
+    static_cast<TransferEngine*>(userp)->watchSocket(s, what, socketp);
+    return 0;
+}
+
+int TransferEngine::timerCallback(CURLM*, long timeoutMs, void* userp) {
+    TransferEngine* self = static_cast<TransferEngine*>(userp);
+    if (timeoutMs < 0) self->m_timeoutTimer->stop();
+    else self->m_timeoutTimer->start((int)timeoutMs);
+    return 0;
+}
+
+void TransferEngine::watchSocket(curl_socket_t s, int what, void* socketp) {
+    SocketWatch* watch = static_cast<SocketWatch*>(socketp);
+
+    if (what == CURL_POLL_REMOVE) {
+        if (watch) {
+            dropNotifier(watch->read);
+            dropNotifier(watch->write);
+            delete watch;
+            curl_multi_assign(m_multiHandle, s, nullptr);
+        }
+        return;
+    }
+
+    if (!watch) {
+        watch = new SocketWatch();
+        curl_multi_assign(m_multiHandle, s, watch);
+    }
+
+    bool wantRead = (what == CURL_POLL_IN || what == CURL_POLL_INOUT);
+    bool wantWrite = (what == CURL_POLL_OUT || what == CURL_POLL_INOUT);
+
+    if (wantRead && !watch->read) {
+        watch->read = new QSocketNotifier(s, QSocketNotifier::Read, this);
+        connect(watch->read, &QSocketNotifier::activated, this, [this, s]() {
+            socketAction(s, CURL_CSELECT_IN);
+        });
+    } else if (!wantRead) {
+        dropNotifier(watch->read);
+    }
+
+    if (wantWrite && !watch->write) {
+        watch->write = new QSocketNotifier(s, QSocketNotifier::Write, this);
+        connect(watch->write, &QSocketNotifier::activated, this, [this, s]() {
+            socketAction(s, CURL_CSELECT_OUT);
+        });
+    } else if (!wantWrite) {
+        dropNotifier(watch->write);
+    }
+}
+
+void TransferEngine::socketAction(curl_socket_t s, int evBitmask) {
+    ++m_stats.wakeups;
+    int running = 0;
+    curl_multi_socket_action(m_multiHandle, s, evBitmask, &running);
+    checkMultiInfo();
+}
+
+void TransferEngine::onTimeout() {
+    socketAction(CURL_SOCKET_TIMEOUT, 0);
+}
+
+void TransferEngine::checkMultiInfo() {
+    int msgsLeft;
+    CURLMsg* msg;
+    while ((msg = curl_multi_info_read(m_multiHandle, &msgsLeft))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        CURL* handle = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        Client* client = m_clients.value(handle, nullptr);
+        // The client owns the easy handle; it removes (and usually frees) it.
+        if (client) client->transferDone(handle, result);
+        else removeHandle(handle);
+    }
+}
+
+void TransferEngine::accountHandle(CURL* handle) {
+    curl_off_t received = 0;
+    if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &received) == CURLE_OK)
+        m_stats.bytesReceived += received;
+}
+
+void TransferEngine::markBusy() {
+    double now = threadCpuSeconds();
+    m_stats.idleCpuSeconds += now - m_phaseCpuStart;
+    m_stats.idleWallSeconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - m_phaseWallStart).count();
+    m_phaseCpuStart = now;
+    m_busy = true;
+}
+
+void TransferEngine::markIdle() {
+    double now = threadCpuSeconds();
+    double cpu = now - m_phaseCpuStart;
+    m_stats.busyCpuSeconds += cpu;
+    m_phaseCpuStart = now;
+    m_phaseWallStart = std::chrono::steady_clock::now();
+    m_busy = false;
+
+    if (lcTransfer().isDebugEnabled()) {
+        Stats s = stats();
+        double gb = s.bytesReceived / (1024.0 * 1024.0 * 1024.0);
+        qCDebug(lcTransfer) << "idle:" << s.bytesReceived << "bytes in" << s.busyCpuSeconds << "s CPU ("
+                            << (gb > 0 ? s.busyCpuSeconds / gb : 0.0) << "s/GB)," << s.idleCpuSeconds
+                            << "s CPU over" << s.idleWallSeconds << "s idle," << s.wakeups << "wakeups";
+    }
+}
+
+double TransferEngine::threadCpuSeconds() {
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
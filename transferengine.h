@@ -0,0 +1,79 @@
+#ifndef TRANSFERENGINE_H
+#define TRANSFERENGINE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMap>
+#include <curl/curl.h>
+#include <chrono>
+
+// Event-driven driver for a curl multi handle. Sockets are watched with
+// QSocketNotifier and curl's timeout with a single-shot QTimer, so the
+// owning thread only wakes up when a socket has data or curl asks for it.
+// There is one engine per network thread; every worker living on that
+// thread shares it.
+class TransferEngine : public QObject {
+    Q_OBJECT
+public:
+    // Receives completion notices for easy handles added through the engine.
+    class Client {
+    public:
+        virtual ~Client() = default;
+        virtual void transferDone(CURL* handle, CURLcode result) = 0;
+    };
+
+    struct Stats {
+        qint64 bytesReceived = 0;
+        double busyCpuSeconds = 0;   // thread CPU while transfers were running
+        double idleCpuSeconds = 0;   // thread CPU while nothing was running
+        double idleWallSeconds = 0;
+        quint64 wakeups = 0;         // socket + timer activations
+    };
+
+    static TransferEngine* forCurrentThread();
+    ~TransferEngine();
+
+    // Process-wide curl state, set up once in main() before any network
+    // thread starts: curl_global_init() and the share handle through which
+    // every engine reuses DNS lookups and TLS sessions.
+    static void initGlobal();
+    static void cleanupGlobal();
+
+    bool addHandle(CURL* handle, Client* client);
+    void removeHandle(CURL* handle);
+    int activeHandles() const { return m_clients.size(); }
+
+    // Totals for this engine's thread. Logged each time it falls idle under
+    // the parafetch.transfer debug category.
+    Stats stats() const;
+
+private slots:
+    void onTimeout();
+
+private:
+    explicit TransferEngine(QObject *parent = nullptr);
+
+    static int socketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+    static int timerCallback(CURLM* multi, long timeoutMs, void* userp);
+
+    void watchSocket(curl_socket_t s, int what, void* socketp);
+    void socketAction(curl_socket_t s, int evBitmask);
+    void checkMultiInfo();
+    void accountHandle(CURL* handle);
+    void markBusy();
+    void markIdle();
+    static double threadCpuSeconds();
+    static void lockShare(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp);
+    static void unlockShare(CURL* handle, curl_lock_data data, void* userp);
+
+    CURLM* m_multiHandle;
+    QTimer* m_timeoutTimer;
+    QMap<CURL*, Client*> m_clients;
+
+    Stats m_stats;
+    bool m_busy;
+    double m_phaseCpuStart;
+    std::chrono::steady_clock::time_point m_phaseWallStart;
+};
+
+#endif
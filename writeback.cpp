@@ -0,0 +1,106 @@
+#include "writeback.h"
+#include "outputfile.h"
+#include <algorithm>
+#include <fcntl.h>
+
+Writeback& Writeback::instance() {
+    static Writeback writeback;
+    return writeback;
+}
+
+Writeback::Writeback()
+    : m_dirtyBytes(0), m_budget(64LL * 1024 * 1024), m_busy(nullptr), m_stop(false)
+{
+}
+
+Writeback::~Writeback() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+}
+
+void Writeback::setBudget(qint64 bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = std::max<qint64>(0, bytes);
+    if (m_budget == 0) {
+        m_queue.clear();
+        m_dirty.clear();
+        m_dirtyBytes = 0;
+    }
+    m_cond.notify_all();
+}
+
+void Writeback::add(OutputFile* file, curl_off_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_budget == 0 || m_stop) return;
+    if (!m_thread.joinable()) m_thread = std::thread([this]() { run(); });
+    m_queue.push_back({file, offset, length});
+    m_cond.notify_all();
+}
+
+void Writeback::forget(OutputFile* file) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    drop(file);
+    m_cond.wait(lock, [this, file]() { return m_busy != file; });
+    // The thread files the region it was busy with as dirty before it lets
+    // go of the lock; that one must not outlive the file either.
+    drop(file);
+}
+
+void Writeback::drop(OutputFile* file) {
+    auto ofFile = [file](const Region& r) { return r.file == file; };
+    m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(), ofFile), m_queue.end());
+    for (const auto& r : m_dirty) if (r.file == file) m_dirtyBytes -= r.length;
+    m_dirty.erase(std::remove_if(m_dirty.begin(), m_dirty.end(), ofFile), m_dirty.end());
+}
+
+void Writeback::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_cond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+        if (m_stop) return;
+
+        // Start writeback of the new region without waiting for it.
+        Region r = m_queue.front();
+        m_queue.pop_front();
+        m_busy = r.file;
+        int fd = r.file->fd();
+        lock.unlock();
+#ifdef __linux__
+        if (fd >= 0) sync_file_range(fd, r.offset, r.length, SYNC_FILE_RANGE_WRITE);
+#endif
+        lock.lock();
+        m_busy = nullptr;
+        m_cond.notify_all();
+        if (m_budget == 0) continue;
+        m_dirty.push_back(r);
+        m_dirtyBytes += r.length;
+
+        // Over budget: wait for the oldest regions to reach the disk, then
+        // let the kernel drop them, unless a verifier is yet to hash them.
+        // Clean pages cost nothing to reclaim, while dropping them would
+        // make it read the file from disk a second time.
+        while (m_dirtyBytes > m_budget && !m_dirty.empty() && !m_stop) {
+            Region old = m_dirty.front();
+            m_dirty.pop_front();
+            m_dirtyBytes -= old.length;
+            m_busy = old.file;
+            fd = old.file->fd();
+            bool drop = !old.file->keepCached();
+            lock.unlock();
+            if (fd >= 0) {
+#ifdef __linux__
+                sync_file_range(fd, old.offset, old.length,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+                if (drop) posix_fadvise(fd, old.offset, old.length, POSIX_FADV_DONTNEED);
+            }
+            lock.lock();
+            m_busy = nullptr;
+            m_cond.notify_all();
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <QtGlobal>
+#include <curl/curl.h>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+class OutputFile;
+
+// Keeps long downloads from filling the page cache with dirty pages. Left
+// alone, the kernel lets gigabytes pile up and then throttles every writer
+// at once, which shows as the speed dropping to zero every so often.
+// Instead, writeback of each completed write is started right away with
+// sync_file_range(), and once more than the budget is in flight the oldest
+// regions are waited for and dropped from the cache with posix_fadvise(),
+// unless a verifier still has to read them (OutputFile::keepCached()).
+// Runs on its own thread, as the waits block.
+class Writeback {
+public:
+    static Writeback& instance();
+
+    // Bytes allowed to be dirty or under writeback; 0 leaves it all to the
+    // kernel.
+    void setBudget(qint64 bytes);
+    // A write to the file's regular descriptor completed.
+    void add(OutputFile* file, curl_off_t offset, size_t length);
+    // Drops everything queued for the file and waits until the writeback
+    // thread is done with it. OutputFile calls it before closing.
+    void forget(OutputFile* file);
+
+private:
+    struct Region {
+        OutputFile* file;
+        curl_off_t offset;
+        size_t length;
+    };
+
+    Writeback();
+    ~Writeback();
+    void run();
+    void drop(OutputFile* file); // its regions, with m_mutex held
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<Region> m_queue;  // written, writeback not started yet
+    std::deque<Region> m_dirty;  // writeback started, oldest first
+    qint64 m_dirtyBytes;
+    qint64 m_budget;
+    OutputFile* m_busy;          // file the thread is making calls on
+    bool m_stop;
+    std::thread m_thread;
+};
+
+#endif